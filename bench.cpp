@@ -0,0 +1,355 @@
+// ============================================================
+// bench.cpp — Interpreter microbenchmarks
+// ============================================================
+// Builds the editor's modules without its main() and times the
+// interpreter's hot paths with no window: expression evaluation,
+// scripts run by ExecuteScripts, and the undo log. Results are
+// written as JSON; given a baseline (bench_baseline.json is kept
+// in the repo) every benchmark is compared against it.
+//
+//   g++ -O2 -std=c++14 bench.cpp tinyfiledialogs.c -o scratch_bench \
+//       -lSDL2 -lSDL2_image -lSDL2_mixer -lSDL2_ttf -lSDL2_gfx -pthread
+//   ./scratch_bench [--out results.json] [--baseline bench_baseline.json]
+//                   [--threshold PCT] [--filter TEXT] [--round-ms MS]
+//
+// Exit code: 0 ok, 1 a benchmark is slower than the baseline by more
+// than the threshold, 2 bad arguments or unreadable baseline.
+// ============================================================
+#define SCRATCH_NO_MAIN
+#include "main.cpp"
+
+// ==================== HARNESS ====================
+// A benchmark gets a fresh engine: it runs on a thread of its own (see
+// the thread_local note at the top of main.cpp). setup() builds the
+// project, untimed; run(n) does about n operations and returns how many.
+// run is first scaled until one call takes the round time, then timed
+// BENCH_ROUNDS times; the fastest round is reported.
+
+struct Benchmark {
+    const char* name;
+    const char* unit;                // what one operation is
+    void (*setup)();
+    long long (*run)(long long n);
+};
+
+struct BenchResult {
+    string name, unit;
+    double nsPerOp = 0;
+    long long ops = 0;
+};
+
+const int BENCH_ROUNDS = 5;
+double benchRoundMs = 50;
+volatile float benchSink;           // keeps expression results alive
+
+void RunBenchmark(const Benchmark& bm, BenchResult& result) {
+    headlessMode = true;
+    keepHistory = false;
+    turboMode = true;   // scripts run flat out instead of one loop pass per frame
+    seedScriptRand(1);
+    CreateDefaultProject(nullptr);
+    bm.setup();
+
+    auto timeRun = [&](long long n, long long& ops) {
+        auto t0 = chrono::steady_clock::now();
+        ops = bm.run(n);
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+    };
+    long long n = 1, ops = 0;
+    for (;;) {
+        double ms = timeRun(n, ops);
+        if (ms >= benchRoundMs || n >= (1LL << 40)) break;
+        n = ms < 1 ? n * 16 : (long long)(n * benchRoundMs / ms * 1.1) + 1;
+    }
+    result.name = bm.name;
+    result.unit = bm.unit;
+    result.nsPerOp = 1e300;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        double ms = timeRun(n, ops);
+        if (ops > 0) result.nsPerOp = min(result.nsPerOp, ms * 1e6 / ops);
+        result.ops = ops;
+    }
+    closeHistoryFile();   // and removes it
+    ReleaseEngine();
+}
+
+// ==================== PROJECT HELPERS ====================
+
+int benchStackX = 320;
+
+BlockRef BenchBlock(BlockType type, int value = 0, const string& str = "") {
+    auto b = NewBlock();
+    b->type = type;
+    b->category = CAT_CONTROL;
+    b->color = getCategoryColor(CAT_CONTROL);
+    b->value = value;
+    b->strValue = str;
+    b->label = str;
+    b->baseLabel = str;
+    b->inPalette = false;
+    b->owner = 0;
+    PlateAppend(b);
+    return b;
+}
+
+// Links the blocks into one stack, laid out top to bottom
+void BenchStack(const vector<BlockRef>& blocks) {
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i]->rect = { benchStackX, 100 + (int)i * (BLOCK_HEIGHT + GAP), 200, BLOCK_HEIGHT };
+        if (i + 1 < blocks.size()) { blocks[i]->next = blocks[i + 1]; blocks[i + 1]->prev = blocks[i]; }
+    }
+    benchStackX += 210;
+}
+
+// Clicks the green flag until n blocks ran
+long long RunFlagScripts(long long n) {
+    long long start = blocksExecuted;
+    scriptsRunning = true;
+    while (blocksExecuted - start < n) {
+        startScriptsForHat(BLOCK_WHEN_FLAG, "");
+        while (AnyScriptsQueued()) ExecuteScripts(nullptr);
+    }
+    return blocksExecuted - start;
+}
+
+// ==================== EXPRESSIONS ====================
+
+void SetupExprVars() {
+    const char* names[] = { "a", "b", "c", "d", "x", "y" };
+    for (int i = 0; i < 6; i++) {
+        defineVariable(names[i]);
+        variables[findVariable(names[i])].value = i + 3;
+    }
+}
+
+long long RunCompileEval(long long n) {
+    for (long long i = 0; i < n; i++) benchSink = evalExpr("(a+b)*(c-d)/2+a%3");
+    return n;
+}
+
+long long RunCompiled(const char* src, long long n) {
+    CompiledExpr ce;
+    CompileExpr(src, ce);
+    BindExprSlots(ce);
+    float sum = 0;
+    for (long long i = 0; i < n; i++) sum += RunExpr(ce);
+    benchSink = sum;
+    return n;
+}
+long long RunArith(long long n) { return RunCompiled("x*2+y-3*(a+b)/c", n); }
+long long RunLogic(long long n) { return RunCompiled("a<b & not (c=d) | x>10", n); }
+
+// ==================== SCRIPTS ====================
+
+// flag -> repeat 1000 { change n by 1 }
+void SetupRepeatLoop() {
+    defineVariable("n");
+    BenchStack({ BenchBlock(BLOCK_WHEN_FLAG), BenchBlock(BLOCK_REPEAT, 1000),
+                 BenchBlock(BLOCK_CHANGE_VAR, 0, "n=1"), BenchBlock(BLOCK_END) });
+    RebuildHatIndex();
+}
+
+// flag -> repeat 500 { change i by 1; if i%2<1 { if i%4<2 { change a by 1 } else { change b by 1 } } else { change c by 1 } }
+void SetupNestedIf() {
+    for (const char* v : { "i", "a", "b", "c" }) defineVariable(v);
+    BenchStack({ BenchBlock(BLOCK_WHEN_FLAG), BenchBlock(BLOCK_REPEAT, 500),
+                 BenchBlock(BLOCK_CHANGE_VAR, 0, "i=1"),
+                 BenchBlock(BLOCK_LESS_THAN, 0, "i%2<1"), BenchBlock(BLOCK_IF_ELSE),
+                     BenchBlock(BLOCK_LESS_THAN, 0, "i%4<2"), BenchBlock(BLOCK_IF_ELSE),
+                         BenchBlock(BLOCK_CHANGE_VAR, 0, "a=1"),
+                     BenchBlock(BLOCK_END),
+                         BenchBlock(BLOCK_CHANGE_VAR, 0, "b=1"),
+                     BenchBlock(BLOCK_END),
+                 BenchBlock(BLOCK_END),
+                     BenchBlock(BLOCK_CHANGE_VAR, 0, "c=1"),
+                 BenchBlock(BLOCK_END),
+                 BenchBlock(BLOCK_END) });
+    RebuildHatIndex();
+}
+
+// flag -> repeat 100 { broadcast tick }, with 50 "when I receive tick -> change n by 1"
+void SetupBroadcastStorm() {
+    defineVariable("n");
+    BenchStack({ BenchBlock(BLOCK_WHEN_FLAG), BenchBlock(BLOCK_REPEAT, 100),
+                 BenchBlock(BLOCK_BROADCAST, 0, "tick"), BenchBlock(BLOCK_END) });
+    for (int i = 0; i < 50; i++)
+        BenchStack({ BenchBlock(BLOCK_WHEN_RECEIVE, 0, "tick"), BenchBlock(BLOCK_CHANGE_VAR, 0, "n=1") });
+    RebuildHatIndex();
+}
+
+// flag -> repeat 200 { 16 sets / changes over 64 variables }
+void SetupVariableHeavy() {
+    for (int i = 0; i < 64; i++) defineVariable("v" + to_string(i));
+    vector<BlockRef> stack = { BenchBlock(BLOCK_WHEN_FLAG), BenchBlock(BLOCK_REPEAT, 200) };
+    for (int i = 0; i < 16; i++) {
+        string a = "v" + to_string(i * 4), b = "v" + to_string(i * 4 + 1), c = "v" + to_string((i * 4 + 7) % 64);
+        if (i % 2 == 0) stack.push_back(BenchBlock(BLOCK_SET_VAR, 0, a + "=" + b + "+" + c + "%7"));
+        else stack.push_back(BenchBlock(BLOCK_CHANGE_VAR, 0, a + "=" + c + "*2-" + b));
+    }
+    stack.push_back(BenchBlock(BLOCK_END));
+    BenchStack(stack);
+    RebuildHatIndex();
+}
+
+// ==================== UNDO ====================
+// 200 stacks of 10 blocks; each operation moves one stack and records it
+
+void SetupUndoProject() {
+    keepHistory = true;
+    projectPath = "scratch_bench.tmp";   // the history file goes next to it
+    for (int s = 0; s < 200; s++) {
+        vector<BlockRef> stack;
+        for (int i = 0; i < 10; i++) stack.push_back(BenchBlock(BLOCK_MOVE_STEPS, i, "move"));
+        BenchStack(stack);
+    }
+    RebuildHatIndex();
+    pushState("Start");
+}
+
+void MoveStack(long long i) {
+    BlockRef top = scriptBlocks[(i % 200) * 10];
+    int dx = (i / 200) % 2 ? -5 : 5;
+    for (BlockRef b = top; b; b = b->next) {
+        NoteBlockEdited(b);
+        b->rect.x += dx;
+    }
+}
+
+long long RunPushState(long long n) {
+    for (long long i = 0; i < n; i++) {
+        MoveStack(i);
+        pushState("Move");
+    }
+    return n;
+}
+
+// Undo / redo one entry at a time, near the end of a 200 entry history
+void SetupRestore() {
+    SetupUndoProject();
+    RunPushState(200);
+}
+
+long long RunRestoreStep(long long n) {
+    int last = undoCount - 1;
+    for (long long i = 0; i < n; i++) restoreState(i % 2 ? last : last - 1, nullptr);
+    return n;
+}
+
+// Jumps between the ends of the history (checkpoints bound the walk)
+long long RunRestoreFar(long long n) {
+    int last = undoCount - 1;
+    for (long long i = 0; i < n; i++) restoreState(i % 2 ? last : 0, nullptr);
+    return n;
+}
+
+const Benchmark benchmarks[] = {
+    { "expr/compile_eval",       "eval",    SetupExprVars,       RunCompileEval },
+    { "expr/run_arith",          "eval",    SetupExprVars,       RunArith },
+    { "expr/run_logic",          "eval",    SetupExprVars,       RunLogic },
+    { "scripts/repeat_loop",     "block",   SetupRepeatLoop,     RunFlagScripts },
+    { "scripts/nested_if_else",  "block",   SetupNestedIf,       RunFlagScripts },
+    { "scripts/broadcast_storm", "block",   SetupBroadcastStorm, RunFlagScripts },
+    { "scripts/variable_heavy",  "block",   SetupVariableHeavy,  RunFlagScripts },
+    { "undo/push_state",         "push",    SetupUndoProject,    RunPushState },
+    { "undo/restore_step",       "restore", SetupRestore,        RunRestoreStep },
+    { "undo/restore_far",        "restore", SetupRestore,        RunRestoreFar },
+};
+
+// ==================== RESULTS ====================
+
+void WriteBenchResults(ostream& out, const vector<BenchResult>& results) {
+    out << "{\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << "    {\"name\": " << jsonString(r.name) << ", \"unit\": " << jsonString(r.unit)
+            << ", \"ns_per_op\": " << jsonNumber(r.nsPerOp) << ", \"ops\": " << r.ops << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// Reads the name -> ns_per_op pairs back from a results file (one
+// benchmark per line, as WriteBenchResults puts them)
+bool ReadBenchBaseline(const string& path, map<string, double>& baseline) {
+    ifstream file(path);
+    if (!file.is_open()) return false;
+    string line;
+    while (getline(file, line)) {
+        size_t n = line.find("\"name\": \""), t = line.find("\"ns_per_op\": ");
+        if (n == string::npos || t == string::npos) continue;
+        n += 9;
+        size_t end = line.find('"', n);
+        if (end == string::npos) continue;
+        baseline[line.substr(n, end - n)] = atof(line.c_str() + t + 13);
+    }
+    return true;
+}
+
+// Prints the results next to the baseline; returns the number of regressions
+int ReportBenchResults(const vector<BenchResult>& results, const map<string, double>& baseline, double thresholdPct) {
+    bool compare = !baseline.empty();
+    if (compare) printf("%-26s %14s %14s %9s\n", "benchmark", "baseline ns", "ns/op", "change");
+    else printf("%-26s %14s\n", "benchmark", "ns/op");
+    int regressions = 0;
+    for (auto& r : results) {
+        auto it = baseline.find(r.name);
+        if (!compare) {
+            printf("%-26s %14.2f  per %s\n", r.name.c_str(), r.nsPerOp, r.unit.c_str());
+            continue;
+        }
+        if (it == baseline.end() || it->second <= 0) {
+            printf("%-26s %14s %14.2f %9s\n", r.name.c_str(), "-", r.nsPerOp, "new");
+            continue;
+        }
+        double change = (r.nsPerOp / it->second - 1) * 100;
+        const char* verdict = "";
+        if (change > thresholdPct) { verdict = "  REGRESSION"; regressions++; }
+        else if (change < -thresholdPct) verdict = "  faster";
+        printf("%-26s %14.2f %14.2f %+8.1f%%%s\n", r.name.c_str(), it->second, r.nsPerOp, change, verdict);
+    }
+    if (compare)
+        printf("%d regression%s over %.0f%%\n", regressions, regressions == 1 ? "" : "s", thresholdPct);
+    return regressions;
+}
+
+// ==================== MAIN ====================
+int main(int argc, char* argv[]) {
+    const char* usage = "usage: scratch_bench [--out results.json] [--baseline file.json] [--threshold PCT] [--filter TEXT] [--round-ms MS]\n";
+    string outPath, baselinePath, filter;
+    double thresholdPct = 10;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        if (a == "--out" && i + 1 < argc) outPath = argv[++i];
+        else if (a == "--baseline" && i + 1 < argc) baselinePath = argv[++i];
+        else if (a == "--threshold" && i + 1 < argc) thresholdPct = atof(argv[++i]);
+        else if (a == "--filter" && i + 1 < argc) filter = argv[++i];
+        else if (a == "--round-ms" && i + 1 < argc) benchRoundMs = atof(argv[++i]);
+        else { fprintf(stderr, "%s", usage); return 2; }
+    }
+    if (benchRoundMs <= 0 || thresholdPct < 0) { fprintf(stderr, "%s", usage); return 2; }
+
+    map<string, double> baseline;
+    if (!baselinePath.empty() && !ReadBenchBaseline(baselinePath, baseline)) {
+        fprintf(stderr, "Cannot read baseline %s\n", baselinePath.c_str());
+        return 2;
+    }
+    if (SDL_Init(SDL_INIT_TIMER) < 0)
+        fprintf(stderr, "Error initializing SDL timer: %s\n", SDL_GetError());
+
+    vector<BenchResult> results;
+    for (const Benchmark& bm : benchmarks) {
+        if (!filter.empty() && string(bm.name).find(filter) == string::npos) continue;
+        results.push_back(BenchResult());
+        thread t(RunBenchmark, cref(bm), ref(results.back()));
+        t.join();
+    }
+
+    if (!outPath.empty()) {
+        ofstream out(outPath);
+        if (!out) { fprintf(stderr, "Cannot write %s\n", outPath.c_str()); SDL_Quit(); return 2; }
+        WriteBenchResults(out, results);
+    }
+    int regressions = ReportBenchResults(results, baseline, thresholdPct);
+    SDL_Quit();
+    return regressions > 0 ? 1 : 0;
+}
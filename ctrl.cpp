@@ -1,347 +1,982 @@
-int EvaluateCondition(shared_ptr<Block> condBlock, Sprite& sprite) {
+int EvaluateCondition(BlockRef condBlock, Sprite& sprite) {
     if (!condBlock) return lastOperatorResult;
     switch (condBlock->type) {
-        case BLOCK_KEY_PRESSED: {
-            const Uint8* keys = SDL_GetKeyboardState(NULL);
-            for (int i = 0; i < 5; i++) {
-                if (condBlock->strValue == keyNames[i])
-                    return keys[keyScancodes[i]] ? 1 : 0;
-            }
-            return 0;
+        case BLOCK_KEY_PRESSED:
+        case BLOCK_MOUSE_DOWN: {
+            // input sampled once per frame by PollInputSources
+            int src = InputSourceOf(*condBlock);
+            return (src != -1 && inputState[src]) ? 1 : 0;
         }
-        case BLOCK_MOUSE_DOWN:
-            return (SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) ? 1 : 0;
         case BLOCK_TOUCHING: {
-            return 0;
+            // "touching {}?": mouse-pointer, edge or a sprite name
+            const string& target = condBlock->strValue;
+            if (target.empty() || target == "mouse-pointer")
+                return SpriteTouchingPoint(sprite, MOUUSE_X, MOUUSE_Y) ? 1 : 0;
+            if (target == "edge") return SpriteTouchingEdge(sprite) ? 1 : 0;
+            return SpriteTouchingSprite(sprite, target) ? 1 : 0;
         }
+        case BLOCK_TOUCHING_COLOR:
+            // value holds the colour as 0xRRGGBB, like "set pen color to"
+            return SpriteTouchingColor(sprite, (Uint32)condBlock->value & 0xFFFFFF) ? 1 : 0;
         case BLOCK_LESS_THAN:
-            return (condBlock->value < condBlock->value2) ? 1 : 0;
         case BLOCK_GREATER_THAN:
-            return (condBlock->value > condBlock->value2) ? 1 : 0;
         case BLOCK_EQUAL:
-            return (condBlock->value == condBlock->value2) ? 1 : 0;
         case BLOCK_AND:
-            return (condBlock->value != 0 && condBlock->value2 != 0) ? 1 : 0;
         case BLOCK_OR:
-            return (condBlock->value != 0 || condBlock->value2 != 0) ? 1 : 0;
         case BLOCK_NOT:
-            return (condBlock->value == 0) ? 1 : 0;
+            // the condition is the block's expression, e.g. "score>100"
+            PrepareBlockExprs(*condBlock);
+            return (RunExpr(*condBlock->expr) != 0) ? 1 : 0;
         default:
             return lastOperatorResult;
     }
 }
 
-void ExecuteScripts(SDL_Renderer* renderer) {
-    if (!scriptsRunning) return;
-    if (isPaused && !stepRequested) return;
-    bool stepMode = stepRequested;
-    if (stepRequested) stepRequested = false;
+// ==================== SCRIPT COMPILER ====================
+// Flattens the stack under a hat into a Program. Each opener (REPEAT,
+// FOREVER, IF, IF_ELSE) gets the index of its matching END, and each END the
+// index of its opener, so the interpreter never walks the chain looking for
+// an END at run time. IF_ELSE owns two ENDs: the first closes the if-branch,
+// the second (jump2) closes the else-branch.
+shared_ptr<Program> CompileScript(BlockRef hat) {
+    auto prog = make_shared<Program>();
+    if (!hat) return prog;
+    prog->hat = hat;
+    vector<int> open; // openers still waiting for their END
+    for (auto b = hat->next; b; b = b->next) {
+        Instr in;
+        in.op = b->type;
+        in.block = b;
+        in.arg = b->type == BLOCK_WAIT ? BlockDurationMs(*b) : b->value;
+        int idx = (int)prog->code.size();
+        if (b->type == BLOCK_REPEAT || b->type == BLOCK_FOREVER ||
+            b->type == BLOCK_IF || b->type == BLOCK_IF_ELSE) {
+            open.push_back(idx);
+        } else if (b->type == BLOCK_END && !open.empty()) {
+            int o = open.back();
+            Instr& opener = prog->code[o];
+            in.jump = o;
+            if (opener.op == BLOCK_IF_ELSE && opener.jump == -1) {
+                opener.jump = idx; // end of if-branch, else-branch still open
+            } else {
+                if (opener.op == BLOCK_IF_ELSE) opener.jump2 = idx;
+                else opener.jump = idx;
+                open.pop_back();
+            }
+        }
+        prog->code.push_back(in);
+    }
+    return prog;
+}
+
+// Returns the cached program for a hat block, compiling it on first use.
+shared_ptr<Program> GetScriptProgram(BlockRef hat) {
+    if (!hat) return make_shared<Program>();
+    if (!hat->program) hat->program = CompileScript(hat);
+    return hat->program;
+}
+
+// Drops the compiled program of every stack the block belongs to.
+// Must be called whenever a block is linked, unlinked or edited.
+// Running scripts keep their own reference and finish on the old code.
+void InvalidateScript(BlockRef b) {
+    // a parked "wait until" may be watching what this condition used to read
+    if (b && sleepingCount > 0 && IsConditionBlock(b->type)) conditionsEdited = true;
+    while (b) {
+        b->program.reset();
+        b = b->prev.lock();
+    }
+}
+
+// ==================== PROFILER ====================
+// RunScriptAs reads profilerEnabled once per slice and only then calls in
+// here, so a disabled profiler costs one predictable test per block. The
+// time from one ProfileEnter to the next is charged to the earlier block
+// and its script; ProfileLeave closes the last one when the script yields.
+
+void ResetProfile() {
+    blockProfile.clear();
+    scriptProfile.clear();
+    profileBlock.reset();
+    profileHat.reset();
+    profileScroll = 0;
+}
+
+void ProfileAdd(vector<BlockProfile>& table, const BlockWeak& b, long long ns) {
+    if (b.slot >= table.size()) table.resize(max<size_t>(b.slot + 1, table.size() * 2));
+    BlockProfile& p = table[b.slot];
+    if (p.gen != b.gen) { p = BlockProfile(); p.gen = b.gen; }   // slot reused by another block
+    p.count++;
+    p.ns += ns;
+}
+
+void ProfileClose(chrono::steady_clock::time_point now) {
+    if (!profileBlock.slot) return;
+    long long ns = chrono::duration_cast<chrono::nanoseconds>(now - profileStart).count();
+    ProfileAdd(blockProfile, profileBlock, ns);
+    if (profileHat.slot) ProfileAdd(scriptProfile, profileHat, ns);
+    profileBlock.reset();
+}
+
+void ProfileEnter(const BlockRef& block, const BlockWeak& hat) {
+    auto now = chrono::steady_clock::now();
+    ProfileClose(now);
+    profileBlock = block;
+    profileHat = hat;
+    profileStart = now;
+}
+
+void ProfileLeave() {
+    ProfileClose(chrono::steady_clock::now());
+}
+
+// Samples of the block in slot, or null if it has none (or the slot's
+// block was freed since)
+const BlockProfile* ProfileOf(const vector<BlockProfile>& table, uint32_t slot) {
+    if (slot == 0 || slot >= table.size()) return nullptr;
+    const BlockProfile& p = table[slot];
+    if (p.count == 0 || p.gen != SlotOf(slot).gen) return nullptr;
+    return &p;
+}
+
+// What the heat map shows for a block: its own time, or for a hat the
+// time of the whole script under it
+long long ProfileNs(const BlockRef& b) {
+    const BlockProfile* p = ProfileOf(b->isHat() ? scriptProfile : blockProfile, b.slot);
+    return p ? p->ns : 0;
+}
+
+// Profiled blocks on the plate (every target), hottest first by 'by';
+// only the first 'top' rows are sorted
+vector<ProfileRow> CollectProfileRows(ProfileSort by, size_t top) {
+    vector<ProfileRow> rows;
+    for (size_t i = 0; i < scriptBlocks.size(); i++) {
+        const BlockProfile* p = ProfileOf(blockProfile, scriptBlocks[i].slot);
+        if (!p) continue;
+        ProfileRow row;
+        row.block = scriptBlocks[i];
+        row.id = (int)i;
+        row.stats = *p;
+        rows.push_back(row);
+    }
+    auto key = [by](const ProfileRow& r) -> double {
+        if (by == PROFILE_BY_COUNT) return (double)r.stats.count;
+        if (by == PROFILE_BY_AVG) return (double)r.stats.ns / r.stats.count;
+        return (double)r.stats.ns;
+    };
+    top = min(top, rows.size());
+    partial_sort(rows.begin(), rows.begin() + top, rows.end(), [&](const ProfileRow& a, const ProfileRow& b) {
+        double ka = key(a), kb = key(b);
+        return ka != kb ? ka > kb : a.id < b.id;
+    });
+    rows.resize(top);
+    return rows;
+}
+
+// ==================== SCRIPT QUEUES ====================
+
+int AcquireBroadcastWait() {
+    if (!freeBroadcastWaits.empty()) {
+        int g = freeBroadcastWaits.back();
+        freeBroadcastWaits.pop_back();
+        broadcastWaits[g] = 0;
+        return g;
+    }
+    broadcastWaits.push_back(0);
+    return broadcastWaits.size() - 1;
+}
+
+void ReleaseBroadcastWait(int g) {
+    freeBroadcastWaits.push_back(g);
+}
+
+// Stops every script (stop button, stop all, new project) and deletes the clones
+void ClearScriptQueues() {
+    flagScripts.clear(); spaceScripts.clear(); clickScripts.clear(); cloneScripts.clear();
+    for (auto& queue : messageScripts) queue.clear();
+    broadcastWaits.clear(); freeBroadcastWaits.clear();
+    ClearTimerWheel();
+    DeleteAllClones();
+}
+
+bool AnyScriptsQueued() {
+    if (sleepingCount > 0) return true;
+    if (!flagScripts.empty() || !spaceScripts.empty() || !clickScripts.empty() || !cloneScripts.empty()) return true;
+    for (auto& queue : messageScripts)
+        if (!queue.empty()) return true;
+    return false;
+}
+
+// ==================== CLONES ====================
+
+void ReserveClones() {
+    size_t n = cloneLimit;
+    if (clones.parent.capacity() >= n) return;
+    clones.parent.reserve(n); clones.gen.reserve(n); clones.seq.reserve(n);
+    clones.x.reserve(n); clones.y.reserve(n); clones.direction.reserve(n); clones.size.reserve(n);
+    clones.costume.reserve(n);
+    clones.visible.reserve(n); clones.penDown.reserve(n); clones.thinking.reserve(n);
+    clones.penColor.reserve(n); clones.penSize.reserve(n);
+    clones.message.reserve(n); clones.messageUntil.reserve(n);
+    clones.collision.reserve(n);
+    clones.freeIds.reserve(n); clones.live.reserve(n);
+}
+
+bool CloneAlive(int id, Uint32 gen) {
+    return id >= 0 && id < (int)clones.parent.size() && clones.parent[id] != -1 && clones.gen[id] == gen;
+}
+
+// The Sprite clones of allSprites[parent] run as; it shares the parent's
+// costumes (copied only when those change) and is otherwise just a view
+Sprite& CloneProxy(int parent) {
+    if ((int)cloneProxy.size() <= parent) cloneProxy.resize(parent + 1);
+    Sprite& p = cloneProxy[parent];
+    const Sprite& s = allSprites[parent];
+    bool same = p.costumes.size() == s.costumes.size();
+    for (size_t i = 0; same && i < s.costumes.size(); i++)
+        same = p.costumes[i].texture == s.costumes[i].texture && p.costumes[i].mask == s.costumes[i].mask;
+    if (!same) p.costumes = s.costumes;
+    if (p.name != s.name) p.name = s.name;
+    p.isDraggable = false;
+    return p;
+}
+
+// Index in allSprites of the sprite s is, or runs as (clone proxies)
+int SpriteParentOf(const Sprite& s) {
+    if (!allSprites.empty() && &s >= allSprites.data() && &s < allSprites.data() + allSprites.size())
+        return &s - allSprites.data();
+    if (clones.loaded != -1 && &s == &cloneProxy[clones.parent[clones.loaded]]) return clones.parent[clones.loaded];
+    return -1;
+}
+
+// Copies clone id into its parent's proxy; pair with StoreClone
+Sprite& LoadClone(int id) {
+    Sprite& p = CloneProxy(clones.parent[id]);
+    p.scratchx = clones.x[id]; p.scratchy = clones.y[id];
+    p.direction = clones.direction[id]; p.size = clones.size[id];
+    p.currentCostumeIndex = clones.costume[id];
+    p.isVisible = clones.visible[id] != 0;
+    p.penDown = clones.penDown[id] != 0; p.penColor = clones.penColor[id]; p.penSize = clones.penSize[id];
+    p.message.swap(clones.message[id]);
+    p.messageUntil = clones.messageUntil[id]; p.isThinking = clones.thinking[id] != 0;
+    clones.loaded = id;
+    return p;
+}
+
+void StoreClone(int id) {
+    if (clones.loaded != id) return;   // deleted while loaded
+    clones.loaded = -1;
+    Sprite& p = cloneProxy[clones.parent[id]];
+    clones.x[id] = p.scratchx; clones.y[id] = p.scratchy;
+    clones.direction[id] = p.direction; clones.size[id] = p.size;
+    clones.costume[id] = p.currentCostumeIndex;
+    clones.visible[id] = p.isVisible;
+    clones.penDown[id] = p.penDown; clones.penColor[id] = p.penColor; clones.penSize[id] = p.penSize;
+    clones.message[id].swap(p.message);
+    clones.messageUntil[id] = p.messageUntil; clones.thinking[id] = p.isThinking;
+}
+
+// "create clone of": a new clone with from's current state, running its
+// "when I start as a clone" scripts. Returns the id, -1 at the limit.
+int CreateClone(const Sprite& from) {
+    int parent = SpriteParentOf(from);
+    if (parent == -1 || (int)clones.live.size() >= cloneLimit) return -1;
+    ReserveClones();
+    int id;
+    if (!clones.freeIds.empty()) {
+        id = clones.freeIds.back();
+        clones.freeIds.pop_back();
+    } else {
+        id = clones.parent.size();
+        clones.parent.push_back(-1); clones.gen.push_back(0); clones.seq.push_back(0);
+        clones.x.push_back(0); clones.y.push_back(0); clones.direction.push_back(0); clones.size.push_back(0);
+        clones.costume.push_back(0);
+        clones.visible.push_back(0); clones.penDown.push_back(0); clones.thinking.push_back(0);
+        clones.penColor.push_back(SDL_Color()); clones.penSize.push_back(0);
+        clones.message.emplace_back(); clones.messageUntil.push_back(0);
+        clones.collision.emplace_back();
+    }
+    clones.parent[id] = parent;
+    clones.seq[id] = clones.nextSeq++;
+    clones.x[id] = from.scratchx; clones.y[id] = from.scratchy;
+    clones.direction[id] = from.direction; clones.size[id] = from.size;
+    clones.costume[id] = from.currentCostumeIndex;
+    clones.visible[id] = from.isVisible;
+    clones.penDown[id] = from.penDown; clones.penColor[id] = from.penColor; clones.penSize[id] = from.penSize;
+    clones.message[id].clear();   // keeps its buffer
+    clones.messageUntil[id] = 0; clones.thinking[id] = 0;
+    clones.live.push_back(id);
+    MarkCloneMoved(id);
+    startScriptsForHatId(BLOCK_WHEN_CLONE_START, -1, -1, id);
+    return id;
+}
+
+void DeleteClone(int id) {
+    if (id < 0 || id >= (int)clones.parent.size() || clones.parent[id] == -1) return;
+    UnlistCollision(-1 - id);
+    clones.parent[id] = -1;
+    clones.gen[id]++;
+    clones.message[id].clear();
+    if (clones.loaded == id) clones.loaded = -1;
+    clones.live.erase(find(clones.live.begin(), clones.live.end(), id));
+    clones.freeIds.push_back(id);
+    // its scripts end when they next run; wake those parked on a condition
+    for (size_t i = 0; i < sleepers.size(); i++) {
+        Sleeper& sl = sleepers[i];
+        if (sl.home && sl.condition && sl.script.clone == id) WakeSleeper(i);
+    }
+}
+
+void DeleteAllClones() {
+    while (!clones.live.empty()) DeleteClone(clones.live.back());
+}
+
+// ==================== TIMER WHEEL ====================
+
+// Duration of wait / say for / think for in ms: value2 holds the exact
+// (possibly fractional) time once typed in, otherwise value is whole secs
+int BlockDurationMs(const Block& b) {
+    return b.value2 > 0 ? b.value2 : b.value * 1000;
+}
+
+// 1500 -> "1.5", 2000 -> "2"
+string FormatSeconds(int ms) {
+    string s = to_string(ms / 1000);
+    int frac = ms % 1000;
+    if (frac == 0) return s;
+    string digits = to_string(1000 + frac).substr(1);
+    while (digits.back() == '0') digits.pop_back();
+    return s + "." + digits;
+}
+
+// "say Hello! for 1.5 secs": the message, then the exact seconds
+string MessageAndSecondsLabel(const Block& b) {
+    string label = b.baseLabel;
+    string msg = b.strValue.empty() ? string("Hello!") : b.strValue.str();
+    size_t p1 = label.find("{}");
+    if (p1 == string::npos) return label;
+    label.replace(p1, 2, msg);
+    size_t p2 = label.find("{}", p1 + msg.size());
+    if (p2 != string::npos) label.replace(p2, 2, FormatSeconds(BlockDurationMs(b)));
+    return label;
+}
+
+void WheelInsert(int id) {
+    long long due = sleepers[id].due;
+    long long delta = due - scriptClockMs;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1LL << (WHEEL_BITS * (level + 1)))) level++;
+    // Past the top level: park in the furthest slot, it cascades again later
+    if (delta >= (1LL << (WHEEL_BITS * WHEEL_LEVELS)))
+        due = scriptClockMs + (1LL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    timerWheel[level][(due >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)].push_back(id);
+}
 
-    // Watchdog:
-    auto resetWatchdog = [](vector<ScriptState>& scripts) {
-        for (auto& s : scripts)
-            for (auto& f : s.stack)
-                f.iterCount = 0;
+// Moves scripts[i] off its run queue into a free sleeper; the emptied
+// entry is dropped by the caller's compaction
+int ParkScript(vector<ScriptState>& scripts, size_t i) {
+    int id;
+    if (!freeSleepers.empty()) { id = freeSleepers.back(); freeSleepers.pop_back(); }
+    else { id = sleepers.size(); sleepers.emplace_back(); }
+    Sleeper& sl = sleepers[id];
+    sl.script = move(scripts[i]);
+    sl.home = &scripts;
+    scripts[i] = ScriptState();
+    sleepingCount++;
+    return id;
+}
+
+// Parks scripts[i] until ms from now
+void SleepScript(vector<ScriptState>& scripts, size_t i, int ms) {
+    int id = ParkScript(scripts, i);
+    sleepers[id].due = scriptClockMs + max(1, ms);
+    WheelInsert(id);
+}
+
+void WakeSleeper(int id) {
+    Sleeper& sl = sleepers[id];
+    sl.home->push_back(move(sl.script));
+    sl.script = ScriptState();
+    sl.home = nullptr;
+    sl.condition = nullptr;
+    sl.token++; // its watch entries are stale now
+    freeSleepers.push_back(id);
+    sleepingCount--;
+}
+
+// Advances the script clock to now and wakes every sleeper that is due.
+// Only the slots passed over are touched, not the sleeping scripts.
+void AdvanceTimerWheel() {
+    long long target;
+    if (headlessMode) {
+        // exactly one frame per call
+        headlessFrames++;
+        target = headlessFrames * 1000 / FPS;
+    } else {
+        auto now = chrono::steady_clock::now();
+        if (!scriptClockRunning) {
+            // (Re)started: count one frame, so a single step still moves time on
+            scriptClockRunning = true;
+            scriptClockLast = now - chrono::milliseconds(1000 / FPS);
+        }
+        target = scriptClockMs + chrono::duration_cast<chrono::milliseconds>(now - scriptClockLast).count();
+        // keep the sub-millisecond remainder for the next frame
+        scriptClockLast += chrono::milliseconds(target - scriptClockMs);
+    }
+    if (sleepingCount == 0) { scriptClockMs = target; return; }
+    vector<int> due;
+    while (scriptClockMs < target && sleepingCount > 0) {
+        scriptClockMs++;
+        // Cascade higher levels whose slot just came round, top level first
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            if (scriptClockMs & ((1LL << (WHEEL_BITS * level)) - 1)) continue;
+            vector<int>& slot = timerWheel[level][(scriptClockMs >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+            vector<int> moved;
+            moved.swap(slot);
+            for (int id : moved) WheelInsert(id);
+        }
+        vector<int>& slot = timerWheel[0][scriptClockMs & (WHEEL_SLOTS - 1)];
+        for (int id : slot) WakeSleeper(id);
+        slot.clear();
+    }
+    scriptClockMs = target;
+}
+
+void ClearTimerWheel() {
+    for (auto& level : timerWheel)
+        for (auto& slot : level) slot.clear();
+    for (auto& w : variableWatch) w.waiters.clear();
+    for (auto& w : inputWatch) w.waiters.clear();
+    conditionRecheck.clear();
+    sleepers.clear();
+    freeSleepers.clear();
+    sleepingCount = 0;
+}
+
+// Say / think bubbles time out on the script clock too, so they freeze
+// while paused and expire in headless runs. messageExpiry is the earliest
+// deadline showing; frames before it skip the sweep.
+void NoteMessageUntil(long long until) {
+    if (until != 0 && (messageExpiry == 0 || until < messageExpiry)) messageExpiry = until;
+}
+
+void ShowMessage(Sprite& s, const string& text, int ms) {
+    s.message = text;
+    s.messageUntil = scriptClockMs + max(1, ms);
+    NoteMessageUntil(s.messageUntil);
+}
+
+void ExpireMessages() {
+    if (messageExpiry == 0 || scriptClockMs < messageExpiry) return;
+    messageExpiry = 0;
+    auto expire = [](string& message, long long& until) {
+        if (until == 0) return;
+        if (until <= scriptClockMs) { until = 0; message.clear(); }
+        else NoteMessageUntil(until);
     };
-    resetWatchdog(flagScripts);
-    resetWatchdog(spaceScripts);
-    resetWatchdog(clickScripts);
-    for (auto& pair : messageScripts) resetWatchdog(pair.second);
-
-    bool stepDone = false;
-    auto stepScripts = [&](vector<ScriptState>& scripts) {
-        for (auto it = scripts.begin(); it != scripts.end(); ) {
-            auto& s = *it;
-            if (s.waitFrames > 0) {
-                s.waitFrames--;
-                ++it;
+    for (auto& s : allSprites) expire(s.message, s.messageUntil);
+    for (int id : clones.live) expire(clones.message[id], clones.messageUntil[id]);
+}
+
+// ==================== CONDITION WAITS ====================
+// Variables and input sources carry a version and a list of parked "wait
+// until" scripts. A change re-queues those scripts for one re-evaluation;
+// nothing else about a waiting script is looked at per frame.
+
+int InputSourceOf(const Block& b) {
+    if (b.type == BLOCK_MOUSE_DOWN) return INPUT_MOUSE_DOWN;
+    if (b.type != BLOCK_KEY_PRESSED) return -1;
+    for (int i = 0; i < 5; i++)
+        if (b.strValue.str() == keyNames[i]) return INPUT_KEY_SPACE + i;
+    return -1;
+}
+
+WatchList& WatchOf(int dep) {
+    if (dep < 0) return inputWatch[-1 - dep];
+    if (dep >= (int)variableWatch.size()) variableWatch.resize(dep + 1);
+    return variableWatch[dep];
+}
+
+bool WatchEntryLive(const WatchEntry& e) {
+    const Sleeper& sl = sleepers[e.id];
+    return sl.condition && sl.token == e.token;
+}
+
+void NoteSourceChanged(WatchList& w) {
+    w.version++;
+    for (auto& e : w.waiters) {
+        if (!WatchEntryLive(e) || sleepers[e.id].queued) continue;
+        sleepers[e.id].queued = true;
+        conditionRecheck.push_back(e.id);
+    }
+    w.waiters.clear();
+}
+
+void NoteVariableChanged(int slot) {
+    NoteSourceChanged(WatchOf(slot));
+}
+
+// Once per frame, instead of querying SDL in every condition
+void PollInputSources() {
+    const Uint8* keys = SDL_GetKeyboardState(NULL);
+    bool now[INPUT_COUNT];
+    for (int i = 0; i < 5; i++) now[INPUT_KEY_SPACE + i] = keys[keyScancodes[i]] != 0;
+    now[INPUT_MOUSE_DOWN] = (SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) != 0;
+    for (int i = 0; i < INPUT_COUNT; i++) {
+        if (now[i] == inputState[i]) continue;
+        inputState[i] = now[i];
+        NoteSourceChanged(inputWatch[i]);
+    }
+}
+
+// What a condition reads; false if it reads something untracked (touching,
+// a previous reporter), in which case the script keeps polling it
+bool ConditionDeps(Block& cond, vector<int>& deps) {
+    deps.clear();
+    int src = InputSourceOf(cond);
+    if (src != -1) { deps.push_back(-1 - src); return true; }
+    switch (cond.type) {
+        case BLOCK_LESS_THAN: case BLOCK_GREATER_THAN: case BLOCK_EQUAL:
+        case BLOCK_AND: case BLOCK_OR: case BLOCK_NOT:
+            PrepareBlockExprs(cond);
+            if (!cond.expr->error.empty()) return false;
+            if (cond.expr->epoch != symbolEpoch) BindExprSlots(*cond.expr);
+            for (int slot : cond.expr->slots) deps.push_back(slot);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void WatchDeps(int id) {
+    Sleeper& sl = sleepers[id];
+    sl.seen.clear();
+    for (int d : sl.deps) {
+        WatchList& w = WatchOf(d);
+        sl.seen.push_back(w.version);
+        w.waiters.push_back({id, sl.token});
+        if (w.waiters.size() >= w.compactAt) {
+            w.waiters.erase(remove_if(w.waiters.begin(), w.waiters.end(),
+                [](const WatchEntry& e) { return !WatchEntryLive(e); }), w.waiters.end());
+            w.compactAt = max((size_t)16, w.waiters.size() * 2);
+        }
+    }
+}
+
+// Parks scripts[i] at its "wait until" until one of deps changes
+void ParkOnCondition(vector<ScriptState>& scripts, size_t i, BlockRef cond, const vector<int>& deps) {
+    int id = ParkScript(scripts, i);
+    Sleeper& sl = sleepers[id];
+    sl.condition = cond;
+    sl.deps = deps;
+    sl.queued = false;
+    sl.edited = false;
+    WatchDeps(id);
+}
+
+// Re-evaluates the parked conditions whose inputs changed, each as the
+// target or clone its script runs as; true if any script woke up
+bool RecheckConditions() {
+    bool woke = false;
+    if (conditionsEdited) {
+        // The text of a condition changed, and with it what it reads:
+        // every parked wait is evaluated once more and re-registered
+        conditionsEdited = false;
+        for (size_t id = 0; id < sleepers.size(); id++) {
+            Sleeper& sl = sleepers[id];
+            if (!sl.condition) continue;
+            sl.edited = true;
+            if (!sl.queued) { sl.queued = true; conditionRecheck.push_back(id); }
+        }
+    }
+    while (!conditionRecheck.empty()) {
+        vector<int> ids;
+        ids.swap(conditionRecheck);
+        for (int id : ids) {
+            Sleeper& sl = sleepers[id];
+            sl.queued = false;
+            if (!sl.condition) continue;
+            bool moved = sl.edited;
+            sl.edited = false;
+            for (size_t d = 0; d < sl.deps.size() && !moved; d++)
+                moved = WatchOf(sl.deps[d]).version != sl.seen[d];
+            int clone = sl.script.clone;
+            if (clone != -1 && !CloneAlive(clone, sl.script.cloneGen)) {
+                WakeSleeper(id);   // dropped when it runs
                 continue;
             }
-            if (!s.current) {
-                it = scripts.erase(it);
+            bool met = false;
+            if (moved) {
+                Sprite& self = (clone == -1) ? TargetSprite(sl.script.target) : LoadClone(clone);
+                met = EvaluateCondition(sl.condition, self) != 0;
+                if (clone != -1) StoreClone(clone);
+            }
+            if (met) {
+                sl.script.pc++; // past the wait until
+                sl.script.conditionBlock = nullptr;
+                sl.script.conditionValue = -1;
+                WakeSleeper(id);
+                woke = true;
                 continue;
             }
-            Block& block = *s.current;
-            Sprite& sprite = allSprites[0];
-
-            // Track currently executing block for step mode highlight
-            if (stepModeActive) {
-                currentExecutingBlock = s.current;
+            // still false: the expression may have been re-bound, so re-read deps
+            sl.token++;
+            vector<int> deps;
+            if (ConditionDeps(*sl.condition, deps)) {
+                sl.deps = deps;
+                WatchDeps(id);
+            } else {
+                WakeSleeper(id); // back to polling at its wait until
             }
+        }
+    }
+    return woke;
+}
+
+// Blocks whose effect is visible on the stage; after one of these a loop
+// waits for the next frame instead of running another iteration.
+bool IsRedrawBlock(const Block& b) {
+    return b.category == CAT_MOTION || b.category == CAT_LOOKS || b.category == CAT_PEN;
+}
+
+// The value an if / wait until tests: what its condition block gave if that
+// ran just before it (nothing can have changed since), otherwise evaluated now
+int TakeCondition(ScriptState& s, BlockRef cond, Sprite& sprite) {
+    int value = s.conditionValue;
+    s.conditionValue = -1;
+    bool fresh = value != -1 && s.pc > 0 && s.program->code[s.pc - 1].block == cond;
+    return fresh ? value : EvaluateCondition(cond, sprite);
+}
+
+bool IsConditionBlock(BlockType t) {
+    return t == BLOCK_KEY_PRESSED || t == BLOCK_MOUSE_DOWN ||
+           t == BLOCK_TOUCHING || t == BLOCK_TOUCHING_COLOR ||
+           t == BLOCK_LESS_THAN || t == BLOCK_EQUAL ||
+           t == BLOCK_GREATER_THAN || t == BLOCK_AND ||
+           t == BLOCK_OR || t == BLOCK_NOT;
+}
+
+// Runs scripts[i] until it yields (loop iteration, wait, wait until,
+// broadcast and wait, ask), finishes, or the frame deadline passes.
+// In turbo mode loop iterations do not yield; the script runs for at most
+// TURBO_SLICE_US before the next script gets its turn.
+// The script is re-fetched by index after anything that may start new
+// scripts, since that can grow the vector it lives in.
+// It runs as its target (or clone); both are looked up by index, so the
+// per-script cost does not grow with the number of sprites.
+// Returns false when every script was stopped (stop all).
+bool RunScriptUntilYield(vector<ScriptState>& scripts, size_t i, bool stepMode,
+                         chrono::steady_clock::time_point deadline,
+                         bool& progressed, bool& stepDone, SDL_Renderer* renderer) {
+    int clone = scripts[i].clone;
+    if (clone == -1) {
+        bool result = RunScriptAs(TargetSprite(scripts[i].target), scripts, i, stepMode, deadline, progressed, stepDone, renderer);
+        if (profilerEnabled) ProfileLeave();
+        return result;
+    }
+    if (!CloneAlive(clone, scripts[i].cloneGen)) {
+        scripts[i].program = nullptr;   // its clone was deleted
+        return true;
+    }
+    Sprite& proxy = LoadClone(clone);
+    bool result = RunScriptAs(proxy, scripts, i, stepMode, deadline, progressed, stepDone, renderer);
+    if (profilerEnabled) ProfileLeave();
+    StoreClone(clone);
+    return result;
+}
+
+bool RunScriptAs(Sprite& sprite, vector<ScriptState>& scripts, size_t i, bool stepMode,
+                 chrono::steady_clock::time_point deadline,
+                 bool& progressed, bool& stepDone, SDL_Renderer* renderer) {
+    auto sliceEnd = deadline;
+    const bool profile = profilerEnabled;
+    long long sliceBlocks = headlessBlockLimit;   // headless: counted in blocks
+    if (turboMode && headlessMode) sliceBlocks = min(headlessBlockLimit, blocksExecuted + HEADLESS_SLICE_BLOCKS);
+    else if (turboMode) sliceEnd = min(deadline, chrono::steady_clock::now() + chrono::microseconds(TURBO_SLICE_US));
+    for (;;) {
+        ScriptState& s = scripts[i];
+        if (!s.program || s.pc >= (int)s.program->code.size()) return true;
+        const vector<Instr>& code = s.program->code;
+        const Instr& in = code[s.pc];
+        Block& block = *in.block;
+        blocksExecuted++;
+        if (profile) ProfileEnter(in.block, s.program->hat);
 
-            if (!s.waitingForBroadcast.empty()) {
-                auto& children = messageScripts[s.waitingForBroadcast];
-                if (children.empty()) {
-                    s.waitingForBroadcast = "";
-                    s.waitingChildren = 0;
+        // Track currently executing block for step mode highlight
+        if (stepModeActive) {
+            currentExecutingBlock = in.block;
+        }
+
+        switch (in.op) {
+            case BLOCK_REPEAT: {
+                if (in.jump == -1) {
+                    s.pc++; // no matching END: run the rest once
+                } else if (in.arg <= 0) {
+                    s.pc = in.jump + 1; // repeat 0: skip the body
                 } else {
-                    ++it;
-                    continue;
+                    CallFrame f;
+                    f.loopStart = s.pc + 1;
+                    f.returnTo = in.jump + 1;
+                    f.remaining = in.arg;
+                    s.stack.push_back(f);
+                    s.pc++;
                 }
+                break;
             }
-
-            switch (block.type) {
-                case BLOCK_REPEAT: {
-                    int depth = 1;
-                    auto end = block.next;
-                    while (end) {
-                        if (end->type == BLOCK_REPEAT || end->type == BLOCK_FOREVER || end->type == BLOCK_IF || end->type == BLOCK_IF_ELSE) depth++;
-                        if (end->type == BLOCK_END) { depth--; if (depth == 0) break; }
-                        end = end->next;
-                    }
-                    if (end) {
-                        CallFrame f;
-                        f.returnTo = end->next;
-                        f.loopStart = block.next;
-                        f.remaining = block.value;
-                        s.stack.push_back(f);
-                        s.current = block.next;
-                    } else {
-                        s.current = block.next;
-                    }
-                    break;
+            case BLOCK_FOREVER: {
+                if (in.jump != -1) {
+                    CallFrame f;
+                    f.loopStart = s.pc + 1;
+                    f.returnTo = -1;
+                    f.remaining = 0;
+                    s.stack.push_back(f);
                 }
-                case BLOCK_FOREVER: {
-                    int depth = 1;
-                    auto end = block.next;
-                    while (end) {
-                        if (end->type == BLOCK_REPEAT || end->type == BLOCK_FOREVER || end->type == BLOCK_IF || end->type == BLOCK_IF_ELSE) depth++;
-                        if (end->type == BLOCK_END) { depth--; if (depth == 0) break; }
-                        end = end->next;
-                    }
-                    if (end) {
-                        CallFrame f;
-                        f.returnTo = nullptr;
-                        f.loopStart = block.next;
-                        f.remaining = 0;
-                        s.stack.push_back(f);
-                        s.current = block.next;
-                    } else {
-                        s.current = block.next;
-                    }
-                    break;
+                s.pc++;
+                break;
+            }
+            case BLOCK_IF: {
+                bool cond = TakeCondition(s, s.conditionBlock, sprite) != 0;
+                if (cond) {
+                    s.pc++;
+                } else {
+                    s.pc = (in.jump != -1) ? in.jump + 1 : (int)code.size();
                 }
-                case BLOCK_IF: {
-                    bool cond = (EvaluateCondition(s.conditionBlock, sprite) != 0);
-                    int depth = 1;
-                    auto end = block.next;
-                    while (end) {
-                        if (end->type == BLOCK_REPEAT || end->type == BLOCK_FOREVER || end->type == BLOCK_IF || end->type == BLOCK_IF_ELSE) depth++;
-                        if (end->type == BLOCK_END) { depth--; if (depth == 0) break; }
-                        end = end->next;
-                    }
-                    if (cond) {
-                        s.current = block.next;
-                    } else {
-                        s.current = end ? end->next : nullptr;
-                    }
-                    s.conditionBlock = nullptr;
-                    break;
+                s.conditionBlock = nullptr;
+                break;
+            }
+            case BLOCK_IF_ELSE: {
+                bool cond = TakeCondition(s, s.conditionBlock, sprite) != 0;
+                if (cond) {
+                    s.pc++; // the first END jumps over the else-branch
+                } else {
+                    s.pc = (in.jump != -1) ? in.jump + 1 : (int)code.size();
                 }
-                case BLOCK_IF_ELSE: {
-                    bool cond = (EvaluateCondition(s.conditionBlock, sprite) != 0);
-                    // Find first END (separates if-branch from else-branch)
-                    int depth = 1;
-                    auto firstEnd = block.next;
-                    while (firstEnd) {
-                        if (firstEnd->type == BLOCK_REPEAT || firstEnd->type == BLOCK_FOREVER ||
-                            firstEnd->type == BLOCK_IF || firstEnd->type == BLOCK_IF_ELSE) depth++;
-                        if (firstEnd->type == BLOCK_END) { depth--; if (depth == 0) break; }
-                        firstEnd = firstEnd->next;
-                    }
-                    // Find second END (end of else-branch)
-                    shared_ptr<Block> secondEnd = nullptr;
-                    if (firstEnd && firstEnd->next) {
-                        depth = 1;
-                        secondEnd = firstEnd->next;
-                        // Check if next block after first END starts another nested structure or is content
-                        // We need to find the matching END for the else-branch
-                        // The else-branch ends at the next unnested END
-                        depth = 0;
-                        auto cur = firstEnd->next;
-                        while (cur) {
-                            if (cur->type == BLOCK_REPEAT || cur->type == BLOCK_FOREVER ||
-                                cur->type == BLOCK_IF || cur->type == BLOCK_IF_ELSE) depth++;
-                            if (cur->type == BLOCK_END) {
-                                if (depth == 0) { secondEnd = cur; break; }
-                                depth--;
-                            }
-                            cur = cur->next;
-                        }
-                        if (!cur) secondEnd = nullptr; // no second END found
-                    }
-                    if (cond) {
-                        // Execute if-branch; when reaching firstEnd, push frame to skip to after secondEnd
-                        if (firstEnd) {
-                            CallFrame f;
-                            f.returnTo = secondEnd ? secondEnd->next : nullptr;
-                            f.loopStart = nullptr;
-                            f.remaining = -1; // special: skip marker, not a loop
-                            s.stack.push_back(f);
-                        }
-                        s.current = block.next;
-                    } else {
-                        // Skip to else-branch (after firstEnd)
-                        if (firstEnd) {
-                            if (secondEnd) {
-                                // Push frame so when we hit secondEnd, we jump past it
-                                CallFrame f;
-                                f.returnTo = secondEnd->next;
-                                f.loopStart = nullptr;
-                                f.remaining = -1; // special: skip marker
-                                s.stack.push_back(f);
-                                s.current = firstEnd->next; // start of else-branch
-                            } else {
-                                s.current = firstEnd->next;
-                            }
-                        } else {
-                            s.current = nullptr;
-                        }
-                    }
-                    s.conditionBlock = nullptr;
+                s.conditionBlock = nullptr;
+                break;
+            }
+            case BLOCK_END: {
+                if (in.jump == -1) {
+                    s.pc++; // stray END
                     break;
                 }
-                case BLOCK_END: {
-                    if (!s.stack.empty()) {
-                        auto& f = s.stack.back();
-                        if (f.remaining == -1) {
-                            // Special IF_ELSE frame: jump to returnTo (skip remaining branch)
-                            s.current = f.returnTo;
-                            s.stack.pop_back();
-                        } else if (f.returnTo == nullptr) {
-                            // FOREVER loop
-                            f.iterCount++;
-                            if (f.iterCount > WATCHDOG_MAX_ITERS_PER_FRAME) {
-                                // watchdog:
-                                setError("Watchdog: infinite loop detected, forcing frame break");
-                                f.iterCount = 0;
-                                s.waitFrames = 1;
-                                s.current = f.loopStart;
-                                ++it;
-                                if (stepMode) { stepDone = true; return; }
-                                continue;
-                            }
-                            s.current = f.loopStart;
-                        } else if (f.remaining > 0) {
-                            f.iterCount++;
-                            if (f.iterCount > WATCHDOG_MAX_ITERS_PER_FRAME) {
-                                setError("Watchdog: repeat loop too heavy, forcing frame break");
-                                f.iterCount = 0;
-                                s.waitFrames = 1;
-                                s.current = f.loopStart;
-                                ++it;
-                                if (stepMode) { stepDone = true; return; }
-                                continue;
-                            }
-                            f.remaining--;
-                            if (f.remaining > 0) s.current = f.loopStart;
-                            else {
-                                s.current = f.returnTo;
-                                s.stack.pop_back();
-                            }
-                        } else {
-                            s.current = f.returnTo;
-                            s.stack.pop_back();
-                        }
-                    } else {
-                        s.current = s.current->next;
-                    }
+                const Instr& opener = code[in.jump];
+                if (opener.op == BLOCK_IF_ELSE && opener.jump == s.pc) {
+                    // End of the if-branch: skip the else-branch
+                    s.pc = (opener.jump2 != -1) ? opener.jump2 + 1 : (int)code.size();
                     break;
                 }
-                case BLOCK_WAIT:
-                    s.waitFrames = block.value * FPS;
-                    s.current = s.current->next;
-                    break;
-                case BLOCK_STOP_ALL:
-                    scriptsRunning = false; isPaused = false; stepRequested = false;
-                    flagScripts.clear(); spaceScripts.clear(); clickScripts.clear(); messageScripts.clear();
-                    return; // exit ExecuteScripts entirely
-                case BLOCK_WAIT_UNTIL: {
-
-                    shared_ptr<Block> condSrc = s.conditionBlock;
-                    if (!condSrc) {
-                        auto prev = s.current->prev.lock();
-                        if (prev && (prev->type == BLOCK_KEY_PRESSED || prev->type == BLOCK_MOUSE_DOWN ||
-                                     prev->type == BLOCK_TOUCHING || prev->type == BLOCK_LESS_THAN ||
-                                     prev->type == BLOCK_EQUAL || prev->type == BLOCK_GREATER_THAN ||
-                                     prev->type == BLOCK_AND || prev->type == BLOCK_OR || prev->type == BLOCK_NOT)) {
-                            condSrc = prev;
-                            s.conditionBlock = prev;
-                        }
-                    }
-                    bool cond = (EvaluateCondition(condSrc, sprite) != 0);
-                    if (cond) {
-                        s.current = s.current->next;
-                        s.conditionBlock = nullptr;
-                    }
+                if ((opener.op != BLOCK_REPEAT && opener.op != BLOCK_FOREVER) || s.stack.empty()) {
+                    s.pc++;
                     break;
                 }
-                case BLOCK_BROADCAST_WAIT: {
-                    string msg = block.strValue;
-                    vector<ScriptState> newReceivers;
-                    for (auto& b : scriptBlocks) {
-                        if (b->type == BLOCK_WHEN_RECEIVE && b->strValue == msg && !b->prev.lock()) {
-                            ScriptState newS;
-                            newS.current = b->next;
-                            newS.waitFrames = 0;
-                            newS.waitingForBroadcast = "";
-                            newS.waitingChildren = 0;
-                            newReceivers.push_back(newS);
-                        }
-                    }
-                    if (!newReceivers.empty()) {
-                        messageScripts[msg].insert(messageScripts[msg].end(), newReceivers.begin(), newReceivers.end());
-                        scriptsRunning = true;
-                        s.waitingForBroadcast = msg;
-                        s.waitingChildren = newReceivers.size();
-                    }
+                auto& f = s.stack.back();
+                if (f.returnTo != -1 && --f.remaining <= 0) {
+                    // REPEAT finished
+                    s.pc = f.returnTo;
+                    s.stack.pop_back();
                     break;
                 }
-                default:
-
-                    if (block.type == BLOCK_KEY_PRESSED || block.type == BLOCK_MOUSE_DOWN ||
-                        block.type == BLOCK_TOUCHING || block.type == BLOCK_TOUCHING_COLOR ||
-                        block.type == BLOCK_LESS_THAN || block.type == BLOCK_EQUAL ||
-                        block.type == BLOCK_GREATER_THAN || block.type == BLOCK_AND ||
-                        block.type == BLOCK_OR || block.type == BLOCK_NOT) {
-                        s.conditionBlock = s.current;
-                    } else {
-                        s.conditionBlock = nullptr;
+                // Loop back-edge: end of one iteration is a yield point
+                // (turbo mode keeps going until the frame budget runs out)
+                s.pc = f.loopStart;
+                progressed = true;
+                if (!turboMode || stepMode) return true;
+                break;
+            }
+            case BLOCK_WAIT:
+                s.pc++;
+                progressed = true;
+                SleepScript(scripts, i, in.arg);   // "wait 0" still waits for the next frame
+                return true;
+            case BLOCK_SAY_FOR:
+            case BLOCK_THINK_FOR:
+                // The bubble expires at the same time the script wakes up
+                s.pc++;
+                ExecuteBlock(block, sprite, renderer);
+                logExecuted(block.label);
+                redrawRequested = true;
+                progressed = true;
+                if (stepMode) stepDone = true;
+                SleepScript(scripts, i, BlockDurationMs(block));
+                return true;
+            case BLOCK_DELETE_CLONE:
+                logExecuted(block.label);
+                progressed = true;
+                if (s.clone == -1) { s.pc++; break; }   // the sprite itself is not a clone
+                DeleteClone(s.clone);
+                s.pc = (int)code.size();   // its other scripts end when they next run
+                redrawRequested = true;
+                return true;
+            case BLOCK_STOP_ALL:
+                scriptsRunning = false; isPaused = false; stepRequested = false;
+                ClearScriptQueues();
+                return false; // exit ExecuteScripts entirely
+            case BLOCK_WAIT_UNTIL: {
+                BlockRef condSrc = s.conditionBlock;
+                if (!condSrc && s.pc > 0) {
+                    auto prev = code[s.pc - 1].block;
+                    if (IsConditionBlock(prev->type)) {
+                        condSrc = prev;
+                        s.conditionBlock = prev;
                     }
-                    ExecuteBlock(block, sprite, renderer);
-                    logAction("Executed: " + block.label);
-                    s.current = s.current->next;
-                    if (stepMode) { stepDone = true; ++it; return; }
-                    break;
+                }
+                bool cond = TakeCondition(s, condSrc, sprite) != 0;
+                if (!cond) {
+                    // Sleep until something the condition reads changes;
+                    // untracked conditions are checked again on the next pass
+                    vector<int> deps;
+                    if (condSrc && ConditionDeps(*condSrc, deps))
+                        ParkOnCondition(scripts, i, condSrc, deps);
+                    return true;
+                }
+                s.pc++;
+                s.conditionBlock = nullptr;
+                break;
+            }
+            case BLOCK_BROADCAST_WAIT: {
+                // This invocation gets its own counter, so an unrelated
+                // broadcast of the same message cannot keep it waiting
+                int msg = blockEventId(block);
+                s.pc++;
+                progressed = true;
+                int group = AcquireBroadcastWait();
+                // may grow 'scripts' when it is this message's own queue
+                int started = startScriptsForHatId(BLOCK_WHEN_RECEIVE, msg, group);
+                if (started > 0) {
+                    scriptsRunning = true;
+                    broadcastWaits[group] = started;
+                    scripts[i].waitingOn = group;
+                } else {
+                    ReleaseBroadcastWait(group);
+                }
+                return true;
             }
-            ++it;
+            case BLOCK_ASK:
+                // One prompt at a time; the script sleeps until it is answered
+                if (waitingForAnswer) return true;
+                s.waitingForAnswer = true;
+                s.pc++;
+                ExecuteBlock(block, sprite, renderer);
+                logExecuted(block.label);
+                progressed = true;
+                if (stepMode) stepDone = true;
+                return true;
+            case BLOCK_KEY_PRESSED: case BLOCK_MOUSE_DOWN:
+            case BLOCK_TOUCHING: case BLOCK_TOUCHING_COLOR:
+            case BLOCK_LESS_THAN: case BLOCK_EQUAL: case BLOCK_GREATER_THAN:
+            case BLOCK_AND: case BLOCK_OR: case BLOCK_NOT:
+                // Evaluated once, here; the if / wait until after it takes the value
+                s.conditionBlock = in.block;
+                s.conditionValue = EvaluateCondition(in.block, sprite);
+                lastOperatorResult = s.conditionValue;
+                s.pc++;
+                logExecuted(block.label);
+                progressed = true;
+                if (stepMode) { stepDone = true; return true; }
+                break;
+            default:
+                s.conditionBlock = nullptr;
+                s.pc++;
+                // may start new scripts: do not touch 's' after this call
+                ExecuteBlock(block, sprite, renderer);
+                logExecuted(block.label);
+                if (IsRedrawBlock(block)) {
+                    redrawRequested = true;
+                    MarkSpriteMoved(sprite);
+                }
+                progressed = true;
+                if (stepMode) { stepDone = true; return true; }
+                break;
         }
-    };
+        if (!stepMode && (headlessMode ? blocksExecuted >= sliceBlocks : chrono::steady_clock::now() >= sliceEnd)) return true;
+    }
+}
+
+void ExecuteScripts(SDL_Renderer* renderer) {
+    if (isPaused && !stepRequested) {
+        scriptClockRunning = false; // the script clock stands still
+        return;
+    }
+    if (!scriptsRunning) {
+        // Nothing runs; the clock only goes on for bubbles still showing
+        if (messageExpiry == 0) { scriptClockRunning = false; return; }
+        AdvanceTimerWheel();
+        ExpireMessages();
+        return;
+    }
+    bool stepMode = stepRequested;
+    if (stepRequested) stepRequested = false;
+
+    AdvanceTimerWheel();
+    ExpireMessages();
+    PollInputSources();
+
+    // Time budget (replaces the old per-loop iteration watchdog)
+    auto frameStart = chrono::steady_clock::now();
+    double budget = turboMode ? TURBO_FRAME_BUDGET : SCHED_FRAME_BUDGET;
+    auto deadline = frameStart + chrono::microseconds((long long)(1000000.0 / FPS * budget));
+    headlessBlockLimit = blocksExecuted + HEADLESS_FRAME_BLOCKS;
+    redrawRequested = false;
 
-    stepScripts(flagScripts);
-    if (!stepDone) stepScripts(spaceScripts);
-    if (!stepDone) stepScripts(clickScripts);
-    if (!stepDone) {
-        for (auto& pair : messageScripts) {
-            stepScripts(pair.second);
-            if (stepDone) break;
+    bool stepDone = false, stopped = false, progressed = false;
+    auto runPass = [&](vector<ScriptState>& scripts) {
+        for (size_t i = 0; i < scripts.size() && !stepDone && !stopped; i++) {
+            ScriptState& s = scripts[i];
+            if (s.waitingOn != -1) {
+                if (broadcastWaits[s.waitingOn] > 0) continue;
+                ReleaseBroadcastWait(s.waitingOn);
+                s.waitingOn = -1;
+            }
+            if (s.waitingForAnswer) {
+                if (waitingForAnswer) continue;
+                s.waitingForAnswer = false;
+            }
+            if (!RunScriptUntilYield(scripts, i, stepMode, deadline, progressed, stepDone, renderer))
+                stopped = true;
+        }
+        if (stopped) return;
+        // Drop finished scripts; receivers of a broadcast-and-wait count down
+        size_t kept = 0;
+        for (size_t i = 0; i < scripts.size(); i++) {
+            ScriptState& s = scripts[i];
+            if (s.program && s.pc < (int)s.program->code.size()) {
+                if (kept != i) scripts[kept] = move(s);
+                kept++;
+            } else if (s.reportsTo != -1) {
+                broadcastWaits[s.reportsTo]--;
+            }
         }
+        scripts.resize(kept);
+    };
+
+    // Keep making passes over all scripts while they make progress, nothing
+    // visible changed (ignored in turbo mode) and the frame budget lasts;
+    // step mode does one block. Each queue runs in the order its scripts were
+    // started, which is the targets' layer order (see IndexHat).
+    do {
+        progressed = RecheckConditions();
+        runPass(flagScripts);
+        if (!stepDone && !stopped) runPass(spaceScripts);
+        if (!stepDone && !stopped) runPass(clickScripts);
+        if (!stepDone && !stopped) runPass(cloneScripts);
+        for (size_t m = 0; m < messageScripts.size() && !stepDone && !stopped; m++)
+            runPass(messageScripts[m]);
+        if (stopped) return;
+    } while (!stepMode && progressed && (turboMode || !redrawRequested) &&
+             (headlessMode ? blocksExecuted < headlessBlockLimit : chrono::steady_clock::now() < deadline));
+
+    // Blocks-per-second counter for the log bar (a stale window just restarts);
+    // headless runs keep the total instead
+    Uint32 nowTicks = headlessMode ? 0 : SDL_GetTicks();
+    if (!headlessMode && nowTicks - blockRateStart >= 1000) {
+        if (nowTicks - blockRateStart < 2000)
+            blocksPerSecond = (int)(blocksExecuted * 1000 / (nowTicks - blockRateStart));
+        blocksExecuted = 0;
+        blockRateStart = nowTicks;
     }
 
     // In step mode, after executing one step, pause until next click
     if (stepModeActive && !stepRequested) {
         isPaused = true;
     }
-
-    for (auto it = messageScripts.begin(); it != messageScripts.end(); ) {
-        if (it->second.empty()) it = messageScripts.erase(it);
-        else ++it;
-    }
-
-    for (auto& s : allSprites) {
-        if (s.messageTimer > 0) {
-            s.messageTimer--;
-            if (s.messageTimer == 0) s.message.clear();
-        }
-    }
 }
@@ -1,14 +1,80 @@
 #pragma once
 // ============================================================
 // hamed_ctrl.h — Hamed Arabpour
-// Control Flow Engine & Step-Mode Watchdog
+// Control Flow Engine & Scheduler
 // ============================================================
-// Condition evaluator and main script execution loop.
-// Handles REPEAT / FOREVER / IF / IF_ELSE stacks,
-// watchdog (WATCHDOG_MAX_ITERS_PER_FRAME), step-mode flag.
+// Script compiler (block stack -> Program with resolved jumps),
+// condition evaluator, clone store and main script execution loop.
+// Handles REPEAT / FOREVER / IF / IF_ELSE via precomputed targets.
+// Scripts run until they yield, within a per-frame time budget
+// (SCHED_FRAME_BUDGET, TURBO_FRAME_BUDGET in turbo mode),
+// blocks-per-second counter and the step-mode flag. Sleeping
+// scripts (wait, say/think for secs) are parked on a timer wheel.
+// An opt-in profiler times every block run (PROFILER).
 // Style: explicit call stack, bool flags, early returns,
 //        structured if-else chains, iteration counters.
 // ============================================================
 
-int  EvaluateCondition(shared_ptr<Block> condBlock, Sprite& sprite);
+shared_ptr<Program> CompileScript(BlockRef hat);
+shared_ptr<Program> GetScriptProgram(BlockRef hat);
+void InvalidateScript(BlockRef b);
+
+void                ResetProfile();
+void                ProfileAdd(vector<BlockProfile>& table, const BlockWeak& b, long long ns);
+void                ProfileClose(chrono::steady_clock::time_point now);
+void                ProfileEnter(const BlockRef& block, const BlockWeak& hat);
+void                ProfileLeave();
+const BlockProfile* ProfileOf(const vector<BlockProfile>& table, uint32_t slot);
+long long           ProfileNs(const BlockRef& b);
+vector<ProfileRow>  CollectProfileRows(ProfileSort by, size_t top);
+
+int  AcquireBroadcastWait();
+void ReleaseBroadcastWait(int g);
+void ClearScriptQueues();
+
+void    ReserveClones();
+bool    CloneAlive(int id, Uint32 gen);
+Sprite& CloneProxy(int parent);
+int     SpriteParentOf(const Sprite& s);
+Sprite& LoadClone(int id);
+void    StoreClone(int id);
+int     CreateClone(const Sprite& from);
+void    DeleteClone(int id);
+void    DeleteAllClones();
+
+int    BlockDurationMs(const Block& b);
+string FormatSeconds(int ms);
+string MessageAndSecondsLabel(const Block& b);
+void   WheelInsert(int id);
+void   SleepScript(vector<ScriptState>& scripts, size_t i, int ms);
+void   WakeSleeper(int id);
+void   AdvanceTimerWheel();
+void   ClearTimerWheel();
+void   NoteMessageUntil(long long until);
+void   ShowMessage(Sprite& s, const string& text, int ms);
+void   ExpireMessages();
+
+int        ParkScript(vector<ScriptState>& scripts, size_t i);
+int        InputSourceOf(const Block& b);
+WatchList& WatchOf(int dep);
+bool       WatchEntryLive(const WatchEntry& e);
+void       NoteSourceChanged(WatchList& w);
+void       NoteVariableChanged(int slot);
+void       PollInputSources();
+bool       ConditionDeps(Block& cond, vector<int>& deps);
+void       WatchDeps(int id);
+void       ParkOnCondition(vector<ScriptState>& scripts, size_t i, BlockRef cond, const vector<int>& deps);
+bool       RecheckConditions();
+bool AnyScriptsQueued();
+
+int  EvaluateCondition(BlockRef condBlock, Sprite& sprite);
+bool IsRedrawBlock(const Block& b);
+bool IsConditionBlock(BlockType t);
+int  TakeCondition(ScriptState& s, BlockRef cond, Sprite& sprite);
+bool RunScriptUntilYield(vector<ScriptState>& scripts, size_t i, bool stepMode,
+                         chrono::steady_clock::time_point deadline,
+                         bool& progressed, bool& stepDone, SDL_Renderer* renderer);
+bool RunScriptAs(Sprite& sprite, vector<ScriptState>& scripts, size_t i, bool stepMode,
+                 chrono::steady_clock::time_point deadline,
+                 bool& progressed, bool& stepDone, SDL_Renderer* renderer);
 void ExecuteScripts(SDL_Renderer* renderer);
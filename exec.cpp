@@ -5,56 +5,299 @@ bool isNumber(const string& s) {
     return *end == 0;
 }
 
-// Evaluate a simple expression (numbers and variables, binary operators + - * / % < > = & |)
-// Operators are scanned from right to left, so precedence is not standard but sufficient.
-float evalExpr(const string& expr) {
-    if (expr.empty()) return 0.0f;
-
-    // Trim spaces
-    string e = expr;
-    e.erase(remove(e.begin(), e.end(), ' '), e.end());
-
-    // Operators in order of scanning (rightmost first)
-    const char* ops[] = {"|", "&", "<", ">", "=", "+", "-", "*", "/", "%"};
-    for (int oi = 0; oi < 10; oi++) {
-        string op = ops[oi];
-        size_t pos = e.rfind(op);
-        if (pos != string::npos && pos > 0 && pos < e.length()-1) {
-            string left = e.substr(0, pos);
-            string right = e.substr(pos + op.length());
-            float l = evalExpr(left);
-            float r = evalExpr(right);
-            if (op == "+") return l + r;
-            if (op == "-") return l - r;
-            if (op == "*") return l * r;
-            if (op == "/") {
-                if (r == 0) { setError("Division by zero"); return 0; }
-                return l / r;
+// ==================== EXPRESSIONS ====================
+// Expressions are parsed once (precedence climbing) into postfix code and
+// cached on the block; running them only walks that array with a fixed
+// stack. Precedence, lowest first:  |   &   < > =   + -   * / %
+// then the prefix operators  - not round abs sqrt. Binary operators are
+// left-associative and parentheses group as usual.
+
+struct ExprParser {
+    const char* s;
+    size_t pos;
+    int depth;      // eval stack depth of the code emitted so far
+    int nesting;    // parentheses / prefix operators currently open
+    CompiledExpr* out;
+    string error;
+};
+
+bool isExprIdentChar(char c) {
+    return isalnum((unsigned char)c) || c == '_' || (c & 0x80); // UTF-8 names are fine
+}
+
+void exprSkipSpaces(ExprParser& P) {
+    while (P.s[P.pos] == ' ' || P.s[P.pos] == '\t') P.pos++;
+}
+
+void exprFail(ExprParser& P, const string& msg) {
+    if (P.error.empty()) P.error = msg;
+}
+
+int exprInternName(CompiledExpr& ce, const string& name) {
+    for (size_t i = 0; i < ce.names.size(); i++)
+        if (ce.names[i] == name) return i;
+    ce.names.push_back(name);
+    return ce.names.size() - 1;
+}
+
+void exprEmit(ExprParser& P, ExprOp op, int var = -1, float num = 0) {
+    ExprInstr in;
+    in.op = op; in.var = var; in.num = num;
+    P.out->code.push_back(in);
+    if (op == EOP_NUM || op == EOP_VAR) {
+        if (++P.depth > EXPR_MAX_STACK) exprFail(P, "Expression too long");
+    } else if (op >= EOP_ADD) {
+        P.depth--;
+    }
+}
+
+// Binary operator at the cursor: returns its precedence (0 = none)
+int exprPeekBinary(ExprParser& P, ExprOp& op) {
+    exprSkipSpaces(P);
+    switch (P.s[P.pos]) {
+        case '|': op = EOP_OR;  return 1;
+        case '&': op = EOP_AND; return 2;
+        case '<': op = EOP_LT;  return 3;
+        case '>': op = EOP_GT;  return 3;
+        case '=': op = EOP_EQ;  return 3;
+        case '+': op = EOP_ADD; return 4;
+        case '-': op = EOP_SUB; return 4;
+        case '*': op = EOP_MUL; return 5;
+        case '/': op = EOP_DIV; return 5;
+        case '%': op = EOP_MOD; return 5;
+    }
+    return 0;
+}
+
+bool exprStartsOperand(ExprParser& P) {
+    exprSkipSpaces(P);
+    char c = P.s[P.pos];
+    return c == '(' || c == '-' || c == '.' || isExprIdentChar(c);
+}
+
+void exprParseBinary(ExprParser& P, int minPrec);
+
+void exprParseUnary(ExprParser& P) {
+    exprSkipSpaces(P);
+    if (!P.error.empty()) return;
+    if (P.nesting > EXPR_MAX_STACK) { exprFail(P, "Expression nested too deeply"); return; }
+    char c = P.s[P.pos];
+    if (c == '-') {
+        P.pos++;
+        P.nesting++; exprParseUnary(P); P.nesting--;
+        exprEmit(P, EOP_NEG);
+        return;
+    }
+    if (c == '(') {
+        P.pos++;
+        P.nesting++; exprParseBinary(P, 1); P.nesting--;
+        exprSkipSpaces(P);
+        if (P.s[P.pos] != ')') { exprFail(P, "Missing )"); return; }
+        P.pos++;
+        return;
+    }
+    if (isdigit((unsigned char)c) || c == '.') {
+        char* end;
+        double v = strtod(P.s + P.pos, &end);
+        if (end == P.s + P.pos) { exprFail(P, "Invalid number"); return; }
+        P.pos = end - P.s;
+        exprEmit(P, EOP_NUM, -1, (float)v);
+        return;
+    }
+    if (isExprIdentChar(c)) {
+        size_t start = P.pos;
+        while (isExprIdentChar(P.s[P.pos])) P.pos++;
+        string word(P.s + start, P.pos - start);
+        ExprOp fn = EOP_NUM;
+        if (word == "not") fn = EOP_NOT;
+        else if (word == "round") fn = EOP_ROUND;
+        else if (word == "abs") fn = EOP_ABS;
+        else if (word == "sqrt") fn = EOP_SQRT;
+        if (fn != EOP_NUM && exprStartsOperand(P)) {
+            P.nesting++; exprParseUnary(P); P.nesting--;
+            exprEmit(P, fn);
+            return;
+        }
+        exprEmit(P, EOP_VAR, exprInternName(*P.out, word));
+        return;
+    }
+    if (c == 0) exprFail(P, "Missing operand");
+    else exprFail(P, string("Unexpected '") + c + "'");
+}
+
+void exprParseBinary(ExprParser& P, int minPrec) {
+    exprParseUnary(P);
+    ExprOp op;
+    int prec;
+    while (P.error.empty() && (prec = exprPeekBinary(P, op)) >= minPrec && prec > 0) {
+        P.pos++;
+        exprParseBinary(P, prec + 1);
+        exprEmit(P, op);
+    }
+}
+
+// Parse 'src' into 'out'. An empty expression compiles to "0".
+// On a syntax error out.error is set and out.code is left empty.
+bool CompileExpr(const string& src, CompiledExpr& out) {
+    out.code.clear();
+    out.names.clear();
+    out.slots.clear();
+    out.epoch = -1;
+    out.targetVar = -1;
+    out.error.clear();
+
+    ExprParser P;
+    P.s = src.c_str(); P.pos = 0; P.depth = 0; P.nesting = 0; P.out = &out;
+    exprSkipSpaces(P);
+    if (P.s[P.pos] == 0) return true;
+    exprParseBinary(P, 1);
+    exprSkipSpaces(P);
+    if (P.error.empty() && P.s[P.pos] != 0) exprFail(P, string("Unexpected '") + P.s[P.pos] + "'");
+    if (!P.error.empty()) {
+        out.code.clear();
+        out.error = "Invalid expression \"" + src + "\": " + P.error;
+        return false;
+    }
+    return true;
+}
+
+// Bind variable names to their slots (at compile time, and again only if
+// the project was replaced since)
+void BindExprSlots(CompiledExpr& ce) {
+    ce.slots.resize(ce.names.size());
+    for (size_t i = 0; i < ce.names.size(); i++)
+        ce.slots[i] = internVariable(ce.names[i]);
+    ce.epoch = symbolEpoch;
+}
+
+float RunExpr(CompiledExpr& ce) {
+    if (!ce.error.empty()) { setError(ce.error); return 0; }
+    if (ce.epoch != symbolEpoch) BindExprSlots(ce);
+    if (ce.code.empty()) return 0;
+
+    float st[EXPR_MAX_STACK];
+    int sp = 0;
+    for (const ExprInstr& in : ce.code) {
+        switch (in.op) {
+            case EOP_NUM:
+                st[sp++] = in.num;
+                break;
+            case EOP_VAR: {
+                const Variable& v = variables[ce.slots[in.var]];
+                if (!v.alive) {
+                    setError("Undefined variable: " + v.name);
+                    st[sp++] = 0;
+                } else {
+                    st[sp++] = (float)v.value;
+                }
+                break;
             }
-            if (op == "%") {
-                if (r == 0) { setError("Mod by zero"); return 0; }
-                return fmod(l, r);
+            case EOP_NEG:   st[sp-1] = -st[sp-1]; break;
+            case EOP_NOT:   st[sp-1] = (st[sp-1] == 0) ? 1.0f : 0.0f; break;
+            case EOP_ROUND: st[sp-1] = roundf(st[sp-1]); break;
+            case EOP_ABS:   st[sp-1] = fabsf(st[sp-1]); break;
+            case EOP_SQRT:
+                if (st[sp-1] < 0) { setError("Square root of negative number"); st[sp-1] = 0; }
+                else st[sp-1] = sqrtf(st[sp-1]);
+                break;
+            default: {
+                float r = st[--sp];
+                float l = st[sp-1];
+                float v = 0;
+                switch (in.op) {
+                    case EOP_ADD: v = l + r; break;
+                    case EOP_SUB: v = l - r; break;
+                    case EOP_MUL: v = l * r; break;
+                    case EOP_DIV:
+                        if (r == 0) setError("Division by zero");
+                        else v = l / r;
+                        break;
+                    case EOP_MOD:
+                        if (r == 0) setError("Mod by zero");
+                        else v = fmod(l, r);
+                        break;
+                    case EOP_LT:  v = (l < r) ? 1.0f : 0.0f; break;
+                    case EOP_GT:  v = (l > r) ? 1.0f : 0.0f; break;
+                    case EOP_EQ:  v = (fabs(l - r) < 1e-6) ? 1.0f : 0.0f; break;
+                    case EOP_AND: v = (l != 0 && r != 0) ? 1.0f : 0.0f; break;
+                    case EOP_OR:  v = (l != 0 || r != 0) ? 1.0f : 0.0f; break;
+                    default: break;
+                }
+                st[sp-1] = v;
+                break;
             }
-            if (op == "<") return (l < r) ? 1.0f : 0.0f;
-            if (op == ">") return (l > r) ? 1.0f : 0.0f;
-            if (op == "=") return (fabs(l - r) < 1e-6) ? 1.0f : 0.0f;
-            if (op == "&") return (l != 0 && r != 0) ? 1.0f : 0.0f;
-            if (op == "|") return (l != 0 || r != 0) ? 1.0f : 0.0f;
         }
     }
-    // Handle unary 'not'
-    if (e.substr(0,3) == "not") {
-        string arg = e.substr(3);
-        float val = evalExpr(arg);
-        return (val == 0) ? 1.0f : 0.0f;
+    return sp > 0 ? st[sp-1] : 0;
+}
+
+// Compile the block's strValue on first use. The cache is dropped when the
+// block is edited (see the value editor in main.cpp).
+//   set / change:   "var=expr"  -> expr, with the target in names
+//   pick random:    "min,max"   -> expr, expr2
+//   letter of:      "index,str" -> expr (index only)
+//   variable, show / hide variable: no code, the name as target
+//   other operators: the whole text
+// Variable names are bound to slots here, once.
+void PrepareBlockExprs(Block& b) {
+    if (b.expr) return;
+    b.expr = make_shared<CompiledExpr>();
+    const string& src = b.strValue;
+    size_t split;
+    switch (b.type) {
+        case BLOCK_SET_VAR:
+        case BLOCK_CHANGE_VAR: {
+            string varName, expr;
+            if (!parseAssignment(src, varName, expr)) {
+                b.expr->error = "Invalid assignment format. Use var=expr";
+                return;
+            }
+            CompileExpr(expr, *b.expr);
+            b.expr->targetVar = exprInternName(*b.expr, varName);
+            break;
+        }
+        case BLOCK_VAR:
+        case BLOCK_SHOW_VARIABLE:
+        case BLOCK_HIDE_VARIABLE:
+            CompileExpr("", *b.expr);
+            b.expr->targetVar = exprInternName(*b.expr, src);
+            break;
+        case BLOCK_RANDOM:
+            split = src.find(',');
+            if (split == string::npos) {
+                CompileExpr(src, *b.expr);
+                break;
+            }
+            CompileExpr(src.substr(0, split), *b.expr);
+            b.expr2 = make_shared<CompiledExpr>();
+            CompileExpr(src.substr(split + 1), *b.expr2);
+            BindExprSlots(*b.expr2);
+            break;
+        case BLOCK_LETTER_OF:
+            split = src.find(',');
+            CompileExpr(src.substr(0, split), *b.expr);
+            break;
+        default:
+            CompileExpr(src, *b.expr);
+            break;
     }
-    // Check if it's a number
-    if (isNumber(e)) return (float)atof(e.c_str());
-    // Otherwise, treat as variable
-    int idx = findVariable(e);
-    if (idx != -1) return (float)variables[idx].value;
-    setError("Undefined variable: " + e);
-    return 0;
+    BindExprSlots(*b.expr);
+}
+
+// Slot of the variable a set / change / show / hide block names
+// (check variables[slot].alive), -1 if the block has no target
+int ExprTargetSlot(CompiledExpr& ce) {
+    if (ce.targetVar == -1) return -1;
+    if (ce.epoch != symbolEpoch) BindExprSlots(ce);
+    return ce.slots[ce.targetVar];
+}
+
+// One-off evaluation of arbitrary text (compiles on every call; blocks use
+// their cached CompiledExpr instead)
+float evalExpr(const string& expr) {
+    CompiledExpr ce;
+    CompileExpr(expr, ce);
+    return RunExpr(ce);
 }
 
 // Split assignment string like "var=10+score" into variable name and expression
@@ -76,13 +319,105 @@ bool isValidVarName(const string& name) {
     return !allDigits;
 }
 
-// ==================== UNDO/REDO ====================
+// ==================== SYMBOL TABLE ====================
+// Every variable name gets a permanent slot in 'variables' the first time
+// it is seen (defined, loaded, or referenced by a compiled block). Deleting
+// a variable only clears 'alive', so slots held by compiled blocks never
+// dangle. Names are found through an open-addressing hash (FNV-1a, linear
+// probing) in symbolBuckets; the slots themselves are plain array indexes.
+// A renamed slot is filed under both names, so blocks still using the old
+// one keep reading it.
+
+unsigned int hashSymbol(const string& name) {
+    unsigned int h = 2166136261u;
+    for (unsigned char c : name) { h ^= c; h *= 16777619u; }
+    return h;
+}
+
+// Bucket 'name' is filed in, or the empty bucket where it would go
+size_t findSymbolBucket(const string& name) {
+    size_t mask = symbolBuckets.size() - 1;
+    size_t b = hashSymbol(name) & mask;
+    while (symbolBuckets[b] != -1 && symbolKeys[b] != name) b = (b + 1) & mask;
+    return b;
+}
+
+// Slot of 'name', or -1 if the name was never interned
+int lookupSymbol(const string& name) {
+    if (symbolBuckets.empty()) return -1;
+    return symbolBuckets[findSymbolBucket(name)];
+}
+
+// Files 'name' under 'slot', replacing what it was filed under before
+void insertSymbol(const string& name, int slot) {
+    // keep the load factor under 1/2
+    if ((symbolCount + 1) * 2 > symbolBuckets.size()) {
+        vector<int> oldBuckets;
+        vector<string> oldKeys;
+        oldBuckets.swap(symbolBuckets);
+        oldKeys.swap(symbolKeys);
+        size_t cap = oldBuckets.empty() ? 64 : oldBuckets.size() * 2;
+        symbolBuckets.assign(cap, -1);
+        symbolKeys.assign(cap, string());
+        for (size_t i = 0; i < oldBuckets.size(); i++) {
+            if (oldBuckets[i] == -1) continue;
+            size_t b = findSymbolBucket(oldKeys[i]);
+            symbolBuckets[b] = oldBuckets[i];
+            symbolKeys[b].swap(oldKeys[i]);
+        }
+    }
+    size_t b = findSymbolBucket(name);
+    if (symbolBuckets[b] == -1) { symbolKeys[b] = name; symbolCount++; }
+    symbolBuckets[b] = slot;
+}
+
+// Slot of 'name', creating a (not alive) one if needed
+int internVariable(const string& name) {
+    int slot = lookupSymbol(name);
+    if (slot != -1) return slot;
+    Variable v;
+    v.name = name;
+    v.value = 0;
+    v.isShown = false;
+    v.rect = {0,0,0,0};
+    v.alive = false;
+    variables.push_back(v);
+    slot = variables.size() - 1;
+    insertSymbol(name, slot);
+    return slot;
+}
+
+// Drop every slot (new / loaded project); compiled blocks re-bind by name
+void resetSymbols() {
+    for (size_t i = 0; i < variables.size(); i++) NoteVariableChanged(i);
+    variables.clear();
+    symbolBuckets.clear();
+    symbolKeys.clear();
+    symbolCount = 0;
+    symbolEpoch++;
+}
+
+// Copy variable state from an undo snapshot without moving any slot
+void restoreVariables(const vector<Variable>& snapshot) {
+    for (auto& v : variables) v.alive = false;
+    for (auto& sv : snapshot) {
+        if (!sv.alive) continue;
+        int slot = internVariable(sv.name);
+        variables[slot] = sv;
+    }
+    for (size_t i = 0; i < variables.size(); i++) NoteVariableChanged(i);
+}
+
+int liveVariableCount() {
+    int n = 0;
+    for (auto& v : variables) if (v.alive) n++;
+    return n;
+}
 
 // Variable helpers
 int findVariable(const string& name) {
-    for (size_t i = 0; i < variables.size(); i++)
-        if (variables[i].name == name) return i;
-    return -1;
+    int slot = lookupSymbol(name);
+    return (slot != -1 && variables[slot].alive) ? slot : -1;
 }
 bool defineVariable(const string& name) {
     if (findVariable(name) != -1) return false;
@@ -90,54 +425,177 @@ bool defineVariable(const string& name) {
         setError("Variable name cannot be a number");
         return false;
     }
-    Variable v;
-    v.name = name;
+    int slot = internVariable(name);
+    Variable& v = variables[slot];
     v.value = 0;
     v.isShown = false;
     v.rect = {0,0,0,0};
-    variables.push_back(v);
-    pushState("Variable defined: " + name);
+    v.alive = true;
+    NoteVariableChanged(slot);
+    noteRunMutation(("Variable defined: " + name).c_str());
     return true;
 }
 
-void startScriptsForHat(BlockType hatType, const string& param = "") {
+// The variable keeps its slot and is filed under the new name too: blocks
+// bound to the slot and blocks still naming the old name both keep working.
+bool renameVariable(const string& oldName, const string& newName) {
+    int slot = findVariable(oldName);
+    if (slot == -1) { setError("Variable not defined: " + oldName); return false; }
+    if (!isValidVarName(newName)) { setError("Variable name cannot be a number"); return false; }
+    int other = findVariable(newName);
+    if (other != -1 && other != slot) { setError("Variable already exists: " + newName); return false; }
+    int was = lookupSymbol(newName);
+    insertSymbol(newName, slot);
+    // The name used to mean a dead slot: blocks bound to that one re-bind
+    if (was != -1 && was != slot) symbolEpoch++;
+    variables[slot].name = newName;
+    NoteVariableChanged(slot);
+    return true;
+}
+
+bool deleteVariable(const string& name) {
+    int slot = findVariable(name);
+    if (slot == -1) return false;
+    variables[slot].alive = false;
+    variables[slot].isShown = false;
+    NoteVariableChanged(slot);
+    return true;
+}
+
+// ==================== HAT INDEX ====================
+// A hat starts scripts while it is a top-level block on the plate. Every
+// place that links, unlinks, deletes or edits blocks calls IndexHat on the
+// blocks whose position changed, so firing an event only touches its
+// listeners.
+
+// Event names (messages, keys) get a permanent small id and a run queue
+int internEvent(const string& name) {
+    auto it = eventIds.find(name);
+    if (it != eventIds.end()) return it->second;
+    int id = eventNames.size();
+    eventNames.push_back(name);
+    eventIds[name] = id;
+    messageScripts.resize(eventNames.size());
+    return id;
+}
+
+// The block's strValue as an event id, interned once per edit
+int blockEventId(Block& b) {
+    if (b.eventId == -1) b.eventId = internEvent(b.strValue);
+    return b.eventId;
+}
+
+bool hatTakesParam(BlockType t) {
+    return t == BLOCK_WHEN_KEY || t == BLOCK_WHEN_RECEIVE;
+}
+
+int hatIndexParam(Block& b) {
+    return hatTakesParam(b.type) ? blockEventId(b) : -1;
+}
+
+void UnindexHat(BlockRef b) {
+    if (!b || !b->hatIndexed) return;
+    auto it = hatIndex.find(make_pair((int)b->type, b->hatParam));
+    if (it != hatIndex.end()) {
+        auto& list = it->second;
+        list.erase(remove(list.begin(), list.end(), b), list.end());
+        if (list.empty()) hatIndex.erase(it);
+    }
+    b->hatIndexed = false;
+    b->hatParam = -1;
+}
+
+// Bring b's entry in line with its current state (no-op for other blocks).
+// Each list is kept in layer order, front-most sprite first and the stage
+// last, so an event starts its scripts in the same order every time.
+void IndexHat(BlockRef b) {
+    if (!b) return;
+    bool listen = b->isHat() && !b->inPalette && !b->prev.lock();
+    if (b->hatIndexed && listen && b->hatParam == hatIndexParam(*b)) return;
+    UnindexHat(b);
+    if (!listen) return;
+    b->hatParam = hatIndexParam(*b);
+    auto& list = hatIndex[make_pair((int)b->type, b->hatParam)];
+    auto at = upper_bound(list.begin(), list.end(), b->owner,
+                          [](int owner, const BlockRef& o) { return owner > o->owner; });
+    list.insert(at, b);
+    b->hatIndexed = true;
+}
+
+// After scriptBlocks was replaced wholesale (load, restore, new project)
+void RebuildHatIndex() {
+    hatIndex.clear();
     for (auto& b : scriptBlocks) {
-        if (b->type == hatType && !b->prev.lock()) {
-            if (hatType == BLOCK_WHEN_KEY) {
-                if (b->strValue != param) continue;
-            } else if (hatType == BLOCK_WHEN_RECEIVE) {
-                if (b->strValue != param) continue;
-            }
-            ScriptState s;
-            s.current = b->next;
-            s.waitFrames = 0;
-            s.waitingForBroadcast = "";
-            s.waitingChildren = 0;
-            if (hatType == BLOCK_WHEN_FLAG) flagScripts.push_back(s);
-            else if (hatType == BLOCK_WHEN_KEY) spaceScripts.push_back(s);
-            else if (hatType == BLOCK_WHEN_CLICKED) clickScripts.push_back(s);
-            else if (hatType == BLOCK_WHEN_RECEIVE) messageScripts[param].push_back(s);
-        }
+        b->hatIndexed = false;
+        IndexHat(b);
     }
 }
 
+// Starts every script under a matching hat; returns how many were started.
+// eventId is -1 for hats without a parameter; reportsTo tags receivers of a
+// broadcast-and-wait with the entry they count down when they finish.
+// Each script runs as the target that owns it. clone is the clone id the
+// scripts run as (-1: the sprite itself), which only starts its parent's
+// scripts; keys and broadcasts start them once more for every live clone.
+// target limits the scripts to one target's (ANY_TARGET: all of them).
+int startScriptsForHatId(BlockType hatType, int eventId, int reportsTo = -1, int clone = -1, int target = ANY_TARGET) {
+    if (hatType == BLOCK_WHEN_FLAG) DeleteAllClones();   // a new run starts without clones
+    auto it = hatIndex.find(make_pair((int)hatType, eventId));
+    if (it == hatIndex.end()) return 0;
+    if (clone != -1) target = clones.parent[clone];
+    int started = 0;
+    for (auto& b : it->second) {
+        if (target != ANY_TARGET && b->owner != target) continue;
+        ScriptState s;
+        s.program = GetScriptProgram(b);
+        s.pc = 0;
+        s.reportsTo = reportsTo;
+        s.target = b->owner;
+        s.clone = clone;
+        if (clone != -1) s.cloneGen = clones.gen[clone];
+        if (hatType == BLOCK_WHEN_FLAG) flagScripts.push_back(s);
+        else if (hatType == BLOCK_WHEN_KEY) spaceScripts.push_back(s);
+        else if (hatType == BLOCK_WHEN_CLICKED) clickScripts.push_back(s);
+        else if (hatType == BLOCK_WHEN_RECEIVE) messageScripts[eventId].push_back(s);
+        else if (hatType == BLOCK_WHEN_CLONE_START) cloneScripts.push_back(s);
+        started++;
+    }
+    if (clone == -1 && (hatType == BLOCK_WHEN_KEY || hatType == BLOCK_WHEN_RECEIVE))
+        for (int id : clones.live) started += startScriptsForHatId(hatType, eventId, reportsTo, id);
+    return started;
+}
+
+int startScriptsForHat(BlockType hatType, const string& param = "") {
+    return startScriptsForHatId(hatType, hatTakesParam(hatType) ? internEvent(param) : -1);
+}
+
+void seedScriptRand(unsigned seed) {
+    scriptRandState = seed;
+}
+
+// Uniform in [0, 1]
+double scriptRandom() {
+    scriptRandState = scriptRandState * 1103515245u + 12345u;
+    return (scriptRandState >> 8) / (double)0xFFFFFF;
+}
+
 void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
     switch (block.type) {
         case BLOCK_MOVE_STEPS: {
             double oldX = sprite.scratchx, oldY = sprite.scratchy;
             Move_Sprite(sprite, mainStage, block.value);
             AddPenStroke(sprite, oldX, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("move " + to_string(block.value) + " steps");
+            noteRunMutation("move steps");
             break;
         }
         case BLOCK_TURN_RIGHT: {
             Turn_Sprite(sprite, block.value);
-            pushState("turn right " + to_string(block.value) + " degrees");
+            noteRunMutation("turn right");
             break;
         }
         case BLOCK_TURN_LEFT: {
             Turn_Sprite(sprite, -block.value);
-            pushState("turn left " + to_string(block.value) + " degrees");
+            noteRunMutation("turn left");
             break;
         }
         case BLOCK_GOTO_XY: {
@@ -145,7 +603,7 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.scratchx = block.value; sprite.scratchy = block.value2;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, oldX, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("go to x:" + to_string(block.value) + " y:" + to_string(block.value2));
+            noteRunMutation("go to x y");
             break;
         }
         case BLOCK_GOTO_RANDOM: {
@@ -163,11 +621,11 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             if (maxY < minY) { minY = maxY = 0; }
             double rangeX = maxX - minX;
             double rangeY = maxY - minY;
-            sprite.scratchx = minX + (rand() / (double)RAND_MAX) * rangeX;
-            sprite.scratchy = minY + (rand() / (double)RAND_MAX) * rangeY;
+            sprite.scratchx = minX + (scriptRandom()) * rangeX;
+            sprite.scratchy = minY + (scriptRandom()) * rangeY;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, oldX, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("go to random position");
+            noteRunMutation("go to random position");
             break;
         }
         case BLOCK_SET_X: {
@@ -175,7 +633,7 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.scratchx = block.value;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, oldX, sprite.scratchy, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("set x to " + to_string(block.value));
+            noteRunMutation("set x");
             break;
         }
         case BLOCK_SET_Y: {
@@ -183,7 +641,7 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.scratchy = block.value;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, sprite.scratchx, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("set y to " + to_string(block.value));
+            noteRunMutation("set y");
             break;
         }
         case BLOCK_CHANGE_X: {
@@ -191,7 +649,7 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.scratchx += block.value;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, oldX, sprite.scratchy, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("change x by " + to_string(block.value));
+            noteRunMutation("change x");
             break;
         }
         case BLOCK_CHANGE_Y: {
@@ -199,12 +657,12 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.scratchy += block.value;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, sprite.scratchx, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("change y by " + to_string(block.value));
+            noteRunMutation("change y");
             break;
         }
         case BLOCK_SET_DIR:
             sprite.direction = block.value;
-            pushState("point in direction " + to_string(block.value));
+            noteRunMutation("point in direction");
             break;
         case BLOCK_POINT_TO_MOUSE: {
             int mx, my;
@@ -214,7 +672,7 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             double dx = (mx - cx) - sprite.scratchx;
             double dy = (cy - my) - sprite.scratchy;
             sprite.direction = atan2(dy, dx) * 180.0 / M_PI;
-            pushState("point towards mouse");
+            noteRunMutation("point towards mouse");
             break;
         }
         case BLOCK_GLIDE: {
@@ -223,7 +681,7 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.scratchx = block.value; sprite.scratchy = block.value2;
             Clamp_Sprite_To_Stage_Bounds(sprite, mainStage);
             AddPenStroke(sprite, oldX, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("glide to x:" + to_string(block.value) + " y:" + to_string(block.value2));
+            noteRunMutation("glide");
             break;
         }
         case BLOCK_IF_EDGE_BOUNCE: {
@@ -263,115 +721,95 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             sprite.direction = fmod(sprite.direction, 360.0);
             if (sprite.direction < 0) sprite.direction += 360.0;
             AddPenStroke(sprite, oldX, oldY, sprite.scratchx, sprite.scratchy, renderer);
-            pushState("if on edge, bounce");
+            noteRunMutation("if on edge, bounce");
             break;
         }
-        case BLOCK_PEN_DOWN: sprite.penDown = true; pushState("pen down"); break;
-        case BLOCK_PEN_UP: sprite.penDown = false; pushState("pen up"); break;
+        case BLOCK_PEN_DOWN: sprite.penDown = true; noteRunMutation("pen down"); break;
+        case BLOCK_PEN_UP: sprite.penDown = false; noteRunMutation("pen up"); break;
         case BLOCK_SET_PEN_COLOR:
             sprite.penColor.r = (block.value >> 16) & 0xFF;
             sprite.penColor.g = (block.value >> 8) & 0xFF;
             sprite.penColor.b = block.value & 0xFF;
-            pushState("set pen color");
+            noteRunMutation("set pen color");
             break;
         case BLOCK_CHANGE_PEN_SIZE:
             sprite.penSize += block.value;
-            pushState("change pen size by " + to_string(block.value));
+            noteRunMutation("change pen size");
             break;
         case BLOCK_SET_PEN_SIZE:
             sprite.penSize = block.value;
-            pushState("set pen size to " + to_string(block.value));
+            noteRunMutation("set pen size");
             break;
         case BLOCK_ERASE_ALL:
-            sprite.penStrokes.clear();
-            sprite.stamps.clear();
-            pushState("erase all");
+            ClearPenCanvas(renderer);
+            noteRunMutation("erase all");
             break;
-        case BLOCK_STAMP: {
-            StampInfo stamp;
-            int cx = mainStage.rect.x + mainStage.rect.w/2;
-            int cy = mainStage.rect.y + mainStage.rect.h/2;
-            stamp.x = cx + (int)sprite.scratchx;
-            stamp.y = cy - (int)sprite.scratchy;
-            stamp.costumeIndex = sprite.currentCostumeIndex;
-            stamp.size = sprite.size;
-            stamp.direction = sprite.direction;
-            sprite.stamps.push_back(stamp);
-            pushState("stamp");
+        case BLOCK_STAMP:
+            StampSprite(sprite, renderer);
+            noteRunMutation("stamp");
             break;
-        }
         case BLOCK_PLAY_SOUND:
             if (catSound) {
                 Mix_VolumeMusic(MIX_MAX_VOLUME * soundVolume / 100);
                 Mix_PlayMusic(catSound, 0);
             }
-            pushState("play sound");
             break;
         case BLOCK_STOP_ALL_SOUNDS:
-            Mix_HaltMusic();
-            pushState("stop all sounds");
+            if (!headlessMode) Mix_HaltMusic();   // the mixer is shared by all engines
             break;
         case BLOCK_SET_VOLUME:
             soundVolume = block.value;
             if (soundVolume < 0) soundVolume = 0;
             if (soundVolume > 100) soundVolume = 100;
-            Mix_VolumeMusic(MIX_MAX_VOLUME * soundVolume / 100);
-            pushState("set volume to " + to_string(block.value) + "%");
+            if (!headlessMode) Mix_VolumeMusic(MIX_MAX_VOLUME * soundVolume / 100);
             break;
         case BLOCK_CHANGE_VOLUME:
             soundVolume += block.value;
             if (soundVolume < 0) soundVolume = 0;
             if (soundVolume > 100) soundVolume = 100;
-            Mix_VolumeMusic(MIX_MAX_VOLUME * soundVolume / 100);
-            pushState("change volume by " + to_string(block.value));
+            if (!headlessMode) Mix_VolumeMusic(MIX_MAX_VOLUME * soundVolume / 100);
             break;
         case BLOCK_SET_PITCH:
             soundPitch = block.value;
-            pushState("set pitch to " + to_string(block.value) + "%");
             break;
         case BLOCK_CHANGE_PITCH:
             soundPitch += block.value;
-            pushState("change pitch by " + to_string(block.value));
             break;
         case BLOCK_SAY:
-            sprite.message = block.strValue;
-            sprite.messageTimer = 2 * FPS;
+            ShowMessage(sprite, block.strValue, 2000);
             sprite.isThinking = false;
-            pushState("say " + block.strValue);
+            noteRunMutation("say");
             break;
         case BLOCK_SAY_FOR:
-            sprite.message = block.strValue;
-            sprite.messageTimer = block.value * FPS;
+            ShowMessage(sprite, block.strValue, BlockDurationMs(block));
             sprite.isThinking = false;
-            pushState("say " + block.strValue + " for " + to_string(block.value) + " secs");
+            noteRunMutation("say for secs");
             break;
         case BLOCK_THINK:
-            sprite.message = block.strValue;
-            sprite.messageTimer = 2 * FPS;
+            ShowMessage(sprite, block.strValue, 2000);
             sprite.isThinking = true;
-            pushState("think " + block.strValue);
+            noteRunMutation("think");
             break;
         case BLOCK_THINK_FOR:
-            sprite.message = block.strValue;
-            sprite.messageTimer = block.value * FPS;
+            ShowMessage(sprite, block.strValue, BlockDurationMs(block));
             sprite.isThinking = true;
-            pushState("think " + block.strValue + " for " + to_string(block.value) + " secs");
+            noteRunMutation("think for secs");
             break;
         case BLOCK_SHOW:
             sprite.isVisible = true;
-            pushState("show");
+            noteRunMutation("show");
             break;
         case BLOCK_HIDE:
             sprite.isVisible = false;
-            pushState("hide");
+            noteRunMutation("hide");
             break;
         case BLOCK_SET_SIZE:
             sprite.size = block.value;
-            pushState("set size to " + to_string(block.value) + "%");
+            noteRunMutation("set size");
             break;
         case BLOCK_CHANGE_SIZE:
             sprite.size += block.value;
-            pushState("change size by " + to_string(block.value));
+            noteRunMutation("change size");
             break;
         // Operators using expression evaluator
         case BLOCK_ADD:
@@ -400,36 +838,40 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
                 block.type == BLOCK_DIVIDE || block.type == BLOCK_MOD || block.type == BLOCK_LESS_THAN ||
                 block.type == BLOCK_EQUAL || block.type == BLOCK_GREATER_THAN || block.type == BLOCK_AND ||
                 block.type == BLOCK_OR || block.type == BLOCK_NOT) {
-                lastOperatorResult = (int)evalExpr(block.strValue);
+                PrepareBlockExprs(block);
+                lastOperatorResult = (int)RunExpr(*block.expr);
             }
             else if (block.type == BLOCK_RANDOM) {
                 // parse "min,max"
-                size_t comma = block.strValue.find(',');
-                if (comma != string::npos) {
-                    float minVal = evalExpr(block.strValue.substr(0, comma));
-                    float maxVal = evalExpr(block.strValue.substr(comma + 1));
+                PrepareBlockExprs(block);
+                if (block.expr2) {
+                    float minVal = RunExpr(*block.expr);
+                    float maxVal = RunExpr(*block.expr2);
                     if (maxVal < minVal) swap(minVal, maxVal);
-                    lastOperatorResult = minVal + (rand() / (float)RAND_MAX) * (maxVal - minVal);
+                    lastOperatorResult = minVal + (float)scriptRandom() * (maxVal - minVal);
                 } else {
-                    lastOperatorResult = evalExpr(block.strValue);
+                    lastOperatorResult = RunExpr(*block.expr);
                 }
             }
             else if (block.type == BLOCK_ROUND) {
-                lastOperatorResult = (int)round(evalExpr(block.strValue));
+                PrepareBlockExprs(block);
+                lastOperatorResult = (int)round(RunExpr(*block.expr));
             }
             else if (block.type == BLOCK_ABS) {
-                lastOperatorResult = abs((int)evalExpr(block.strValue));
+                PrepareBlockExprs(block);
+                lastOperatorResult = abs((int)RunExpr(*block.expr));
             }
             else if (block.type == BLOCK_SQRT) {
-                float val = evalExpr(block.strValue);
+                PrepareBlockExprs(block);
+                float val = RunExpr(*block.expr);
                 if (val >= 0) lastOperatorResult = (int)sqrt(val);
                 else { lastOperatorResult = 0; setError("Square root of negative number"); }
             }
             else if (block.type == BLOCK_JOIN) {
-                size_t comma = block.strValue.find(',');
+                size_t comma = block.strValue.str().find(',');
                 if (comma != string::npos) {
-                    string s1 = block.strValue.substr(0, comma);
-                    string s2 = block.strValue.substr(comma + 1);
+                    string s1 = block.strValue.str().substr(0, comma);
+                    string s2 = block.strValue.str().substr(comma + 1);
                     // evaluate? No, we want string concatenation. But our blocks store strings, not expressions.
                     // For simplicity, we treat as literal strings.
                     string result = s1 + s2;
@@ -438,12 +880,13 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
                 }
             }
             else if (block.type == BLOCK_LETTER_OF) {
-                size_t comma = block.strValue.find(',');
+                size_t comma = block.strValue.str().find(',');
                 if (comma != string::npos) {
-                    int idx = (int)evalExpr(block.strValue.substr(0, comma));
-                    string str = block.strValue.substr(comma + 1);
-                    if (idx >= 1 && idx <= (int)str.length())
-                        lastOperatorResult = str[idx-1];
+                    PrepareBlockExprs(block);
+                    int idx = (int)RunExpr(*block.expr);
+                    int len = block.strValue.str().length() - comma - 1;
+                    if (idx >= 1 && idx <= len)
+                        lastOperatorResult = block.strValue.str()[comma + idx];
                     else {
                         lastOperatorResult = 0;
                         setError("Letter index out of range");
@@ -451,91 +894,71 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
                 }
             }
             else if (block.type == BLOCK_LENGTH) {
-                lastOperatorResult = block.strValue.length();
+                lastOperatorResult = block.strValue.str().length();
             }
             else if (block.type == BLOCK_CONTAINS) {
-                size_t comma = block.strValue.find(',');
+                size_t comma = block.strValue.str().find(',');
                 if (comma != string::npos) {
-                    string s1 = block.strValue.substr(0, comma);
-                    string s2 = block.strValue.substr(comma + 1);
+                    string s1 = block.strValue.str().substr(0, comma);
+                    string s2 = block.strValue.str().substr(comma + 1);
                     lastOperatorResult = (s1.find(s2) != string::npos) ? 1 : 0;
                 }
             }
-            pushState("Operator executed");
             break;
 
         case BLOCK_DEFINE_VARIABLE:
             defineVariable(block.strValue);
             break;
-        case BLOCK_SET_VAR: {
-            string varName, expr;
-            if (parseAssignment(block.strValue, varName, expr)) {
-                int idx = findVariable(varName);
-                if (idx != -1) {
-                    variables[idx].value = (int)evalExpr(expr);
-                } else {
-                    setError("Variable not defined: " + varName);
-                }
-            } else {
-                setError("Invalid assignment format. Use var=expr");
-            }
-            pushState("set variable " + block.strValue);
-            break;
-        }
+        case BLOCK_SET_VAR:
         case BLOCK_CHANGE_VAR: {
-            string varName, expr;
-            if (parseAssignment(block.strValue, varName, expr)) {
-                int idx = findVariable(varName);
-                if (idx != -1) {
-                    variables[idx].value += (int)evalExpr(expr);
+            PrepareBlockExprs(block);
+            CompiledExpr& ce = *block.expr;
+            if (!ce.error.empty()) {
+                setError(ce.error);
+            } else {
+                int slot = ExprTargetSlot(ce);
+                if (variables[slot].alive) {
+                    int v = (int)RunExpr(ce);
+                    int old = variables[slot].value;
+                    if (block.type == BLOCK_SET_VAR) variables[slot].value = v;
+                    else variables[slot].value += v;
+                    if (variables[slot].value != old) NoteVariableChanged(slot);
                 } else {
-                    setError("Variable not defined: " + varName);
+                    setError("Variable not defined: " + ce.names[ce.targetVar]);
                 }
-            } else {
-                setError("Invalid assignment format. Use var=expr");
             }
-            pushState("change variable " + block.strValue);
+            noteRunMutation(block.type == BLOCK_SET_VAR ? "set variable" : "change variable");
             break;
         }
         case BLOCK_SHOW_VARIABLE: {
-            int idx = findVariable(block.strValue);
-            if (idx != -1) variables[idx].isShown = true;
-            pushState("show variable " + block.strValue);
+            PrepareBlockExprs(block);
+            Variable& v = variables[ExprTargetSlot(*block.expr)];
+            if (v.alive) v.isShown = true;
+            noteRunMutation("show variable");
             break;
         }
         case BLOCK_HIDE_VARIABLE: {
-            int idx = findVariable(block.strValue);
-            if (idx != -1) variables[idx].isShown = false;
-            pushState("hide variable " + block.strValue);
+            PrepareBlockExprs(block);
+            Variable& v = variables[ExprTargetSlot(*block.expr)];
+            if (v.alive) v.isShown = false;
+            noteRunMutation("hide variable");
             break;
         }
         case BLOCK_VAR:
             {
-                int idx = findVariable(block.strValue);
-                lastOperatorResult = (idx != -1) ? variables[idx].value : 0;
+                PrepareBlockExprs(block);
+                const Variable& v = variables[ExprTargetSlot(*block.expr)];
+                lastOperatorResult = v.alive ? v.value : 0;
             }
             break;
         case BLOCK_ASK:
-            sprite.message = block.strValue;
-            sprite.messageTimer = 2 * FPS;
+            ShowMessage(sprite, block.strValue, 2000);
             waitingForAnswer = true;
             SDL_StartTextInput();
-            pushState("ask " + block.strValue);
-            break;
-        case BLOCK_KEY_PRESSED: {
-            const Uint8* keystate = SDL_GetKeyboardState(NULL);
-            bool pressed = false;
-            if (block.strValue == "space") pressed = keystate[SDL_SCANCODE_SPACE];
-            else if (block.strValue == "up") pressed = keystate[SDL_SCANCODE_UP];
-            else if (block.strValue == "down") pressed = keystate[SDL_SCANCODE_DOWN];
-            else if (block.strValue == "left") pressed = keystate[SDL_SCANCODE_LEFT];
-            else if (block.strValue == "right") pressed = keystate[SDL_SCANCODE_RIGHT];
-            lastOperatorResult = pressed ? 1 : 0;
-            break;
-        }
-        case BLOCK_MOUSE_DOWN:
-            lastOperatorResult = (SDL_GetMouseState(NULL, NULL) & SDL_BUTTON(SDL_BUTTON_LEFT)) ? 1 : 0;
+            noteRunMutation("ask");
             break;
+        // "key pressed?" / "mouse down?" are conditions: the scheduler evaluates
+        // them with EvaluateCondition, from the per-frame inputState
         case BLOCK_DISTANCE_TO: {
             int mx, my;
             SDL_GetMouseState(&mx, &my);
@@ -547,25 +970,12 @@ void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer) {
             break;
         }
         case BLOCK_BROADCAST:
-            {
-                string msg = block.strValue;
-                vector<ScriptState> newReceivers;
-                for (auto& b : scriptBlocks) {
-                    if (b->type == BLOCK_WHEN_RECEIVE && b->strValue == msg && !b->prev.lock()) {
-                        ScriptState s;
-                        s.current = b->next;
-                        s.waitFrames = 0;
-                        s.waitingForBroadcast = "";
-                        s.waitingChildren = 0;
-                        newReceivers.push_back(s);
-                    }
-                }
-                if (!newReceivers.empty()) {
-                    messageScripts[msg].insert(messageScripts[msg].end(), newReceivers.begin(), newReceivers.end());
-                    scriptsRunning = true;
-                }
-                pushState("broadcast " + msg);
-            }
+            if (startScriptsForHatId(BLOCK_WHEN_RECEIVE, blockEventId(block)) > 0)
+                scriptsRunning = true;
+            break;
+        case BLOCK_CREATE_CLONE:
+            // runtime only: clones are not part of the project or its undo history
+            CreateClone(sprite);
             break;
         default:
             break;
@@ -3,19 +3,48 @@
 // hamed_exec.h — Hamed Arabpour
 // Block Interpreter & Variable Engine
 // ============================================================
-// Expression evaluator, variable helpers, hat-trigger
-// dispatcher, and the main ExecuteBlock switch-case.
+// Expression compiler (precedence climbing -> postfix code
+// cached on the block), variable symbol table (hashed names,
+// permanent slots), variable helpers, hat-trigger
+// dispatcher (incremental hat index), and the main
+// ExecuteBlock switch-case.
 // Style: sequential, guard clauses, explicit switch-case,
 //        minimal abstraction, no OOP patterns.
 // ============================================================
 
 bool  isNumber(const string& s);
+bool  CompileExpr(const string& src, CompiledExpr& out);
+void  BindExprSlots(CompiledExpr& ce);
+float RunExpr(CompiledExpr& ce);
+void  PrepareBlockExprs(Block& b);
+int   ExprTargetSlot(CompiledExpr& ce);
 float evalExpr(const string& expr);
 bool  parseAssignment(const string& str, string& varName, string& expr);
 bool  isValidVarName(const string& name);
 
+unsigned int hashSymbol(const string& name);
+int  lookupSymbol(const string& name);
+size_t findSymbolBucket(const string& name);
+void insertSymbol(const string& name, int slot);
+int  internVariable(const string& name);
+void resetSymbols();
+void restoreVariables(const vector<Variable>& snapshot);
+int  liveVariableCount();
+
 int  findVariable(const string& name);
 bool defineVariable(const string& name);
+bool renameVariable(const string& oldName, const string& newName);
+bool deleteVariable(const string& name);
 
-void startScriptsForHat(BlockType hatType, const string& param = "");
+int  internEvent(const string& name);
+int  blockEventId(Block& b);
+bool hatTakesParam(BlockType t);
+int  hatIndexParam(Block& b);
+void UnindexHat(BlockRef b);
+void IndexHat(BlockRef b);
+void RebuildHatIndex();
+int  startScriptsForHatId(BlockType hatType, int eventId, int reportsTo = -1, int clone = -1, int target = ANY_TARGET);
+int  startScriptsForHat(BlockType hatType, const string& param = "");
+void   seedScriptRand(unsigned seed);
+double scriptRandom();
 void ExecuteBlock(Block& block, Sprite& sprite, SDL_Renderer* renderer);
@@ -12,13 +12,12 @@ SDL_Surface* shrinkSurface(SDL_Surface* src, int factorW, int factorH) {
 }
 
 void FreeBlockTextures() {
-    for (auto& b : paletteBlocks) if (b.textTexture) SDL_DestroyTexture(b.textTexture);
-    for (auto& b : scriptBlocks) if (b->textTexture) SDL_DestroyTexture(b->textTexture);
+    ClearLabelTextures();
 }
 
 void Handle_Sprite_Drag_And_Drop(Sprite& s, Stage& st, const SDL_Event& e, int mx, int my) {
     if (!s.isDraggable) return;
-    if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button==SDL_BUTTON_LEFT && IsMouseOverRect(s.rect,mx,my)) {
+    if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button==SDL_BUTTON_LEFT && SpriteHitTest(s,mx,my)) {
         s.isBeingDragged = true; s.dragOffsetX = mx - s.rect.x; s.dragOffsetY = my - s.rect.y;
     }
     if (e.type == SDL_MOUSEMOTION && s.isBeingDragged) {
@@ -32,6 +31,33 @@ void Handle_Sprite_Drag_And_Drop(Sprite& s, Stage& st, const SDL_Event& e, int m
 Sprite Create_Sprite(int id, string n) {
     Sprite s; s.name = n; s.direction=90.0; return s;
 }
+// The sprite a target's scripts run as
+Sprite& TargetSprite(int target) {
+    return target == STAGE_TARGET ? stageTarget : allSprites[target];
+}
+
+void FreeSpriteCostumes(Sprite& s) {
+    for (auto& c : s.costumes) {
+        if (c.surface) {
+            auto it = penStampTextures.find(c.surface);
+            if (it != penStampTextures.end()) { SDL_DestroyTexture(it->second); penStampTextures.erase(it); }
+            SDL_FreeSurface(c.surface);
+        }
+        if (c.texture) SDL_DestroyTexture(c.texture);
+    }
+    s.costumes.clear();
+}
+
+// Drops the sprites from index n on; their clones must be deleted already
+void TruncateSprites(size_t n) {
+    while (allSprites.size() > n) {
+        FreeSpriteCostumes(allSprites.back());
+        allSprites.pop_back();
+    }
+    if (cloneProxy.size() > n) cloneProxy.resize(n);
+    if (editingTarget >= (int)n) editingTarget = n > 0 ? 0 : STAGE_TARGET;
+    ScrollSpriteList(0);
+}
 void Clamp_Sprite_To_Stage_Bounds(Sprite& s, Stage& st) {
     Update_Sprite_Render_Rect(s, st);
     double hw = st.rect.w/2.0, hh = st.rect.h/2.0;
@@ -55,24 +81,663 @@ void Clamp_Sprite_To_Stage_Bounds(Sprite& s, Stage& st) {
     }
     Update_Sprite_Render_Rect(s, st);
 }
-void DrawPenLines(SDL_Renderer* renderer) {
-    for (auto& s : allSprites) {
-        for (const auto& stroke : s.penStrokes) {
-            thickLineRGBA(renderer, stroke.x1, stroke.y1, stroke.x2, stroke.y2,
-                          stroke.size, stroke.color.r, stroke.color.g, stroke.color.b, 255);
+// ==================== COLLISION ====================
+// Each costume keeps a 1-bit mask of its opaque pixels. A sprite's mask is
+// re-sampled into stage orientation (size and direction applied) only when
+// its costume, size or direction changes; moving it just shifts the window
+// position. Sprites are bucketed into a grid of COLLISION_CELL-sized cells
+// over the stage, so "touching <sprite>?" only ANDs masks of sprites that
+// share a cell, 64 pixels per word.
+
+// Pixel of any surface format as 0xAARRGGBB (surface must be locked if it needs it)
+Uint32 SurfacePixel(SDL_Surface* surf, int x, int y) {
+    int bpp = surf->format->BytesPerPixel;
+    Uint32 px = 0;
+    memcpy(&px, (const Uint8*)surf->pixels + (size_t)y * surf->pitch + x * bpp, bpp);
+    Uint8 r, g, b, a;
+    SDL_GetRGBA(px, surf->format, &r, &g, &b, &a);
+    return ((Uint32)a << 24) | ((Uint32)r << 16) | ((Uint32)g << 8) | b;
+}
+
+shared_ptr<CollisionMask> BuildCollisionMask(SDL_Surface* surf) {
+    if (!surf) return nullptr;
+    auto m = make_shared<CollisionMask>();
+    m->w = surf->w; m->h = surf->h;
+    m->words = (surf->w + 63) / 64;
+    m->bits.assign((size_t)m->words * surf->h, 0);
+    if (SDL_MUSTLOCK(surf)) SDL_LockSurface(surf);
+    for (int y = 0; y < surf->h; y++) {
+        Uint64* out = &m->bits[(size_t)y * m->words];
+        for (int x = 0; x < surf->w; x++)
+            if (SurfacePixel(surf, x, y) >> 24) out[x >> 6] |= (Uint64)1 << (x & 63);
+    }
+    if (SDL_MUSTLOCK(surf)) SDL_UnlockSurface(surf);
+    return m;
+}
+
+// Sprites and clones share the grid under one key: the allSprites index,
+// or -1 - id for clone id
+SpriteCollision& CollisionEntry(int key) {
+    return key >= 0 ? spriteCollision[key] : clones.collision[-1 - key];
+}
+
+// Key of a sprite in allSprites or of the clone loaded into a proxy
+bool CollisionKeyOf(const Sprite& s, int& key) {
+    if (!allSprites.empty() && &s >= allSprites.data() && &s < allSprites.data() + allSprites.size()) {
+        key = &s - allSprites.data();
+        return key < (int)spriteCollision.size();
+    }
+    if (clones.loaded != -1 && &s == &cloneProxy[clones.parent[clones.loaded]]) {
+        key = -1 - clones.loaded;
+        return true;
+    }
+    return false;
+}
+
+// What collision needs of a sprite or clone; a clone not currently loaded
+// reads its arrays and takes costumes and name from its parent
+struct SpritePose {
+    const Sprite* sprite;
+    int costume;
+    double x, y, size, direction;
+    bool visible;
+};
+
+SpritePose PoseOf(const Sprite& s) {
+    return {&s, s.currentCostumeIndex, s.scratchx, s.scratchy, s.size, s.direction, s.isVisible};
+}
+
+SpritePose PoseOfKey(int key) {
+    if (key >= 0) return PoseOf(allSprites[key]);
+    int id = -1 - key;
+    if (clones.loaded == id) return PoseOf(cloneProxy[clones.parent[id]]);
+    return {&allSprites[clones.parent[id]], clones.costume[id], clones.x[id], clones.y[id],
+            clones.size[id], clones.direction[id], clones.visible[id] != 0};
+}
+
+void MarkKeyMoved(int key) {
+    SpriteCollision& c = CollisionEntry(key);
+    if (c.dirty) return;
+    c.dirty = true;
+    dirtySprites.push_back(key);
+}
+
+void MarkSpriteMoved(Sprite& s) {
+    int key;
+    if (CollisionKeyOf(s, key)) MarkKeyMoved(key);
+}
+
+void MarkCloneMoved(int id) {
+    MarkKeyMoved(-1 - id);
+}
+
+// Takes key out of the grid cells it is listed in
+void UnlistCollision(int key) {
+    SpriteCollision& c = CollisionEntry(key);
+    for (int cy = c.cellY0; cy <= c.cellY1; cy++)
+        for (int cx = c.cellX0; cx <= c.cellX1; cx++) {
+            vector<int>& cell = collisionGrid[(size_t)cy * collisionGridW + cx];
+            cell.erase(find(cell.begin(), cell.end(), key));
+        }
+    c.cellX0 = c.cellY0 = 0; c.cellX1 = c.cellY1 = -1;
+}
+
+// The transform SDL_RenderCopyEx applies when Draw_Sprite draws a costume,
+// inverted: maps a pixel of the stage-aligned box (ex,ey = its half size)
+// back into the unrotated dw x dh costume rect
+struct WorldXform {
+    int dw = 0, dh = 0, ex = 0, ey = 0;
+    double ca = 1, sa = 0;
+    WorldXform(const SpritePose& s, bool hasCostume) {
+        if (hasCostume) {
+            const Costume& c = s.sprite->costumes[s.costume];
+            dw = (int)(c.width * s.size / 100.0);
+            dh = (int)(c.height * s.size / 100.0);
+            double ang = (s.direction - 90.0) * M_PI / 180.0;
+            ca = cos(ang); sa = sin(ang);
+        } else {
+            // no costume: Draw_Sprite draws an upright square face
+            dw = dh = (int)(50 * s.size / 100.0);
+        }
+        if (dw <= 0 || dh <= 0) { dw = dh = 0; return; }
+        ex = (int)ceil((fabs(dw * ca) + fabs(dh * sa)) / 2.0);
+        ey = (int)ceil((fabs(dw * sa) + fabs(dh * ca)) / 2.0);
+    }
+    bool toCostume(int x, int y, double& lx, double& ly) const {
+        double dx = x + 0.5 - ex, dy = y + 0.5 - ey;
+        lx = dx * ca + dy * sa + dw / 2.0;
+        ly = -dx * sa + dy * ca + dh / 2.0;
+        return lx >= 0 && ly >= 0 && lx < dw && ly < dh;
+    }
+};
+
+// Resample the sprite's costume mask at its size and direction
+void BuildWorldMask(const SpritePose& s, SpriteCollision& c) {
+    const vector<Costume>& costumes = s.sprite->costumes;
+    int costume = costumes.empty() ? -1 : s.costume;
+    const CollisionMask* src = nullptr;
+    if (costume >= 0 && costume < (int)costumes.size()) src = costumes[costume].mask.get();
+    if (c.costume == costume && c.source == src && c.size == s.size && c.direction == s.direction) return;
+    c.costume = costume; c.source = src; c.size = s.size; c.direction = s.direction;
+    c.colorsValid = false;
+
+    CollisionMask& w = c.world;
+    WorldXform xf(s, src != nullptr);
+    if (xf.dw == 0) {
+        w.w = w.h = w.words = 0; w.bits.clear();
+        c.offX = c.offY = 0; c.used = {0, 0, 0, 0};
+        return;
+    }
+    w.w = 2 * xf.ex; w.h = 2 * xf.ey;
+    w.words = (w.w + 63) / 64;
+    w.bits.assign((size_t)w.words * w.h, 0);
+    c.offX = -xf.ex; c.offY = -xf.ey;
+
+    int minX = w.w, minY = w.h, maxX = -1, maxY = -1;
+    for (int y = 0; y < w.h; y++) {
+        Uint64* out = &w.bits[(size_t)y * w.words];
+        for (int x = 0; x < w.w; x++) {
+            double lx, ly;
+            if (!xf.toCostume(x, y, lx, ly)) continue;
+            if (src && !src->test((int)(lx * src->w / xf.dw), (int)(ly * src->h / xf.dh))) continue;
+            out[x >> 6] |= (Uint64)1 << (x & 63);
+            if (x < minX) minX = x;
+            if (x > maxX) maxX = x;
+            if (y < minY) minY = y;
+            maxY = y;
+        }
+    }
+    if (maxX < 0) c.used = {0, 0, 0, 0};
+    else c.used = {minX, minY, maxX - minX + 1, maxY - minY + 1};
+}
+
+// Bring one sprite's (or clone's) world mask and position up to date and
+// re-list it in the cells its opaque box now covers
+void UpdateSpriteCollision(int key) {
+    SpriteCollision& c = CollisionEntry(key);
+    c.dirty = false;
+    if (key < 0 && clones.parent[-1 - key] == -1) return;   // deleted since
+    SpritePose s = PoseOfKey(key);
+    BuildWorldMask(s, c);
+    const SDL_Rect& st = mainStage.rect;
+    c.x = st.x + st.w / 2 + (int)s.x + c.offX;
+    c.y = st.y + st.h / 2 - (int)s.y + c.offY;
+
+    int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+    if (c.used.w > 0) {
+        x0 = max(0, (c.x + c.used.x - st.x) / COLLISION_CELL);
+        y0 = max(0, (c.y + c.used.y - st.y) / COLLISION_CELL);
+        x1 = min(collisionGridW - 1, (c.x + c.used.x + c.used.w - 1 - st.x) / COLLISION_CELL);
+        y1 = min(collisionGridH - 1, (c.y + c.used.y + c.used.h - 1 - st.y) / COLLISION_CELL);
+        if (c.x + c.used.x + c.used.w <= st.x || c.y + c.used.y + c.used.h <= st.y) x1 = y1 = -1;
+    }
+    if (x0 == c.cellX0 && y0 == c.cellY0 && x1 == c.cellX1 && y1 == c.cellY1) return;
+
+    UnlistCollision(key);
+    c.cellX0 = x0; c.cellY0 = y0; c.cellX1 = x1; c.cellY1 = y1;
+    for (int cy = y0; cy <= y1; cy++)
+        for (int cx = x0; cx <= x1; cx++)
+            collisionGrid[(size_t)cy * collisionGridW + cx].push_back(key);
+}
+
+void SyncCollision() {
+    int gw = (mainStage.rect.w + COLLISION_CELL - 1) / COLLISION_CELL;
+    int gh = (mainStage.rect.h + COLLISION_CELL - 1) / COLLISION_CELL;
+    if (gw < 1) gw = 1;
+    if (gh < 1) gh = 1;
+    if (gw != collisionGridW || gh != collisionGridH || spriteCollision.size() != allSprites.size()) {
+        collisionGridW = gw; collisionGridH = gh;
+        collisionGrid.assign((size_t)gw * gh, vector<int>());
+        spriteCollision.resize(allSprites.size());
+        dirtySprites.clear();
+        for (size_t i = 0; i < spriteCollision.size(); i++) {
+            SpriteCollision& c = spriteCollision[i];
+            c.cellX0 = c.cellY0 = 0; c.cellX1 = c.cellY1 = -1;
+            c.dirty = true;
+            dirtySprites.push_back((int)i);
+        }
+        for (auto& c : clones.collision) {
+            c.cellX0 = c.cellY0 = 0; c.cellX1 = c.cellY1 = -1;
+            c.dirty = false;
+        }
+        for (int id : clones.live) MarkCloneMoved(id);
+    }
+    for (int i : dirtySprites) UpdateSpriteCollision(i);
+    dirtySprites.clear();
+}
+
+// 64 bits of a mask row starting at column x; columns outside the mask are 0
+Uint64 MaskBitsAt(const CollisionMask& m, int row, int x) {
+    if (x >= m.w || x <= -64) return 0;
+    const Uint64* r = &m.bits[(size_t)row * m.words];
+    if (x < 0) return r[0] << -x;
+    int wi = x >> 6, sh = x & 63;
+    Uint64 v = r[wi] >> sh;
+    if (sh && wi + 1 < m.words) v |= r[wi + 1] << (64 - sh);
+    return v;
+}
+
+bool MasksOverlap(const SpriteCollision& a, const SpriteCollision& b) {
+    if (a.used.w <= 0 || b.used.w <= 0) return false;
+    int x0 = max(a.x + a.used.x, b.x + b.used.x);
+    int y0 = max(a.y + a.used.y, b.y + b.used.y);
+    int x1 = min(a.x + a.used.x + a.used.w, b.x + b.used.x + b.used.w);
+    int y1 = min(a.y + a.used.y + a.used.h, b.y + b.used.y + b.used.h);
+    if (x0 >= x1 || y0 >= y1) return false;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x += 64) {
+            Uint64 bits = MaskBitsAt(a.world, y - a.y, x - a.x) & MaskBitsAt(b.world, y - b.y, x - b.x);
+            if (x1 - x < 64) bits &= ((Uint64)1 << (x1 - x)) - 1;
+            if (bits) return true;
         }
     }
+    return false;
+}
+
+// Collision state for any sprite: the cached entry for sprites in
+// allSprites and loaded clones, a one-off build into scratch otherwise
+const SpriteCollision& CollisionOf(const Sprite& s, SpriteCollision& scratch) {
+    SyncCollision();
+    int key;
+    if (CollisionKeyOf(s, key)) return CollisionEntry(key);
+    BuildWorldMask(PoseOf(s), scratch);
+    const SDL_Rect& st = mainStage.rect;
+    scratch.x = st.x + st.w / 2 + (int)s.scratchx + scratch.offX;
+    scratch.y = st.y + st.h / 2 - (int)s.scratchy + scratch.offY;
+    return scratch;
+}
+
+// Window point on an opaque pixel of the sprite (picking, ignores visibility)
+bool SpriteHitTest(const Sprite& s, int x, int y) {
+    SpriteCollision scratch;
+    const SpriteCollision& c = CollisionOf(s, scratch);
+    return c.world.test(x - c.x, y - c.y);
+}
+
+bool SpriteTouchingPoint(const Sprite& s, int x, int y) {
+    return s.isVisible && SpriteHitTest(s, x, y);
+}
+
+bool SpriteTouchingEdge(const Sprite& s) {
+    SpriteCollision scratch;
+    const SpriteCollision& c = CollisionOf(s, scratch);
+    if (c.used.w <= 0) return false;
+    const SDL_Rect& st = mainStage.rect;
+    return c.x + c.used.x < st.x || c.y + c.used.y < st.y ||
+           c.x + c.used.x + c.used.w > st.x + st.w || c.y + c.used.y + c.used.h > st.y + st.h;
 }
+
+// Starts a candidate walk over the grid: entries seen get this query's mark
+void NextCollisionQuery() {
+    if (++collisionQuery != 0) return;
+    for (auto& o : spriteCollision) o.queryMark = 0;
+    for (auto& o : clones.collision) o.queryMark = 0;
+    collisionQuery = 1;
+}
+
+bool SpriteTouchingSprite(const Sprite& s, const string& name) {
+    if (!s.isVisible) return false;
+    SpriteCollision scratch;
+    const SpriteCollision& c = CollisionOf(s, scratch);
+    if (c.used.w <= 0) return false;
+    const SDL_Rect& st = mainStage.rect;
+    int x0 = max(0, (c.x + c.used.x - st.x) / COLLISION_CELL);
+    int y0 = max(0, (c.y + c.used.y - st.y) / COLLISION_CELL);
+    int x1 = min(collisionGridW - 1, (c.x + c.used.x + c.used.w - 1 - st.x) / COLLISION_CELL);
+    int y1 = min(collisionGridH - 1, (c.y + c.used.y + c.used.h - 1 - st.y) / COLLISION_CELL);
+    NextCollisionQuery();
+    for (int cy = y0; cy <= y1; cy++) {
+        for (int cx = x0; cx <= x1; cx++) {
+            for (int j : collisionGrid[(size_t)cy * collisionGridW + cx]) {
+                SpriteCollision& o = CollisionEntry(j);
+                if (o.queryMark == collisionQuery) continue;
+                o.queryMark = collisionQuery;
+                if (&o == &c) continue;
+                SpritePose other = PoseOfKey(j);
+                if (!other.visible || other.sprite->name != name) continue;   // clones go by their parent's name
+                if (MasksOverlap(c, o)) return true;
+            }
+        }
+    }
+    return false;
+}
+
+// ==================== COLOR SENSING ====================
+// "touching color?" looks at what the stage shows under the sprite's opaque
+// pixels, leaving the sprite itself out. The backdrop and pen layer live in
+// stageComposite, rebuilt per grid cell only where the pen drew or the
+// backdrop changed. Other sprites are drawn over a scratch copy of the
+// queried box from their cached colour images (opaque where their mask is).
+
+// bit i set when (px[i] & mask) == color, for n <= 64 pixels
+Uint64 MatchColorBits(const Uint32* px, int n, Uint32 color, Uint32 mask) {
+    Uint64 bits = 0;
+    int i = 0;
+#if defined(__AVX2__)
+    __m256i m8 = _mm256_set1_epi32((int)mask), c8 = _mm256_set1_epi32((int)color);
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(px + i));
+        __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(v, m8), c8);
+        bits |= (Uint64)(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(eq)) << i;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i m4 = _mm_set1_epi32((int)mask), c4 = _mm_set1_epi32((int)color);
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(px + i));
+        __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(v, m4), c4);
+        bits |= (Uint64)(unsigned)_mm_movemask_ps(_mm_castsi128_ps(eq)) << i;
+    }
+#endif
+    for (; i < n; i++)
+        if ((px[i] & mask) == color) bits |= (Uint64)1 << i;
+    return bits;
+}
+
+// Stage-local rectangle whose backdrop or pen pixels changed
+void MarkStageDirty(int x, int y, int w, int h) {
+    int sw = mainStage.rect.w, sh = mainStage.rect.h;
+    if (compositeDirty.size() != (size_t)collisionGridW * collisionGridH) return;   // rebuilt whole anyway
+    if (w <= 0 || h <= 0 || x >= sw || y >= sh || x + w <= 0 || y + h <= 0) return;
+    int x0 = max(0, x) / COLLISION_CELL, x1 = min(sw - 1, x + w - 1) / COLLISION_CELL;
+    int y0 = max(0, y) / COLLISION_CELL, y1 = min(sh - 1, y + h - 1) / COLLISION_CELL;
+    for (int cy = y0; cy <= y1; cy++)
+        for (int cx = x0; cx <= x1; cx++) compositeDirty[(size_t)cy * collisionGridW + cx] = 1;
+}
+
+void MarkStageDirty() {
+    fill(compositeDirty.begin(), compositeDirty.end(), 1);
+}
+
+void SyncComposite() {
+    SyncCollision();
+    int sw = mainStage.rect.w, sh = mainStage.rect.h;
+    SDL_Surface* backdrop = nullptr;
+    int bi = mainStage.currentBackdropIndex;
+    if (bi >= 0 && bi < (int)mainStage.backdrops.size()) backdrop = mainStage.backdrops[bi].surface;
+    if (stageComposite.size() != (size_t)sw * sh || compositeDirty.size() != (size_t)collisionGridW * collisionGridH) {
+        stageComposite.assign((size_t)sw * sh, 0);
+        compositeDirty.assign((size_t)collisionGridW * collisionGridH, 1);
+    }
+    if (backdrop != compositeBackdrop) {
+        compositeBackdrop = backdrop;
+        MarkStageDirty();
+    }
+}
+
+// Rebuild the dirty cells inside a stage-local box: one pen readback for
+// their bounding rect, then backdrop + pen blended per pixel
+void RefreshComposite(int bx0, int by0, int bx1, int by1) {
+    int sw = mainStage.rect.w, sh = mainStage.rect.h;
+    int cx0 = bx0 / COLLISION_CELL, cy0 = by0 / COLLISION_CELL;
+    int cx1 = (bx1 - 1) / COLLISION_CELL, cy1 = (by1 - 1) / COLLISION_CELL;
+    int dx0 = cx1 + 1, dy0 = cy1 + 1, dx1 = -1, dy1 = -1;
+    for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++)
+            if (compositeDirty[(size_t)cy * collisionGridW + cx]) {
+                dx0 = min(dx0, cx); dx1 = max(dx1, cx);
+                dy0 = min(dy0, cy); dy1 = max(dy1, cy);
+            }
+    if (dx1 < 0) return;
+
+    SDL_Rect area = {dx0 * COLLISION_CELL, dy0 * COLLISION_CELL, 0, 0};
+    area.w = min(sw, (dx1 + 1) * COLLISION_CELL) - area.x;
+    area.h = min(sh, (dy1 + 1) * COLLISION_CELL) - area.y;
+
+    // pen pixels of the area as ARGB8888, from penSurface or read back from the target
+    const Uint32* pen = nullptr;
+    int penPitch = 0;
+    if (penSurface) {
+        pen = (const Uint32*)penSurface->pixels + (size_t)area.y * (penSurface->pitch / 4) + area.x;
+        penPitch = penSurface->pitch / 4;
+    } else if (penCanvas && g_renderer) {
+        penReadback.resize((size_t)area.w * area.h);
+        SDL_Texture* old = SDL_GetRenderTarget(g_renderer);
+        SDL_SetRenderTarget(g_renderer, penCanvas);
+        if (SDL_RenderReadPixels(g_renderer, &area, SDL_PIXELFORMAT_ARGB8888, penReadback.data(), area.w * 4) == 0) {
+            pen = penReadback.data();
+            penPitch = area.w;
+        }
+        SDL_SetRenderTarget(g_renderer, old);
+    }
+
+    SDL_Surface* bd = compositeBackdrop;
+    if (bd && SDL_MUSTLOCK(bd)) SDL_LockSurface(bd);
+    for (int cy = dy0; cy <= dy1; cy++) {
+        for (int cx = dx0; cx <= dx1; cx++) {
+            Uint8& dirty = compositeDirty[(size_t)cy * collisionGridW + cx];
+            if (!dirty) continue;
+            dirty = 0;
+            int x0 = cx * COLLISION_CELL, x1 = min(sw, x0 + COLLISION_CELL);
+            int y0 = cy * COLLISION_CELL, y1 = min(sh, y0 + COLLISION_CELL);
+            for (int y = y0; y < y1; y++) {
+                Uint32* out = &stageComposite[(size_t)y * sw];
+                const Uint32* penRow = pen ? pen + (size_t)(y - area.y) * penPitch - area.x : nullptr;
+                for (int x = x0; x < x1; x++) {
+                    Uint32 v = bd ? SurfacePixel(bd, x * bd->w / sw, y * bd->h / sh) & 0xFFFFFF : 0xFFFFFF;
+                    if (penRow) {
+                        Uint32 p = penRow[x], a = p >> 24;
+                        if (a == 255) v = p & 0xFFFFFF;
+                        else if (a) {
+                            Uint32 r = (((p >> 16) & 255) * a + ((v >> 16) & 255) * (255 - a)) / 255;
+                            Uint32 g = (((p >> 8) & 255) * a + ((v >> 8) & 255) * (255 - a)) / 255;
+                            Uint32 b = ((p & 255) * a + (v & 255) * (255 - a)) / 255;
+                            v = (r << 16) | (g << 8) | b;
+                        }
+                    }
+                    out[x] = v;
+                }
+            }
+        }
+    }
+    if (bd && SDL_MUSTLOCK(bd)) SDL_UnlockSurface(bd);
+}
+
+// Colour of every set pixel of the sprite's world mask
+void BuildWorldColors(const SpritePose& s, SpriteCollision& c) {
+    if (c.colorsValid) return;
+    c.colorsValid = true;
+    const CollisionMask& w = c.world;
+    c.colors.assign((size_t)w.w * w.h, 0);
+    SDL_Surface* surf = c.source ? s.sprite->costumes[c.costume].surface : nullptr;
+    if (!surf) {
+        // no costume (or no pixels kept): the face's body colour
+        for (int y = 0; y < w.h; y++)
+            for (int x = 0; x < w.w; x++)
+                if (w.test(x, y)) c.colors[(size_t)y * w.w + x] = 0xFFC864;
+        return;
+    }
+    WorldXform xf(s, true);
+    if (SDL_MUSTLOCK(surf)) SDL_LockSurface(surf);
+    for (int y = 0; y < w.h; y++) {
+        for (int x = 0; x < w.w; x++) {
+            double lx, ly;
+            if (!w.test(x, y) || !xf.toCostume(x, y, lx, ly)) continue;
+            c.colors[(size_t)y * w.w + x] = SurfacePixel(surf, (int)(lx * surf->w / xf.dw), (int)(ly * surf->h / xf.dh)) & 0xFFFFFF;
+        }
+    }
+    if (SDL_MUSTLOCK(surf)) SDL_UnlockSurface(surf);
+}
+
+bool SpriteTouchingColor(const Sprite& s, Uint32 rgb) {
+    if (!s.isVisible) return false;
+    SpriteCollision scratch;
+    const SpriteCollision& c = CollisionOf(s, scratch);
+    if (c.used.w <= 0) return false;
+    SyncComposite();
+
+    // the sprite's opaque box, clipped to the stage (window coordinates)
+    const SDL_Rect& st = mainStage.rect;
+    int bx0 = max(c.x + c.used.x, st.x), by0 = max(c.y + c.used.y, st.y);
+    int bx1 = min(c.x + c.used.x + c.used.w, st.x + st.w), by1 = min(c.y + c.used.y + c.used.h, st.y + st.h);
+    if (bx0 >= bx1 || by0 >= by1) return false;
+    int bw = bx1 - bx0, bh = by1 - by0;
+    RefreshComposite(bx0 - st.x, by0 - st.y, bx1 - st.x, by1 - st.y);
+
+    colorScratch.resize((size_t)bw * bh);
+    for (int y = 0; y < bh; y++)
+        memcpy(&colorScratch[(size_t)y * bw], &stageComposite[(size_t)(by0 - st.y + y) * st.w + (bx0 - st.x)], bw * 4);
+
+    // other visible sprites and clones over the box, in drawing order
+    // (clones in creation order, then the sprites)
+    vector<int>& over = overScratch;
+    over.clear();
+    NextCollisionQuery();
+    int cx0 = (bx0 - st.x) / COLLISION_CELL, cx1 = (bx1 - 1 - st.x) / COLLISION_CELL;
+    int cy0 = (by0 - st.y) / COLLISION_CELL, cy1 = (by1 - 1 - st.y) / COLLISION_CELL;
+    for (int cy = cy0; cy <= cy1; cy++)
+        for (int cx = cx0; cx <= cx1; cx++)
+            for (int j : collisionGrid[(size_t)cy * collisionGridW + cx]) {
+                SpriteCollision& o = CollisionEntry(j);
+                if (o.queryMark == collisionQuery) continue;
+                o.queryMark = collisionQuery;
+                if (&o != &c && PoseOfKey(j).visible) over.push_back(j);
+            }
+    sort(over.begin(), over.end(), [](int a, int b) {
+        if ((a < 0) != (b < 0)) return a < 0;
+        return a < 0 ? clones.seq[-1 - a] < clones.seq[-1 - b] : a < b;
+    });
+    for (int j : over) {
+        SpriteCollision& o = CollisionEntry(j);
+        BuildWorldColors(PoseOfKey(j), o);
+        int ox0 = max(bx0, o.x + o.used.x), ox1 = min(bx1, o.x + o.used.x + o.used.w);
+        int oy0 = max(by0, o.y + o.used.y), oy1 = min(by1, o.y + o.used.y + o.used.h);
+        for (int y = oy0; y < oy1; y++) {
+            Uint32* dst = &colorScratch[(size_t)(y - by0) * bw];
+            const Uint32* src = &o.colors[(size_t)(y - o.y) * o.world.w];
+            for (int x = ox0; x < ox1; x += 64) {
+                Uint64 bits = MaskBitsAt(o.world, y - o.y, x - o.x);
+                int n = min(64, ox1 - x);
+                for (int k = 0; k < n; k++)
+                    if ((bits >> k) & 1) dst[x + k - bx0] = src[x + k - o.x];
+            }
+        }
+    }
+
+    // any of the sprite's own pixels over a matching colour
+    Uint32 want = rgb & COLOR_MATCH_MASK;
+    for (int y = by0; y < by1; y++) {
+        const Uint32* row = &colorScratch[(size_t)(y - by0) * bw];
+        for (int x = bx0; x < bx1; x += 64) {
+            int n = min(64, bx1 - x);
+            Uint64 self = MaskBitsAt(c.world, y - c.y, x - c.x);
+            if (n < 64) self &= ((Uint64)1 << n) - 1;
+            if (self && (MatchColorBits(row + (x - bx0), n, want, COLOR_MATCH_MASK) & self)) return true;
+        }
+    }
+    return false;
+}
+
+// ==================== PEN CANVAS ====================
+// Pen strokes and stamps are drawn once into a stage-sized canvas, which
+// Render copies over the backdrop. With render-target support the canvas is
+// a target texture; otherwise it is a surface drawn by a software renderer
+// and uploaded to a streaming texture when it changed.
+bool EnsurePenCanvas(SDL_Renderer* renderer) {
+    if (!renderer) return false;   // no window (headless): pen marks are not kept
+    int w = mainStage.rect.w, h = mainStage.rect.h;
+    if (penCanvas) {
+        int cw, ch; SDL_QueryTexture(penCanvas, NULL, NULL, &cw, &ch);
+        if (cw == w && ch == h) return true;
+        FreePenCanvas();   // stage resized: start over
+    }
+    SDL_RendererInfo info;
+    bool targets = SDL_GetRendererInfo(renderer, &info) == 0 && (info.flags & SDL_RENDERER_TARGETTEXTURE);
+    if (targets) {
+        penCanvas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, w, h);
+    }
+    if (!penCanvas) {
+        penSurface = SDL_CreateRGBSurfaceWithFormat(0, w, h, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (!penSurface) return false;
+        penSoftRenderer = SDL_CreateSoftwareRenderer(penSurface);
+        penCanvas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, w, h);
+        if (!penSoftRenderer || !penCanvas) { FreePenCanvas(); return false; }
+    }
+    SDL_SetTextureBlendMode(penCanvas, SDL_BLENDMODE_BLEND);
+    ClearPenCanvas(renderer);
+    return true;
+}
+
+void FreePenCanvas() {
+    for (auto& it : penStampTextures) SDL_DestroyTexture(it.second);
+    penStampTextures.clear();
+    if (penSoftRenderer) { SDL_DestroyRenderer(penSoftRenderer); penSoftRenderer = nullptr; }
+    if (penSurface) { SDL_FreeSurface(penSurface); penSurface = nullptr; }
+    if (penCanvas) { SDL_DestroyTexture(penCanvas); penCanvas = nullptr; }
+    penSurfaceDirty = false;
+    MarkStageDirty();
+}
+
+// Renderer to draw pen marks with, in stage coordinates (0,0 = top left)
+SDL_Renderer* BeginPenDraw(SDL_Renderer* renderer) {
+    if (!EnsurePenCanvas(renderer)) return nullptr;
+    if (penSoftRenderer) { penSurfaceDirty = true; return penSoftRenderer; }
+    SDL_SetRenderTarget(renderer, penCanvas);
+    return renderer;
+}
+
+void EndPenDraw(SDL_Renderer* renderer) {
+    if (!penSoftRenderer) SDL_SetRenderTarget(renderer, NULL);
+}
+
+void ClearPenCanvas(SDL_Renderer* renderer) {
+    if (!penCanvas) return;
+    MarkStageDirty();
+    if (penSurface) {
+        SDL_FillRect(penSurface, NULL, 0);
+        penSurfaceDirty = true;
+        return;
+    }
+    SDL_SetRenderTarget(renderer, penCanvas);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderClear(renderer);
+    SDL_SetRenderTarget(renderer, NULL);
+}
+
+void DrawPenCanvas(SDL_Renderer* renderer) {
+    if (!penCanvas) return;
+    if (penSurfaceDirty) {
+        SDL_UpdateTexture(penCanvas, NULL, penSurface->pixels, penSurface->pitch);
+        penSurfaceDirty = false;
+    }
+    SDL_RenderCopy(renderer, penCanvas, NULL, &mainStage.rect);
+}
+
 void AddPenStroke(Sprite& sprite, double oldX, double oldY, double newX, double newY, SDL_Renderer* renderer) {
     if (!sprite.penDown) return;
-    int cx = mainStage.rect.x + mainStage.rect.w/2;
-    int cy = mainStage.rect.y + mainStage.rect.h/2;
-    PenStroke stroke;
-    stroke.x1 = cx + (int)oldX;
-    stroke.y1 = cy - (int)oldY;
-    stroke.x2 = cx + (int)newX;
-    stroke.y2 = cy - (int)newY;
-    stroke.size = sprite.penSize;
-    stroke.color = sprite.penColor;
-    sprite.penStrokes.push_back(stroke);
+    SDL_Renderer* pr = BeginPenDraw(renderer);
+    if (!pr) return;
+    int cx = mainStage.rect.w/2;
+    int cy = mainStage.rect.h/2;
+    int x0 = cx + (int)oldX, y0 = cy - (int)oldY, x1 = cx + (int)newX, y1 = cy - (int)newY;
+    thickLineRGBA(pr, x0, y0, x1, y1, sprite.penSize, sprite.penColor.r, sprite.penColor.g, sprite.penColor.b, 255);
+    EndPenDraw(renderer);
+    int pad = sprite.penSize / 2 + 2;
+    MarkStageDirty(min(x0, x1) - pad, min(y0, y1) - pad, abs(x1 - x0) + 2 * pad + 1, abs(y1 - y0) + 2 * pad + 1);
+}
+
+void StampSprite(Sprite& sprite, SDL_Renderer* renderer) {
+    SDL_Renderer* pr = BeginPenDraw(renderer);
+    if (!pr) return;
+    int x = mainStage.rect.w/2 + (int)sprite.scratchx;
+    int y = mainStage.rect.h/2 - (int)sprite.scratchy;
+    int ci = sprite.currentCostumeIndex;
+    bool hasCostume = ci >= 0 && ci < (int)sprite.costumes.size();
+    if (pr == renderer || !hasCostume) {
+        drawSpriteAtIndex(pr, sprite, ci, x, y, sprite.size, sprite.direction);
+    } else if (SDL_Surface* surf = sprite.costumes[ci].surface) {
+        // costume textures belong to the window renderer: use a copy made for the software one
+        SDL_Texture*& t = penStampTextures[surf];
+        if (!t) t = SDL_CreateTextureFromSurface(pr, surf);
+        const Costume& c = sprite.costumes[ci];
+        SDL_Rect rect;
+        rect.w = (int)(c.width * sprite.size / 100.0);
+        rect.h = (int)(c.height * sprite.size / 100.0);
+        rect.x = x - rect.w / 2;
+        rect.y = y - rect.h / 2;
+        SDL_RenderCopyEx(pr, t, NULL, &rect, sprite.direction - 90.0, NULL, SDL_FLIP_NONE);
+    }
+    EndPenDraw(renderer);
+    // the stamp covers the sprite's rotated box
+    int ext = (int)ceil(hypot(sprite.rect.w, sprite.rect.h) / 2) + 1;
+    MarkStageDirty(x - ext, y - ext, 2 * ext + 1, 2 * ext + 1);
 }
@@ -3,7 +3,8 @@
 // davoud_input.h — Davoud Samie Darian
 // Input Handling, Pen & Drag-Drop System
 // ============================================================
-// Sprite drag-and-drop, pen stroke recording & drawing,
+// Sprite drag-and-drop, collision masks, touching & color sensing,
+// pen canvas (strokes & stamps),
 // surface shrink utility, block texture cleanup.
 // Style: explicit boolean flags, direct coordinate math,
 //        manual event routing, index-based state checks.
@@ -14,5 +15,23 @@ void FreeBlockTextures();
 
 void Handle_Sprite_Drag_And_Drop(Sprite& sprite, Stage& stage, const SDL_Event& event, int mouseX, int mouseY);
 void Clamp_Sprite_To_Stage_Bounds(Sprite& sprite, Stage& stage);
-void DrawPenLines(SDL_Renderer* renderer);
+shared_ptr<CollisionMask> BuildCollisionMask(SDL_Surface* surface);
+void MarkSpriteMoved(Sprite& sprite);
+void MarkCloneMoved(int id);
+void UnlistCollision(int key);
+void SyncCollision();
+bool SpriteHitTest(const Sprite& sprite, int x, int y);
+bool SpriteTouchingPoint(const Sprite& sprite, int x, int y);
+bool SpriteTouchingEdge(const Sprite& sprite);
+bool SpriteTouchingSprite(const Sprite& sprite, const string& name);
+void MarkStageDirty(int x, int y, int w, int h);
+void MarkStageDirty();
+bool SpriteTouchingColor(const Sprite& sprite, Uint32 rgb);
+bool EnsurePenCanvas(SDL_Renderer* renderer);
+void FreePenCanvas();
+SDL_Renderer* BeginPenDraw(SDL_Renderer* renderer);
+void EndPenDraw(SDL_Renderer* renderer);
+void ClearPenCanvas(SDL_Renderer* renderer);
+void DrawPenCanvas(SDL_Renderer* renderer);
 void AddPenStroke(Sprite& sprite, double oldX, double oldY, double newX, double newY, SDL_Renderer* renderer);
+void StampSprite(Sprite& sprite, SDL_Renderer* renderer);
@@ -4,10 +4,10 @@ void setError(const string& msg) {
 }
 
 void addHistory(const string& desc, int stateIdx) {
+    if (historyLog.empty()) historyFirst = stateIdx;
     historyLog.push_back({desc, stateIdx});
-    if (historyLog.size() > MAX_HISTORY) {
-        historyLog.erase(historyLog.begin());
-    }
+    historyRows.clear();
+    if ((int)historyLog.size() > HISTORY_MEMORY && !historyInMemory) { historyLog.pop_front(); historyFirst++; }
 }
 
 void logAction(const string& msg, int stateIdx = -1) {
@@ -17,6 +17,13 @@ void logAction(const string& msg, int stateIdx = -1) {
     }
 }
 
+// Called for every executed block: reuses the log string's buffer
+// instead of building a temporary "Executed: ..." string each time.
+void logExecuted(const string& label) {
+    lastNormalLog.assign("Executed: ");
+    lastNormalLog += label;
+}
+
 string getOpenFileName() {
     const char* filters[] = { "*.txt" };
     const char* filename = tinyfd_openFileDialog("Open Project", "", 1, filters, "Text Files", 0);
@@ -29,6 +36,12 @@ string getSaveFileName() {
     return filename ? string(filename) : "";
 }
 
+string getProfileSaveFileName() {
+    const char* filters[] = { "*.csv" };
+    const char* filename = tinyfd_saveFileDialog("Export Profile", "profile.csv", 1, filters, "CSV Files");
+    return filename ? string(filename) : "";
+}
+
 // Helper function to get color based on category
 SDL_Color getCategoryColor(Category c) {
     switch(c) {
@@ -53,17 +66,33 @@ void saveProject(const string& filename) {
         return;
     }
     // version 2: supports value2 for GOTO_XY/GLIDE, strValue for arrow KEY_PRESSED, POINT_TO_MOUSE
-    file << "#ScratchProject 2\n";
-    Sprite& sp = allSprites[0];
-    file << "Sprite " << sp.scratchx << " " << sp.scratchy << " " << sp.direction << " " << sp.size << " "
-         << sp.isVisible << " " << sp.penDown << " " << (int)sp.penColor.r << " " << (int)sp.penColor.g << " " << (int)sp.penColor.b << " " << sp.penSize << "\n";
+    // version 3: every sprite in layer order with its costume files, the owner of each block
+    // version 4: the old names of each renamed variable, which blocks may still use
+    file << "#ScratchProject 4\n";
+    file << "Sprites " << allSprites.size() << "\n";
+    for (auto& sp : allSprites) {
+        file << "Sprite |" << sp.name << "| " << sp.scratchx << " " << sp.scratchy << " " << sp.direction << " " << sp.size << " "
+             << sp.isVisible << " " << sp.penDown << " " << (int)sp.penColor.r << " " << (int)sp.penColor.g << " " << (int)sp.penColor.b << " " << sp.penSize
+             << " " << sp.currentCostumeIndex << " " << sp.costumes.size() << "\n";
+        for (auto& c : sp.costumes)
+            file << "Costume |" << c.name << "| |" << c.path << "|\n";
+    }
     file << "Backdrop " << mainStage.currentBackdropIndex << "\n";
-    file << "Variables " << variables.size() << "\n";
-    for (auto& v : variables) {
-        file << "Var " << v.name << " " << v.value << " " << v.isShown << "\n";
+    file << "Variables " << liveVariableCount() << "\n";
+    vector<vector<string>> oldNames(variables.size());
+    for (size_t b = 0; b < symbolBuckets.size(); b++) {
+        int slot = symbolBuckets[b];
+        if (slot != -1 && symbolKeys[b] != variables[slot].name) oldNames[slot].push_back(symbolKeys[b]);
+    }
+    for (size_t i = 0; i < variables.size(); i++) {
+        auto& v = variables[i];
+        if (!v.alive) continue;  // slots of deleted / never defined names
+        file << "Var " << v.name << " " << v.value << " " << v.isShown << " " << oldNames[i].size();
+        for (auto& n : oldNames[i]) file << " " << n;
+        file << "\n";
     }
     file << "Blocks " << scriptBlocks.size() << "\n";
-    map<shared_ptr<Block>, int> idMap;
+    map<BlockRef, int> idMap;
     for (size_t i = 0; i < scriptBlocks.size(); i++) {
         idMap[scriptBlocks[i]] = i;
     }
@@ -71,12 +100,13 @@ void saveProject(const string& filename) {
         auto& b = scriptBlocks[i];
         int nextId = (b->next ? idMap[b->next] : -1);
         file << "Block " << i << " " << (int)b->type << " " << (int)b->category << " "
-             << "|" << b->baseLabel << "|" << "|" << b->label << "|" << "|" << b->strValue << "|"
+             << "|" << b->baseLabel.str() << "|" << "|" << b->label.str() << "|" << "|" << b->strValue.str() << "|"
              << " " << b->value << " " << b->value2
              << " " << b->rect.x << " " << b->rect.y << " " << b->rect.w << " " << b->rect.h
-             << " " << nextId << "\n";
+             << " " << nextId << " " << b->owner << "\n";
     }
     file.close();
+    projectPath = filename;
     logAction("Project saved to " + filename);
 }
 
@@ -89,20 +119,74 @@ void loadProject(const string& filename, SDL_Renderer* renderer) {
     string header;
     int version;
     file >> header >> version;
-    if (header != "#ScratchProject" || (version != 1 && version != 2)) {
-        setError("Invalid or unsupported project file (expected version 1 or 2)");
+    if (header != "#ScratchProject" || version < 1 || version > 4) {
+        setError("Invalid or unsupported project file (expected version 1 to 4)");
         return;
     }
-    scriptBlocks.clear();
-    variables.clear();
+    // Scripts run as sprites by index, and those are about to change
+    ClearScriptQueues();
+    scriptsRunning = false; isPaused = false; stepRequested = false;
+    PlateClear();
+    resetSymbols();
+
+    auto readPiped = [&]() {
+        string s; char c;
+        file >> c;
+        getline(file, s, '|');
+        return s;
+    };
+    auto readSpriteState = [&](Sprite& sp) {
+        file >> sp.scratchx >> sp.scratchy >> sp.direction >> sp.size >> sp.isVisible >> sp.penDown;
+        int r, g, b;
+        file >> r >> g >> b >> sp.penSize;
+        sp.penColor = { (Uint8)r, (Uint8)g, (Uint8)b, 255 };
+    };
 
     string token;
-    file >> token;
-    Sprite& sp = allSprites[0];
-    file >> sp.scratchx >> sp.scratchy >> sp.direction >> sp.size >> sp.isVisible >> sp.penDown;
-    int r, g, b;
-    file >> r >> g >> b >> sp.penSize;
-    sp.penColor = { (Uint8)r, (Uint8)g, (Uint8)b, 255 };
+    if (version < 3) {
+        // a single sprite, the first one
+        TruncateSprites(1);
+        file >> token;
+        readSpriteState(allSprites[0]);
+    } else {
+        file >> token;
+        int spriteCount;
+        file >> spriteCount;
+        vector<Sprite> loaded;
+        for (int i = 0; i < spriteCount && file; i++) {
+            file >> token; // "Sprite"
+            Sprite st = Create_Sprite(i, readPiped());
+            readSpriteState(st);
+            int costumeCount;
+            file >> st.currentCostumeIndex >> costumeCount;
+            vector<string> names, paths;
+            for (int c = 0; c < costumeCount && file; c++) {
+                file >> token; // "Costume"
+                names.push_back(readPiped());
+                paths.push_back(readPiped());
+            }
+            // Keep the costumes of a sprite already loaded from the same files
+            Sprite sp = Create_Sprite(i, st.name);
+            bool same = i < (int)allSprites.size() && allSprites[i].costumes.size() == paths.size();
+            for (size_t c = 0; same && c < paths.size(); c++) same = allSprites[i].costumes[c].path == paths[c];
+            if (same) {
+                sp.costumes.swap(allSprites[i].costumes);
+            } else {
+                for (size_t c = 0; c < paths.size(); c++) {
+                    Add_Costume_To_Sprite(renderer, sp, names[c], paths[c].c_str());
+                    if (sp.costumes.size() != c + 1) setError("Missing costume image " + paths[c]);
+                }
+            }
+            applySpriteState(sp, st);
+            if (sp.currentCostumeIndex < 0 || sp.currentCostumeIndex >= (int)sp.costumes.size()) sp.currentCostumeIndex = 0;
+            loaded.push_back(sp);
+        }
+        for (auto& old : allSprites) FreeSpriteCostumes(old);
+        allSprites.swap(loaded);
+        cloneProxy.clear();
+        if (editingTarget >= (int)allSprites.size()) editingTarget = allSprites.empty() ? STAGE_TARGET : 0;
+        ScrollSpriteList(0);
+    }
 
     file >> token;
     file >> mainStage.currentBackdropIndex;
@@ -114,35 +198,39 @@ void loadProject(const string& filename, SDL_Renderer* renderer) {
         file >> token;
         Variable v;
         file >> v.name >> v.value >> v.isShown;
-        variables.push_back(v);
+        v.rect = {0,0,0,0};
+        int slot = internVariable(v.name);
+        variables[slot] = v;
+        int oldNames = 0;
+        if (version >= 4) file >> oldNames;
+        for (int k = 0; k < oldNames && file; k++) {
+            string old;
+            file >> old;
+            insertSymbol(old, slot);
+        }
     }
 
     file >> token;
     int blockCount;
     file >> blockCount;
-    vector<shared_ptr<Block>> blocks(blockCount);
+    vector<BlockRef> blocks(blockCount);
     vector<int> nextIds(blockCount);
     for (int i = 0; i < blockCount; i++) {
         file >> token; // "Block"
         int id, typeInt, catInt;
         file >> id >> typeInt >> catInt;
-        auto b = make_shared<Block>();
+        auto b = NewBlock();
         b->type = (BlockType)typeInt;
         b->category = (Category)catInt;
 
-        auto readPiped = [&]() {
-            string s; char c;
-            file >> c;
-            getline(file, s, '|');
-            return s;
-        };
         b->baseLabel = readPiped();
         b->label     = readPiped();
         b->strValue  = readPiped();
         file >> b->value >> b->value2 >> b->rect.x >> b->rect.y >> b->rect.w >> b->rect.h >> nextIds[i];
+        if (version >= 3) file >> b->owner;
+        if (b->owner < STAGE_TARGET || b->owner >= (int)allSprites.size()) b->owner = allSprites.empty() ? STAGE_TARGET : 0;
         b->color = getCategoryColor((Category)catInt);
         b->inPalette = false;
-        b->textTexture = nullptr;
         b->next = nullptr;
         blocks[id] = b;
     }
@@ -157,8 +245,271 @@ void loadProject(const string& filename, SDL_Renderer* renderer) {
     for (auto& b : blocks) {
         UpdateBlockTexture(b, renderer);
     }
-    scriptBlocks = blocks;
+    for (auto& b : blocks) PlateAppend(b);
+    RebuildHatIndex();
 
+    projectPath = filename;
     logAction("Project loaded from " + filename);
     pushState("Loaded project");
 }
+
+// ==================== PROFILE EXPORT ====================
+// One row per profiled script and per profiled block:
+//   project,kind,id,script,sprite,label,count,total_ns,avg_ns
+// id is the block's index in the project file (Blocks section), script the
+// id of the hat it hangs under (-1 if none). For a script, count is the
+// number of blocks run in it and total_ns their time. Scripts are listed in
+// project order, then blocks from the most time to the least.
+
+const char* PROFILE_CSV_HEADER = "project,kind,id,script,sprite,label,count,total_ns,avg_ns\n";
+
+string csvField(const string& s) {
+    if (s.find_first_of(",\"\n\r") == string::npos) return s;
+    string out = "\"";
+    for (char c : s) {
+        if (c == '"') out += '"';
+        out += c;
+    }
+    return out + "\"";
+}
+
+void writeProfileCsv(ostream& out, const string& project) {
+    vector<int> scriptOf(blockProfile.size(), -1);
+    for (size_t i = 0; i < scriptBlocks.size(); i++) {
+        const BlockRef& hat = scriptBlocks[i];
+        if (!hat->isHat()) continue;
+        for (BlockRef b = hat->next; b; b = b->next)
+            if (b.slot < scriptOf.size()) scriptOf[b.slot] = (int)i;
+        const BlockProfile* p = ProfileOf(scriptProfile, hat.slot);
+        if (!p) continue;
+        out << csvField(project) << ",script," << i << "," << i << ","
+            << csvField(TargetSprite(hat->owner).name) << "," << csvField(hat->label) << ","
+            << p->count << "," << p->ns << "," << p->ns / p->count << "\n";
+    }
+    for (auto& row : CollectProfileRows(PROFILE_BY_TIME, scriptBlocks.size())) {
+        const Block& b = *row.block;
+        out << csvField(project) << ",block," << row.id << "," << scriptOf[row.block.slot] << ","
+            << csvField(TargetSprite(b.owner).name) << "," << csvField(b.label) << ","
+            << row.stats.count << "," << row.stats.ns << "," << row.stats.ns / row.stats.count << "\n";
+    }
+}
+
+void ExportProfileCsv(const string& filename) {
+    if (blockProfile.empty()) {
+        setError("No profile yet: turn on the profiler and run the project");
+        return;
+    }
+    ofstream file(filename);
+    if (!file.is_open()) {
+        setError("Failed to write " + filename);
+        return;
+    }
+    file << PROFILE_CSV_HEADER;
+    writeProfileCsv(file, projectPath);
+    logAction("Profile exported to " + filename);
+}
+
+// ==================== HEADLESS RUNNER ====================
+// scratch_editor --headless [--frames N] [--seed S] [--turbo] [--jobs J] [--out file.json]
+//                            [--profile file.csv] project.txt...
+// Loads a project without a window, clicks the green flag and runs frames
+// back to back until no script is left or N frames have run. Script time is
+// virtual (1000/FPS ms per frame) and every frame runs a fixed block budget,
+// so the same project and seed always give the same result. The final
+// sprite and variable state is written as JSON to stdout or --out; with
+// several projects, an array of those in command line order. Up to J
+// projects run at once, each on its own thread with its own engine.
+// --profile runs the profiler and writes every project's blocks to one CSV
+// (see PROFILE EXPORT); its times are wall clock, so they vary run to run.
+// Exit code: 0 ok, 1 a project or the output file failed, 2 bad arguments.
+
+string jsonString(const string& s) {
+    string out = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += (char)c; }
+        else if (c == '\n') out += "\\n";
+        else if (c == '\t') out += "\\t";
+        else if (c < 0x20) { char buf[8]; snprintf(buf, sizeof buf, "\\u%04x", c); out += buf; }
+        else out += (char)c;
+    }
+    return out + "\"";
+}
+
+string jsonNumber(double v) {
+    if (!std::isfinite(v)) return "null";
+    char buf[32];
+    snprintf(buf, sizeof buf, "%.15g", v);
+    return buf;
+}
+
+void writeHeadlessState(ostream& out, const string& project, int frames, bool finished) {
+    out << "{\n";
+    out << "  \"project\": " << jsonString(project) << ",\n";
+    out << "  \"frames\": " << frames << ",\n";
+    out << "  \"finished\": " << (finished ? "true" : "false") << ",\n";
+    out << "  \"scriptTimeMs\": " << scriptClockMs << ",\n";
+    out << "  \"blocksExecuted\": " << blocksExecuted << ",\n";
+    out << "  \"backdrop\": " << mainStage.currentBackdropIndex << ",\n";
+    out << "  \"clones\": " << clones.live.size() << ",\n";
+    out << "  \"sprites\": [";
+    for (size_t i = 0; i < allSprites.size(); i++) {
+        const Sprite& sp = allSprites[i];
+        out << (i ? ",\n" : "\n")
+            << "    {\"name\": " << jsonString(sp.name)
+            << ", \"x\": " << jsonNumber(sp.scratchx)
+            << ", \"y\": " << jsonNumber(sp.scratchy)
+            << ", \"direction\": " << jsonNumber(sp.direction)
+            << ", \"size\": " << jsonNumber(sp.size)
+            << ", \"costume\": " << sp.currentCostumeIndex
+            << ", \"visible\": " << (sp.isVisible ? "true" : "false")
+            << ", \"penDown\": " << (sp.penDown ? "true" : "false")
+            << ", \"message\": " << jsonString(sp.message) << "}";
+    }
+    out << (allSprites.empty() ? "],\n" : "\n  ],\n");
+    out << "  \"variables\": {";
+    bool first = true;
+    for (auto& v : variables) {
+        if (!v.alive) continue;
+        out << (first ? "\n" : ",\n") << "    " << jsonString(v.name) << ": " << v.value;
+        first = false;
+    }
+    out << (first ? "}\n" : "\n  }\n");
+    out << "}\n";
+}
+
+struct HeadlessJob {
+    string project;
+    string json;     // final state, empty if the project did not load
+    string error;
+    string profileCsv;   // --profile rows
+    int frames = 0;
+    long long blocks = 0;
+    double wallMs = 0;
+};
+
+// Runs one project on the calling thread's engine, which must be fresh
+void RunHeadlessJob(HeadlessJob& job, int maxFrames, unsigned seed, bool turbo, bool profile) {
+    headlessMode = true;
+    profilerEnabled = profile;
+    keepHistory = false;
+    turboMode = turbo;
+    seedScriptRand(seed);
+    CreateDefaultProject(nullptr);
+    errorMessage.clear();
+    loadProject(job.project, nullptr);
+    if (projectPath != job.project) {
+        job.error = errorMessage;
+        ReleaseEngine();
+        return;
+    }
+
+    auto wallStart = chrono::steady_clock::now();
+    scriptsRunning = true;
+    startScriptsForHat(BLOCK_WHEN_FLAG, "");
+    int frame = 0;
+    while (frame < maxFrames && scriptsRunning && AnyScriptsQueued()) {
+        if (waitingForAnswer) {
+            // Nobody to type: every "ask" is answered with an empty line
+            waitingForAnswer = false;
+            defineVariable("answer");
+            int idx = findVariable("answer");
+            if (idx != -1) { variables[idx].value = 0; NoteVariableChanged(idx); }
+        }
+        ExecuteScripts(nullptr);
+        frame++;
+    }
+    job.wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - wallStart).count();
+    job.frames = frame;
+    job.blocks = blocksExecuted;
+
+    ostringstream out;
+    writeHeadlessState(out, job.project, frame, !AnyScriptsQueued());
+    job.json = out.str();
+    if (profile) {
+        ostringstream csv;
+        writeProfileCsv(csv, job.project);
+        job.profileCsv = csv.str();
+    }
+    ReleaseEngine();
+}
+
+int RunHeadless(int argc, char* argv[]) {
+    const char* usage = "usage: scratch_editor --headless [--frames N] [--seed S] [--turbo] [--jobs J] [--out file.json]\n"
+                        "                                 [--profile file.csv] project.txt...\n";
+    int frames = 1800;   // 30 s of script time at 60 fps
+    unsigned seed = 0;
+    int jobCount = 1;
+    bool turbo = false;
+    string outPath, profilePath;
+    vector<HeadlessJob> jobs;
+    for (int i = 2; i < argc; i++) {
+        string a = argv[i];
+        if (a == "--frames" && i + 1 < argc) frames = atoi(argv[++i]);
+        else if (a == "--seed" && i + 1 < argc) seed = (unsigned)strtoul(argv[++i], nullptr, 10);
+        else if (a == "--jobs" && i + 1 < argc) jobCount = atoi(argv[++i]);
+        else if (a == "--out" && i + 1 < argc) outPath = argv[++i];
+        else if (a == "--profile" && i + 1 < argc) profilePath = argv[++i];
+        else if (a == "--turbo") turbo = true;
+        else if (!a.empty() && a[0] != '-') { jobs.push_back(HeadlessJob()); jobs.back().project = a; }
+        else { cerr << usage; return 2; }
+    }
+    if (jobs.empty() || frames < 0 || jobCount < 1) { cerr << usage; return 2; }
+    jobCount = min(jobCount, (int)jobs.size());
+
+    if (SDL_Init(SDL_INIT_TIMER) < 0)
+        cerr << "Error initializing SDL timer: " << SDL_GetError() << endl;
+
+    // Each project gets a thread of its own, so it starts from freshly
+    // constructed engine state; the workers only bound how many run at once
+    auto wallStart = chrono::steady_clock::now();
+    atomic<size_t> nextJob(0);
+    auto worker = [&]() {
+        for (size_t i; (i = nextJob++) < jobs.size(); ) {
+            thread t(RunHeadlessJob, ref(jobs[i]), frames, seed, turbo, !profilePath.empty());
+            t.join();
+        }
+    };
+    vector<thread> workers;
+    for (int w = 1; w < jobCount; w++) workers.emplace_back(worker);
+    worker();
+    for (auto& t : workers) t.join();
+    double wallMs = chrono::duration<double, milli>(chrono::steady_clock::now() - wallStart).count();
+
+    int status = 0;
+    ofstream file;
+    if (!outPath.empty()) {
+        file.open(outPath);
+        if (!file) { cerr << "Cannot write " << outPath << endl; status = 1; }
+    }
+    ostream& out = outPath.empty() ? cout : file;
+    bool several = jobs.size() > 1;
+    if (several) out << "[\n";
+    long long totalBlocks = 0;
+    bool first = true;
+    for (auto& job : jobs) {
+        if (job.json.empty()) {
+            cerr << job.project << ": " << job.error << endl;
+            status = 1;
+            continue;
+        }
+        if (several && !first) out << ",\n";
+        out << job.json;
+        first = false;
+        totalBlocks += job.blocks;
+        // wall time is the only nondeterministic number, so it stays off the JSON
+        cerr << job.project << ": " << job.frames << " frames, " << job.blocks << " blocks, "
+             << fixed << setprecision(1) << job.wallMs << " ms" << endl;
+    }
+    if (several) out << "]\n";
+    if (!profilePath.empty()) {
+        ofstream csv(profilePath);
+        if (!csv) { cerr << "Cannot write " << profilePath << endl; status = 1; }
+        csv << PROFILE_CSV_HEADER;
+        for (auto& job : jobs) csv << job.profileCsv;
+    }
+    if (several)
+        cerr << jobs.size() << " projects on " << jobCount << " threads: " << fixed << setprecision(1)
+             << wallMs << " ms, " << (long long)(totalBlocks / max(wallMs, 1e-3) * 1000) << " blocks/s" << endl;
+    SDL_Quit();
+    return status;
+}
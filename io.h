@@ -4,7 +4,8 @@
 // File I/O, Error Log & Category Colors
 // ============================================================
 // Project save/load (versioned text format), file dialogs,
-// error and action logging system, category color lookup.
+// error and action logging system, category color lookup,
+// profile CSV export and the headless runner.
 // Style: defensive checks, clear error messages,
 //        consistent naming, guarded file operations.
 // ============================================================
@@ -12,10 +13,20 @@
 void setError(const string& msg);
 void addHistory(const string& desc, int stateIdx);
 void logAction(const string& msg, int stateIdx = -1);
+void logExecuted(const string& label);
 
 string getOpenFileName();
 string getSaveFileName();
+string getProfileSaveFileName();
 SDL_Color getCategoryColor(Category c);
 
 void saveProject(const string& filename);
 void loadProject(const string& filename, SDL_Renderer* renderer);
+
+string csvField(const string& s);
+void   writeProfileCsv(ostream& out, const string& project);
+void   ExportProfileCsv(const string& filename);
+
+string jsonString(const string& s);
+string jsonNumber(double v);
+int  RunHeadless(int argc, char* argv[]);
@@ -2,7 +2,11 @@
 // Compile: g++ -std=c++11 -o scratch_editor scratch_editor_final.cpp tinyfiledialogs.c -lSDL2 -lSDL2_image -lSDL2_mixer -lSDL2_ttf -lSDL2_gfx -lcomdlg32 -lole32 -lm
 
 #define _USE_MATH_DEFINES
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include <iostream>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_mixer.h>
@@ -19,11 +23,28 @@
 #include <cstdlib>
 #include <ctime>
 #include <map>
+#include <deque>
 #include "tinyfiledialogs.h"
 #include <cstdio>
 #include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <cstring>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 using namespace std;
 
+// Globals marked thread_local make up one engine: the project (blocks,
+// sprites, stage, variables, undo log) and the interpreter running it.
+// Every thread gets its own, so the headless runner can execute several
+// projects at once (see HEADLESS RUNNER in ali_io.cpp). The editor only
+// ever uses the main thread's; layout, fonts and UI state are shared.
+
 // ==================== ENUMS ====================
 enum ButtonID {
     BTN_Play, BTN_Stop, BTN_Pause, BTN_Step,
@@ -36,6 +57,7 @@ enum ButtonID {
     BTN_Restore, BTN_Turbo, BTN_PP, BTN_DataSet,
     BTN_TempSave,
     BTN_TempLoad,
+    BTN_Profile, BTN_ExportProfile,
 };
 
 enum BlockType {
@@ -71,6 +93,8 @@ enum BlockType {
     BLOCK_ERASE_ALL, BLOCK_STAMP,
     // My Blocks
     BLOCK_MYBLOCK_DEFINE, BLOCK_MYBLOCK_CALL,
+    // Clones (appended: projects store block types by number)
+    BLOCK_CREATE_CLONE, BLOCK_WHEN_CLONE_START, BLOCK_DELETE_CLONE,
 };
 
 enum Category { CAT_MOTION, CAT_LOOKS, CAT_SOUND, CAT_EVENTS, CAT_CONTROL,
@@ -96,29 +120,157 @@ struct Panel {
     int count;
 };
 
+// One bit per pixel (alpha > 0), rows padded to whole 64-bit words
+struct CollisionMask {
+    int w = 0, h = 0, words = 0;
+    vector<Uint64> bits;
+    bool test(int x, int y) const {
+        return x >= 0 && y >= 0 && x < w && y < h && ((bits[(size_t)y * words + (x >> 6)] >> (x & 63)) & 1);
+    }
+};
+
 struct Costume {
     string name;
     SDL_Texture* texture;
     int width, height;
+    SDL_Surface* surface = nullptr;   // scaled pixels of texture (for pen stamps and sensing)
+    shared_ptr<CollisionMask> mask;   // of surface, for touching and picking
+    string path;                      // image file it was loaded from (saved with the project)
 };
 
-struct PenStroke {
-    int x1, y1, x2, y2;
-    int size;
-    SDL_Color color;
+struct Program;
+struct Block;
+
+// Compiled expression: the text of an operator / set / change block parsed
+// once into postfix code (see CompileExpr in hamed_exec.cpp)
+enum ExprOp : unsigned char {
+    EOP_NUM, EOP_VAR,
+    EOP_NEG, EOP_NOT, EOP_ROUND, EOP_ABS, EOP_SQRT,
+    EOP_ADD, EOP_SUB, EOP_MUL, EOP_DIV, EOP_MOD,
+    EOP_LT, EOP_GT, EOP_EQ, EOP_AND, EOP_OR
+};
+struct ExprInstr {
+    ExprOp op;
+    int var = -1;       // EOP_VAR: index into CompiledExpr::names
+    float num = 0;      // EOP_NUM
+};
+const int EXPR_MAX_STACK = 64;
+struct CompiledExpr {
+    vector<ExprInstr> code;  // postfix
+    vector<string> names;    // variables referenced by the code (and the target)
+    vector<int> slots;       // names bound to slots in 'variables'
+    int epoch = -1;          // symbolEpoch the slots were bound in
+    int targetVar = -1;      // set/change: index into names of the assigned variable
+    string error;            // parse error, reported each time it is evaluated
+};
+
+// Blocks live in a chunked arena (see BLOCK ARENA below) and are named by a
+// 32-bit slot number. BlockRef is the owning handle: the reference count
+// lives next to the slot, so there is no control block or allocation per
+// block. Slot 0 is the null handle.
+struct BlockRef {
+    uint32_t slot = 0;
+
+    BlockRef() {}
+    BlockRef(nullptr_t) {}
+    explicit BlockRef(uint32_t s);             // takes a reference on slot s
+    BlockRef(const BlockRef& o);
+    BlockRef(BlockRef&& o) noexcept : slot(o.slot) { o.slot = 0; }
+    ~BlockRef();
+    BlockRef& operator=(BlockRef o) noexcept { swap(slot, o.slot); return *this; }
+
+    Block* get() const;
+    Block* operator->() const { return get(); }
+    Block& operator*() const { return *get(); }
+    explicit operator bool() const { return slot != 0; }
+    bool operator==(const BlockRef& o) const { return slot == o.slot; }
+    bool operator!=(const BlockRef& o) const { return slot != o.slot; }
+    bool operator<(const BlockRef& o) const { return slot < o.slot; }
+    bool operator==(nullptr_t) const { return slot == 0; }
+    bool operator!=(nullptr_t) const { return slot != 0; }
+};
+
+// Non-owning handle (the prev links): remembers the slot's generation, so a
+// block that was freed and whose slot was reused reads as gone
+struct BlockWeak {
+    uint32_t slot = 0, gen = 0;
+
+    BlockWeak() {}
+    BlockWeak(const BlockRef& r);
+    BlockRef lock() const;
+    void reset() { slot = 0; gen = 0; }
+};
+
+// Interned block text: base label ("move {} steps"), label and strValue.
+// Every copy of a block shares its strings, and comparing two is one int
+thread_local deque<string> labelTexts(1);    // 0 = ""; a deque, so references stay valid as it grows
+thread_local map<string, int> labelIds;
+struct LabelRef {
+    int id = 0;
+
+    LabelRef() {}
+    LabelRef(const string& s) { *this = s; }
+    LabelRef& operator=(const string& s) {
+        auto it = labelIds.find(s);
+        if (it != labelIds.end()) { id = it->second; return *this; }
+        id = (int)labelTexts.size();
+        labelTexts.push_back(s);
+        labelIds[s] = id;
+        return *this;
+    }
+    const string& str() const { return labelTexts[id]; }
+    operator const string&() const { return str(); }
+    bool operator==(const LabelRef& o) const { return id == o.id; }
+    bool operator!=(const LabelRef& o) const { return id != o.id; }
+    bool empty() const { return id == 0 || str().empty(); }
+};
+
+// Block label textures are shared: one entry per (label, font size, colour),
+// counted by the blocks showing it (see LABEL TEXTURES in davoud_render.cpp)
+struct LabelTexture {
+    string label;
+    int size = 0;
+    SDL_Color color = {0, 0, 0, 0};
+    SDL_Texture* texture = nullptr;   // null until rasterized, and after eviction
+    int w = 0, h = 0;
+    int refs = 0;
+    int lruPrev = -1, lruNext = -1;   // rasterized entries, most recently drawn first
+    bool inUse = false;               // slot holds an entry
+};
+thread_local vector<LabelTexture> labelTextures;
+thread_local vector<int> freeLabelTextures;
+thread_local map<pair<string, Uint64>, int> labelTextureIds;
+thread_local deque<int> labelPrewarm;              // entries acquired but not rasterized yet
+thread_local int labelLruHead = -1, labelLruTail = -1;
+thread_local size_t labelTextureBytes = 0;
+const size_t LABEL_TEXTURE_BUDGET = 16 << 20;
+
+void ReleaseLabelTexture(int id);
+struct LabelTextureRef {
+    int id = -1;
+
+    LabelTextureRef() {}
+    explicit LabelTextureRef(int i) : id(i) { if (id >= 0) labelTextures[id].refs++; }
+    LabelTextureRef(const LabelTextureRef& o) : LabelTextureRef(o.id) {}
+    LabelTextureRef(LabelTextureRef&& o) noexcept : id(o.id) { o.id = -1; }
+    ~LabelTextureRef() { if (id >= 0) ReleaseLabelTexture(id); }
+    LabelTextureRef& operator=(LabelTextureRef o) noexcept { swap(id, o.id); return *this; }
 };
 
-struct StampInfo {
-    int x, y;
-    int costumeIndex;
-    double size;
-    double direction;
+// What undo restores on a block; type and base label never change
+struct BlockFields {
+    LabelRef label, strValue;
+    int value = 0, value2 = 0;
+    SDL_Rect rect = {0, 0, 0, 0};
+    BlockRef next;
+    BlockWeak prev;
 };
 
 struct Block {
     BlockType type;
     Category category;
-    string baseLabel, label, strValue;
+    LabelRef baseLabel;
+    LabelRef label, strValue;
     int value;
     int value2;
     SDL_Rect rect;
@@ -126,11 +278,17 @@ struct Block {
     bool isDragging = false;
     int dragOffX, dragOffY;
     bool inPalette;
-    SDL_Texture* textTexture = nullptr;
-    shared_ptr<Block> next;
-    weak_ptr<Block> prev;
-
-    bool hasEditableValue() const { return baseLabel.find("{}") != string::npos; }
+    LabelTextureRef labelTexture;
+    BlockRef next;
+    BlockWeak prev;
+    shared_ptr<Program> program;  // compiled stack, cached on hat blocks only
+    shared_ptr<CompiledExpr> expr, expr2;  // compiled strValue, dropped when it is edited
+    int eventId = -1;             // interned strValue of broadcast / hat blocks (see internEvent)
+    bool hatIndexed = false;      // listed in hatIndex under hatParam
+    int hatParam = -1;
+    int owner = 0;                // target the script belongs to: allSprites index or STAGE_TARGET
+
+    bool hasEditableValue() const { return baseLabel.str().find("{}") != string::npos; }
     bool hasTwoEditableValues() const {
         return type == BLOCK_ADD || type == BLOCK_SUBTRACT || type == BLOCK_MULTIPLY || type == BLOCK_DIVIDE ||
                type == BLOCK_LESS_THAN || type == BLOCK_EQUAL || type == BLOCK_GREATER_THAN ||
@@ -140,6 +298,7 @@ struct Block {
         return type == BLOCK_WHEN_KEY || type == BLOCK_BROADCAST || type == BLOCK_BROADCAST_WAIT || type == BLOCK_WHEN_RECEIVE ||
                type == BLOCK_LETTER_OF || type == BLOCK_LENGTH || type == BLOCK_CONTAINS ||
                type == BLOCK_SAY || type == BLOCK_SAY_FOR || type == BLOCK_THINK || type == BLOCK_THINK_FOR ||
+               type == BLOCK_TOUCHING ||
                // operators now also have string value (expression)
                type == BLOCK_ADD || type == BLOCK_SUBTRACT || type == BLOCK_MULTIPLY || type == BLOCK_DIVIDE ||
                type == BLOCK_RANDOM || type == BLOCK_LESS_THAN || type == BLOCK_EQUAL || type == BLOCK_GREATER_THAN ||
@@ -148,32 +307,128 @@ struct Block {
                type == BLOCK_JOIN || type == BLOCK_DEFINE_VARIABLE || type == BLOCK_SET_VAR || type == BLOCK_CHANGE_VAR ||
                type == BLOCK_VAR;
     }
-    bool isHat() const { return type == BLOCK_WHEN_FLAG || type == BLOCK_WHEN_KEY || type == BLOCK_WHEN_CLICKED || type == BLOCK_WHEN_RECEIVE; }
+    // "say {} for {} secs": a message field, then a seconds field
+    bool hasMessageAndSeconds() const { return type == BLOCK_SAY_FOR || type == BLOCK_THINK_FOR; }
+    bool isHat() const { return type == BLOCK_WHEN_FLAG || type == BLOCK_WHEN_KEY || type == BLOCK_WHEN_CLICKED || type == BLOCK_WHEN_RECEIVE ||
+                                type == BLOCK_WHEN_CLONE_START; }
     Block() : next(nullptr), prev(), value2(0) {}
 
-    shared_ptr<Block> clone() const {
-        auto newBlock = make_shared<Block>();
-        newBlock->type = type;
-        newBlock->category = category;
-        newBlock->baseLabel = baseLabel;
-        newBlock->label = label;
-        newBlock->strValue = strValue;
-        newBlock->value = value;
-        newBlock->value2 = value2;
-        newBlock->rect = rect;
-        newBlock->color = color;
-        newBlock->inPalette = inPalette;
-        newBlock->textTexture = nullptr;
-        if (next) newBlock->next = next->clone();
-        return newBlock;
-    }
+    // Undo bookkeeping (see pushState): fields as of the last undo entry
+    BlockFields undoBase;
+    bool undoListed = false;   // in scriptBlocks as of the last undo entry
+    bool undoEdited = false;   // in undoEdited: changed since the last undo entry
+    unsigned undoMark = 0;
+    int undoDelta = -1;        // scratch used while building an entry
+    int undoId = 0;            // name of the block in the history file, 0 = none yet
+};
+
+// ==================== BLOCK ARENA ====================
+// Blocks are allocated in chunks that never move, so a Block* stays valid
+// while its slot is referenced. Freed slots are reset, their generation is
+// bumped (stale BlockWeak handles then fail to lock) and they are reused.
+const int BLOCK_CHUNK_BITS = 10;
+const uint32_t BLOCK_CHUNK = 1u << BLOCK_CHUNK_BITS;
+const int BLOCK_MAX_CHUNKS = 4096;   // 4M blocks
+struct BlockSlot {
+    uint32_t refs = 0, gen = 0;
+};
+struct BlockChunk {
+    Block blocks[BLOCK_CHUNK];
+    BlockSlot slots[BLOCK_CHUNK];
 };
+struct BlockArena {
+    BlockChunk* chunks[BLOCK_MAX_CHUNKS] = {};
+    int chunkCount = 0;
+    vector<uint32_t> freeSlots;
+    vector<uint32_t> dying;          // slots whose last reference dropped, not yet reset
+    bool draining = false;
+    size_t live = 0;
+};
+thread_local BlockArena blockArena;
+
+inline BlockChunk& ChunkOf(uint32_t slot) { return *blockArena.chunks[slot >> BLOCK_CHUNK_BITS]; }
+inline Block* BlockAt(uint32_t slot) { return &ChunkOf(slot).blocks[slot & (BLOCK_CHUNK - 1)]; }
+inline BlockSlot& SlotOf(uint32_t slot) { return ChunkOf(slot).slots[slot & (BLOCK_CHUNK - 1)]; }
+
+// Resetting a block drops its next link, which can free the rest of a long
+// stack; the dying list keeps that iterative instead of recursing per block.
+inline void ReleaseBlockSlot(uint32_t slot) {
+    BlockArena& a = blockArena;
+    if (--SlotOf(slot).refs > 0) return;
+    a.dying.push_back(slot);
+    if (a.draining) return;
+    a.draining = true;
+    while (!a.dying.empty()) {
+        uint32_t s = a.dying.back();
+        a.dying.pop_back();
+        Block dead = move(*BlockAt(s));
+        *BlockAt(s) = Block();
+        SlotOf(s).gen++;
+        a.freeSlots.push_back(s);
+        a.live--;
+    }
+    a.draining = false;
+}
+
+inline BlockRef NewBlock() {
+    BlockArena& a = blockArena;
+    if (a.freeSlots.empty()) {
+        if (a.chunkCount == BLOCK_MAX_CHUNKS) {
+            fprintf(stderr, "Out of block slots\n");
+            abort();
+        }
+        uint32_t base = (uint32_t)a.chunkCount << BLOCK_CHUNK_BITS;
+        a.chunks[a.chunkCount++] = new BlockChunk();
+        for (uint32_t s = base + BLOCK_CHUNK; s-- > base; )
+            if (s) a.freeSlots.push_back(s);   // slot 0 is the null handle
+    }
+    uint32_t slot = a.freeSlots.back();
+    a.freeSlots.pop_back();
+    a.live++;
+    return BlockRef(slot);
+}
+// Ends the arena with its engine: the links between blocks (next, the undo
+// base, cached programs) are dropped first so no cycle keeps a block alive,
+// then the chunks are deleted once nothing else holds a block
+inline void FreeBlockArena() {
+    BlockArena& a = blockArena;
+    for (int c = 0; c < a.chunkCount; c++)
+        for (uint32_t i = 0; i < BLOCK_CHUNK; i++) {
+            Block& b = a.chunks[c]->blocks[i];
+            b.next = nullptr;
+            b.undoBase.next = nullptr;
+            b.program.reset();
+        }
+    if (a.live > 0) return;
+    for (int i = 0; i < a.chunkCount; i++) delete a.chunks[i];
+    a.chunkCount = 0;
+    a.freeSlots.clear();
+}
+inline BlockRef NewBlock(const Block& from) {
+    BlockRef b = NewBlock();
+    *b = from;
+    return b;
+}
+
+inline BlockRef::BlockRef(uint32_t s) : slot(s) { if (slot) SlotOf(slot).refs++; }
+inline BlockRef::BlockRef(const BlockRef& o) : slot(o.slot) { if (slot) SlotOf(slot).refs++; }
+inline BlockRef::~BlockRef() { if (slot) ReleaseBlockSlot(slot); }
+inline Block* BlockRef::get() const { return slot ? BlockAt(slot) : nullptr; }
+
+inline BlockWeak::BlockWeak(const BlockRef& r) : slot(r.slot), gen(r.slot ? SlotOf(r.slot).gen : 0) {}
+inline BlockRef BlockWeak::lock() const {
+    if (!slot) return BlockRef();
+    BlockSlot& info = SlotOf(slot);
+    if (info.gen != gen || info.refs == 0) return BlockRef();
+    return BlockRef(slot);
+}
 
 struct Variable {
     string name;
     int value;
     bool isShown;
     SDL_Rect rect;
+    bool alive = true;  // false: slot kept for a deleted / not yet defined name
 };
 
 struct Sprite {
@@ -188,10 +443,8 @@ struct Sprite {
     bool penDown = false;
     SDL_Color penColor;
     int penSize = 2;
-    vector<PenStroke> penStrokes;
-    vector<StampInfo> stamps;
     string message;
-    int messageTimer = 0;
+    long long messageUntil = 0;   // script clock ms the bubble expires, 0 = none
     bool isThinking = false;
 
     Sprite cloneState() const {
@@ -209,7 +462,7 @@ struct Sprite {
         s.penColor = penColor;
         s.penSize = penSize;
         s.message = message;
-        s.messageTimer = messageTimer;
+        s.messageUntil = messageUntil;
         s.isThinking = isThinking;
         return s;
     }
@@ -221,9 +474,10 @@ struct Stage {
     SDL_Rect rect;
 };
 
-void UpdateBlockTexture(shared_ptr<Block> block, SDL_Renderer* renderer);
+void UpdateBlockTexture(BlockRef block, SDL_Renderer* renderer);
 void DrawToolbar(SDL_Renderer* r, SDL_Rect& t, SDL_Color c);
 void RenderText(SDL_Renderer* r, int x, int y, const string& txt, SDL_Color col);
+int  TextWidth(const string& txt, int size);
 
 
 // ==================== CONSTANTS ====================
@@ -233,8 +487,8 @@ const int Toolbar_Height = 45, Blockbar_Width = 60, Empty_Height = 45,
 
 SDL_Rect toolbar = {0,0,1280,45}, BlockBar = {0,90,60,660}, BlocksFuncs = {60,90,240,700},
          Plate = {300,90,480,700}, Stage1 = {787,90,487,330}, BackDrop_List = {1194,426,80,300},
-         Sprite_Info = {787,426,401,300}, Sprite_List = {787,511,401,300},
-         File_Panel = {100,45,200,90}, Edit_Panel = {145,45,200,60}, Help_Panel = {1080,45,200,90};
+         Sprite_Info = {787,426,401,300}, Sprite_List = {787,489,401,56}, History_List = {787,549,401,136},
+         File_Panel = {100,45,200,90}, Edit_Panel = {145,45,200,120}, Help_Panel = {1080,45,200,90};
 
 // Colors
 SDL_Color Blue = {77,151,255,255}, DarkerBlue = {66,128,217,255}, Background = {229,240,255,255},
@@ -249,17 +503,25 @@ SDL_Color MotionColor = {74,155,252,255}, LooksColor = {154,106,255,255}, SoundC
           MyBlocksColor = {255,0,0,255};
 
 int MOUUSE_X, MOUUSE_Y;
+#ifdef _WIN32
 HWND g_hwnd = NULL;
+#endif
 SDL_Renderer* g_renderer = nullptr;  // global renderer for button callbacks
 
 // UI elements
-Button ToolBar_Button[4], BlockBar_Button[11], File_Panel_Button[3], Edit_Panel_Button[2], Help_Panel_Button[3];
+Button ToolBar_Button[4], BlockBar_Button[11], File_Panel_Button[3], Edit_Panel_Button[4], Help_Panel_Button[3];
 Panel File_BTN_Panel, Edit_BTN_Panel, Help_BTN_Panel;
-Stage mainStage;
+thread_local Stage mainStage;
 vector<Button*> allButtons;
-vector<Sprite> allSprites;
-vector<Block> paletteBlocks;
-vector<shared_ptr<Block>> scriptBlocks;
+thread_local vector<Sprite> allSprites;       // in layer order: the last one is drawn on top
+// Targets: scripts belong to a sprite (its allSprites index) or the stage,
+// which runs them as stageTarget, a hidden sprite without costumes
+const int STAGE_TARGET = -1, ANY_TARGET = -2;
+thread_local Sprite stageTarget;
+thread_local int editingTarget = 0;           // target whose scripts the plate shows
+thread_local int spriteListScroll = 0;        // first tile shown in the sprite list
+thread_local vector<Block> paletteBlocks;    // hold label texture refs, so per engine like the label cache
+thread_local vector<BlockRef> scriptBlocks;
 SDL_Texture* Scratch_Logo = nullptr;
 
 // Special buttons
@@ -276,13 +538,13 @@ Button RedoBtn = { {930,8,30,30}, Background, LightBlue, LightBlue_1, Black, But
 
 // Sound
 Mix_Music* catSound = nullptr;
-int soundVolume = 100;
-int soundPitch = 100;
+thread_local int soundVolume = 100;
+thread_local int soundPitch = 100;
 
 // Log/Error bar
-string errorMessage = "";
-string lastNormalLog = "";
-Uint32 errorMessageTimer = 0;
+thread_local string errorMessage = "";
+thread_local string lastNormalLog = "";
+thread_local Uint32 errorMessageTimer = 0;
 const Uint32 ERROR_MESSAGE_DURATION = 3000;
 
 void setError(const string& msg) {
@@ -290,68 +552,281 @@ void setError(const string& msg) {
     errorMessageTimer = SDL_GetTicks() + ERROR_MESSAGE_DURATION;
 }
 
-// History panel
+// History panel: one item per undo entry. Only the newest HISTORY_MEMORY
+// items stay in memory; older descriptions are read back from the history file
 struct HistoryItem {
     string description;
     int stateIndex;
 };
-vector<HistoryItem> historyLog;
-const int MAX_HISTORY = 20;
+thread_local deque<HistoryItem> historyLog;   // items historyFirst .. historyFirst + size - 1
+thread_local int historyFirst = 0;
+const int HISTORY_MEMORY = 256;
+int historyScroll = 0;   // rows scrolled back from the newest item
+// Descriptions of the rows on screen, newest first; fetched again only when
+// the panel scrolls or an item is added, as old ones come from the file
+thread_local vector<string> historyRows;
+thread_local int historyRowsNewest = -1;
 
 // Drag state
-shared_ptr<Block> draggedBlock = nullptr;
-bool draggingFromPalette = false;
-int dragOffX, dragOffY;
-shared_ptr<Block> snapCandidate = nullptr;
+thread_local BlockRef draggedBlock = nullptr;
+thread_local bool draggingFromPalette = false;
+thread_local int dragOffX, dragOffY;
+thread_local BlockRef snapCandidate = nullptr;
 
 // Click/drag detection
-bool potentialDrag = false;
-int clickStartX, clickStartY;
-Uint32 clickStartTime;
-shared_ptr<Block> clickBlock = nullptr;
-bool clickInValueArea = false;
-bool clickInValue2Area = false;
-bool clickInStringArea = false;
+thread_local bool potentialDrag = false;
+thread_local int clickStartX, clickStartY;
+thread_local Uint32 clickStartTime;
+thread_local BlockRef clickBlock = nullptr;
+thread_local int clickIndex = -1;   // clickBlock's index in scriptBlocks when pressed
+thread_local bool clickInValueArea = false;
+thread_local bool clickInValue2Area = false;
+thread_local bool clickInStringArea = false;
 
 // Script execution
+// A hat-rooted stack is compiled once into a flat instruction array with the
+// loop / if / else jump targets already resolved (see CompileScript).
+struct Instr {
+    BlockType op;
+    BlockRef block;  // source block: operands and step-mode highlight
+    int arg = 0;              // REPEAT count, WAIT seconds
+    int jump = -1;            // openers: index of matching END; END: index of its opener
+    int jump2 = -1;           // IF_ELSE: index of the END closing the else-branch
+};
+struct Program {
+    vector<Instr> code;
+    BlockWeak hat;            // the stack's hat, for per-script profiling
+};
 struct CallFrame {
-    shared_ptr<Block> returnTo;
-    shared_ptr<Block> loopStart;
+    int loopStart;            // first instruction of the loop body
+    int returnTo;             // instruction after the END, -1 for forever
     int remaining;
-    int iterCount = 0; // watchdog
 };
-// (watchdog)
-const int WATCHDOG_MAX_ITERS_PER_FRAME = 10000;
+// Scheduler: scripts run until they yield, sharing this fraction of each
+// frame; the rest is left for event handling and rendering.
+const double SCHED_FRAME_BUDGET = 0.75;
+// Turbo mode: loops do not yield, scripts get almost the whole frame and
+// the stage is only redrawn TURBO_RENDER_FPS times per second.
+const double TURBO_FRAME_BUDGET = 0.95;
+const int TURBO_RENDER_FPS = 10;
+const int TURBO_SLICE_US = 1000; // per-script slice so one loop cannot starve the rest
 struct ScriptState {
-    shared_ptr<Block> current;
+    shared_ptr<Program> program;  // kept alive even if the stack is edited mid-run
+    int pc = 0;
     vector<CallFrame> stack;
-    int waitFrames = 0;
-    string waitingForBroadcast;
-    int waitingChildren;
-    shared_ptr<Block> conditionBlock = nullptr;
+    int waitingOn = -1;   // broadcast-and-wait: index into broadcastWaits this script sleeps on
+    int reportsTo = -1;   // receiver started by a broadcast-and-wait: entry to count down when done
+    bool waitingForAnswer = false;  // this script owns the open "ask" prompt
+    BlockRef conditionBlock = nullptr;
+    int conditionValue = -1;  // what conditionBlock gave when it just ran, -1 = evaluate again
+    int target = 0;           // allSprites index it runs as (a clone's parent), or STAGE_TARGET
+    int clone = -1;           // clone id it runs as, -1 for the sprite itself
+    Uint32 cloneGen = 0;      // that clone's generation when the script started
 };
-vector<ScriptState> flagScripts, spaceScripts, clickScripts;
-map<string, vector<ScriptState>> messageScripts;
-
-bool scriptsRunning = false;
-bool penEnabled = false;
+thread_local vector<ScriptState> flagScripts, spaceScripts, clickScripts, cloneScripts;
+// Timer wheel: scripts sleeping in "wait" or "say/think for secs" leave
+// their run queue and are parked in sleepers until due. Times are in ms on
+// the script clock, which only advances while scripts run (not when paused).
+// Level L has WHEEL_SLOTS slots of WHEEL_SLOTS^L ms each; entries cascade
+// down a level as their time comes closer.
+const int WHEEL_BITS = 6, WHEEL_SLOTS = 1 << WHEEL_BITS, WHEEL_LEVELS = 4;
+// "wait until" with a false condition parks the script in sleepers too
+// (off the wheel), listed under every variable slot and input source the
+// condition reads; it is re-evaluated only after one of them changes.
+struct Sleeper {
+    ScriptState script;
+    vector<ScriptState>* home = nullptr;  // run queue to go back to
+    long long due = 0;
+    BlockRef condition;          // wait until: condition waited for
+    vector<int> deps;                     // variable slots, or -1 - InputSource
+    vector<unsigned> seen;                // deps' versions when last evaluated
+    int token = 0;                        // bumped when its watch entries go stale
+    bool queued = false;                  // already in conditionRecheck
+    bool edited = false;                  // its condition was edited: evaluate it again
+};
+thread_local vector<Sleeper> sleepers;
+thread_local vector<int> freeSleepers;
+thread_local vector<int> timerWheel[WHEEL_LEVELS][WHEEL_SLOTS];
+thread_local int sleepingCount = 0;
+enum InputSource {
+    INPUT_KEY_SPACE, INPUT_KEY_UP, INPUT_KEY_DOWN, INPUT_KEY_LEFT, INPUT_KEY_RIGHT,
+    INPUT_MOUSE_DOWN, INPUT_COUNT
+};
+struct WatchEntry { int id; int token; };
+struct WatchList {
+    unsigned version = 0;        // bumped on every change
+    vector<WatchEntry> waiters;  // sleepers to re-check on the next change
+    size_t compactAt = 16;       // drop stale entries when the list gets this long
+};
+thread_local vector<WatchList> variableWatch;     // by variable slot
+thread_local WatchList inputWatch[INPUT_COUNT];
+thread_local bool inputState[INPUT_COUNT] = {};   // sampled once per frame (PollInputSources)
+thread_local vector<int> conditionRecheck;
+thread_local bool conditionsEdited = false;   // a condition block was edited while scripts slept
+thread_local long long scriptClockMs = 0;
+thread_local chrono::steady_clock::time_point scriptClockLast;
+thread_local bool scriptClockRunning = false;
+thread_local long long messageExpiry = 0;   // earliest say/think deadline showing, 0 = none
+// Hat dispatch index: top-level hat blocks by (hat type, key / message id),
+// kept up to date by IndexHat / UnindexHat as blocks are edited
+thread_local map<pair<int, int>, vector<BlockRef>> hatIndex;
+// Broadcast messages and key names are interned to small ids (eventNames);
+// each message id has its own run queue. A deque, so adding a queue never
+// moves the ones being run.
+thread_local vector<string> eventNames;
+thread_local map<string, int> eventIds;
+thread_local deque<vector<ScriptState>> messageScripts;
+// Broadcast and wait: receivers still running per invocation (pooled)
+thread_local vector<int> broadcastWaits;
+thread_local vector<int> freeBroadcastWaits;
+
+thread_local bool scriptsRunning = false;
+thread_local bool penEnabled = false;
+
+// Headless runs (see HEADLESS RUNNER in ali_io.cpp): no window, and no wall
+// clock either. The script clock steps one frame per ExecuteScripts, and a
+// frame ends after a number of blocks instead of a time budget, so a run
+// gives the same result on every machine.
+thread_local bool headlessMode = false;
+const long long HEADLESS_FRAME_BLOCKS = 100000;   // replaces the frame budget
+const long long HEADLESS_SLICE_BLOCKS = 10000;    // replaces TURBO_SLICE_US
+thread_local long long headlessFrames = 0;                     // frames the script clock has stepped
+thread_local long long headlessBlockLimit = 0;                 // blocksExecuted at which this frame ends
+
+// Profiler (see PROFILER in hamed_ctrl.cpp): while profilerEnabled, every
+// block the interpreter runs is counted and timed, and the time is also
+// added to the hat-rooted script it ran in. Both tables are indexed by
+// block slot; an entry only counts while its generation matches the slot's.
+struct BlockProfile {
+    uint32_t gen = 0;
+    long long count = 0;   // blocks: times run; scripts: blocks run in it
+    long long ns = 0;
+};
+struct ProfileRow {
+    BlockRef block;
+    int id = 0;            // index in scriptBlocks: the block's number in a saved project
+    BlockProfile stats;
+};
+thread_local bool profilerEnabled = false;
+thread_local vector<BlockProfile> blockProfile;    // by block slot
+thread_local vector<BlockProfile> scriptProfile;   // by hat block slot
+thread_local BlockWeak profileBlock, profileHat;   // block being timed and its script
+thread_local chrono::steady_clock::time_point profileStart;
+// "Top blocks" table shown over the history panel while profiling
+enum ProfileSort { PROFILE_BY_TIME, PROFILE_BY_COUNT, PROFILE_BY_AVG };
+ProfileSort profileSort = PROFILE_BY_TIME;
+int profileScroll = 0;   // rows scrolled down from the top
+
+// Collision (see COLLISION in davoud_input.cpp): each sprite's costume mask
+// transformed by size and direction, and a uniform grid over the stage
+// listing the sprites whose mask bounds overlap each cell
+struct SpriteCollision {
+    CollisionMask world;          // stage-aligned mask
+    int offX = 0, offY = 0;       // its top-left relative to the sprite centre
+    SDL_Rect used = {0, 0, 0, 0}; // box of the set bits in world
+    int x = 0, y = 0;             // window position of world's top-left
+    int costume = -2;             // what world was built for (-1: no costume)
+    const CollisionMask* source = nullptr;   // costume mask it was built from
+    double size = 0, direction = 0;
+    int cellX0 = 0, cellY0 = 0, cellX1 = -1, cellY1 = -1;   // grid cells it is listed in
+    bool dirty = true;
+    unsigned queryMark = 0;
+    vector<Uint32> colors;        // 0x00RRGGBB under world's set bits, built on demand
+    bool colorsValid = false;
+};
+const int COLLISION_CELL = 32;
+thread_local vector<SpriteCollision> spriteCollision;   // parallel to allSprites
+thread_local vector<int> dirtySprites;
+thread_local vector<vector<int>> collisionGrid;
+thread_local int collisionGridW = 0, collisionGridH = 0;
+thread_local unsigned collisionQuery = 0;
+
+// Color sensing: CPU copy of the stage under the sprites (backdrop with the
+// pen layer over it), refreshed per collision grid cell when they change
+const Uint32 COLOR_MATCH_MASK = 0xF8F8F0;   // compare the top 5/5/4 bits of R/G/B
+thread_local vector<Uint32> stageComposite;              // 0x00RRGGBB, stage-sized
+thread_local vector<Uint8> compositeDirty;               // per grid cell
+thread_local SDL_Surface* compositeBackdrop = nullptr;   // backdrop stageComposite was built from
+thread_local vector<Uint32> penReadback;
+thread_local vector<Uint32> colorScratch;                // queried box with the other sprites drawn in
+thread_local vector<int> overScratch;                    // sprites drawn over that box
+
+// Clones (see CLONES in hamed_ctrl.cpp): a pooled structure-of-arrays store
+// indexed by clone id. Ids are recycled through a free list and every array
+// is reserved up to cloneLimit, so creating and deleting clones does not
+// allocate. Clones share their parent's costumes; to run a block, draw or
+// sense, a clone is loaded into its parent's cloneProxy and stored back.
+int cloneLimit = 300;   // as in Scratch
+struct CloneStore {
+    vector<int> parent;           // allSprites index, -1 for a free id
+    vector<Uint32> gen;           // bumped on delete: scripts hold (id, gen)
+    vector<Uint32> seq;           // creation order, which is drawing order
+    vector<double> x, y, direction, size;
+    vector<int> costume;
+    vector<Uint8> visible, penDown, thinking;
+    vector<SDL_Color> penColor;
+    vector<int> penSize;
+    vector<string> message;
+    vector<long long> messageUntil;
+    vector<SpriteCollision> collision;
+    vector<int> freeIds;
+    vector<int> live;             // live ids in creation order
+    Uint32 nextSeq = 0;
+    int loaded = -1;              // id currently held by its parent's proxy
+};
+thread_local CloneStore clones;
+thread_local vector<Sprite> cloneProxy;        // by parent index
+
+// Pen layer: strokes and stamps are drawn once, into a stage-sized canvas
+thread_local SDL_Texture* penCanvas = nullptr;          // render target, or the upload of penSurface
+thread_local SDL_Surface* penSurface = nullptr;         // CPU canvas when the renderer has no render targets
+thread_local SDL_Renderer* penSoftRenderer = nullptr;   // draws into penSurface
+thread_local bool penSurfaceDirty = false;
+thread_local map<SDL_Surface*, SDL_Texture*> penStampTextures;   // costume copies for penSoftRenderer
 bool showExtPanel = false;
-bool isPaused = false;
-bool stepRequested = false;
-bool stepModeActive = false;  // when true, all events run step by step
-shared_ptr<Block> currentExecutingBlock = nullptr;  // block currently highlighted
+thread_local bool isPaused = false;
+thread_local bool stepRequested = false;
+thread_local bool stepModeActive = false;  // when true, all events run step by step
+thread_local bool redrawRequested = false; // a visible change this frame: loops stop re-running until Render
+thread_local bool turboMode = false;
+thread_local long long blocksExecuted = 0;  // blocks run since blockRateStart
+thread_local Uint32 blockRateStart = 0;
+thread_local int blocksPerSecond = 0;       // shown in the log bar while scripts run
+thread_local BlockRef currentExecutingBlock = nullptr;  // block currently highlighted
 Uint32 lastUpTime = 0;
 int lastUpX = 0, lastUpY = 0;
 
 // Category
 Category currentCategory = CAT_MOTION;
-TTF_Font* gFont = nullptr;
+TTF_Font* gFont = nullptr;   // FONT_UI, owned by fontAtlases
+
+// Text: one glyph atlas per font size (see TEXT in davoud_render.cpp)
+const char* FONT_PATH = "assets/OpenSans-Regular.ttf";
+const int FONT_UI = 14;
+const int ATLAS_WIDTH = 512, ATLAS_MAX_HEIGHT = 4096;
+struct Glyph {
+    bool measured = false, rasterized = false;
+    int advance = 0;
+    SDL_Rect src = {0, 0, 0, 0};   // in the atlas; w == 0 for blank glyphs
+};
+struct FontAtlas {
+    TTF_Font* font = nullptr;
+    int height = 0;
+    Glyph latin[256];
+    map<Uint32, Glyph> others;
+    SDL_Surface* pixels = nullptr;    // white glyphs on transparent, mirrored into texture
+    SDL_Texture* texture = nullptr;
+    int shelfX = 0, shelfY = 0, shelfH = 0;
+};
+map<int, FontAtlas> fontAtlases;
+vector<SDL_Vertex> textVerts;   // reused by every DrawString call
+vector<int> textIndices;
 
 // Block editing
-shared_ptr<Block> editingBlock = nullptr;
-string editInputString;
-bool editing = false;
-int editingFieldIndex = 0;
+thread_local BlockRef editingBlock = nullptr;
+thread_local string editInputString;
+thread_local bool editing = false;
+thread_local int editingFieldIndex = 0;
 
 // Sprite property editing
 int editingSpriteProp = -1;
@@ -367,30 +842,121 @@ Uint32 lastBackdropClickTime = 0;
 int lastBackdropClickIndex = -1;
 
 // Last operator result
-int lastOperatorResult = 0;
+thread_local int lastOperatorResult = 0;
+
+// "pick random" / "go to random position" generator: one per engine, unlike
+// rand(), so a seeded headless run gives the same result on any thread
+thread_local unsigned scriptRandState = 1;
 
 // Variables
-vector<Variable> variables;
+// 'variables' is indexed by slot: every name ever used keeps its slot until
+// the project is replaced, so compiled blocks can index it directly.
+thread_local vector<Variable> variables;
+thread_local vector<int> symbolBuckets;  // open-addressing hash: name -> slot, -1 = empty
+thread_local vector<string> symbolKeys;  // the name each bucket was filed under
+thread_local size_t symbolCount = 0;     // filled buckets; a renamed slot fills two
+thread_local int symbolEpoch = 0;        // bumped when slots are dropped (load / new project) or a name moves to another slot
+int lastMonitorClickSlot = -1;
+Uint32 lastMonitorClickTime = 0;
 
 // Sensing
-string askAnswer;
-bool waitingForAnswer = false;
+thread_local string askAnswer;
+thread_local bool waitingForAnswer = false;
 
 // Key names
 const char* keyNames[] = { "space", "up", "down", "left", "right" };
 int keyScancodes[] = { SDL_SCANCODE_SPACE, SDL_SCANCODE_UP, SDL_SCANCODE_DOWN, SDL_SCANCODE_LEFT, SDL_SCANCODE_RIGHT };
 
 // ==================== UNDO/REDO ====================
-struct State {
-    vector<shared_ptr<Block>> scriptBlocks;
-    Sprite sprite;
+// Undo log: every entry records only what one action changed, as before /
+// after values. Blocks keep their identity, so undo and redo put the old
+// fields back on the same objects. Every entry is appended to the history
+// file next to the project, and a full checkpoint too once the entries since
+// the last one cost as much to apply as the checkpoint itself, so jumping to
+// any history item costs at most about twice that. Only the last UNDO_MEMORY entries stay in
+// memory; older ones are read back from the file when needed. Where each
+// entry lives is kept in a fixed-size record per entry in an index file
+// beside it, of which the last HISTORY_MEMORY stay in memory too.
+struct BlockDelta {
+    BlockRef block;
+    bool listedBefore = true, listedAfter = true;
+    BlockFields before, after;
+};
+// One insertion into or removal from scriptBlocks, at the index it had then;
+// an entry's plate edits replay forwards for redo and inverted backwards for undo
+struct PlateEdit {
+    BlockRef block;
+    int index = 0;
+    bool insert = false;
+};
+struct VariableDelta {
+    Variable before, after;
+};
+struct SpriteDelta {
+    int index = 0;           // in allSprites
+    Sprite before, after;    // cloneState() copies
+};
+struct UndoCheckpoint {
+    vector<BlockRef> blocks;   // scriptBlocks in order
+    vector<BlockFields> fields;
     vector<Variable> variables;
-    int backdropIndex;
+    vector<Sprite> sprites;    // by allSprites index
+    int backdropIndex = 0;
+};
+struct UndoEntry {
+    vector<BlockDelta> blocks;
+    vector<PlateEdit> plate;
+    vector<VariableDelta> variables;
+    vector<SpriteDelta> sprites;   // only the sprites that changed
+    int backdropBefore = 0, backdropAfter = 0;
+};
+// Where entry n lives in the history file, and what applying it costs
+struct UndoRecord {
+    streamoff offset = -1;
+    streamoff checkpointAt = -1;   // checkpoint of the state after entry n, if any
+    int checkpointCost = 0;
+    int cost = 1;
+    int costSince = 0;   // of the entries after the last checkpoint, up to n
 };
 
-vector<State> undoStack;
-int undoIndex = -1;
-const int MAX_UNDO = 50;
+thread_local deque<UndoEntry> undoStack;   // entries undoFirst .. undoFirst + size - 1
+thread_local int undoFirst = 0;
+thread_local deque<UndoRecord> undoRecords;   // records recordFirst .. undoCount - 1
+thread_local int recordFirst = 0;
+thread_local int undoCount = 0;   // entries in the history
+thread_local int undoIndex = -1;
+const int UNDO_MEMORY = 64;
+// The history file and its index are named after the process, so two
+// editors on the same project never share one, and removed when closed
+thread_local fstream historyFile, historyIndex;
+thread_local string historyPath;
+thread_local int historySerial = 0;      // tells apart engines in one process
+thread_local streamoff historyEnd = 0;   // appends go here
+thread_local streamoff histReadPos = 0;  // where the next read starts, for bounds checks
+thread_local bool historyAppending = false;   // put position is at historyEnd
+thread_local bool historyInMemory = false;    // the file could not be created: nothing is spilled
+thread_local streamoff indexPutAt = -1;       // put position in the index, -1 if unknown
+thread_local string projectPath;   // file last loaded / saved, the history file goes next to it
+thread_local int nextUndoBlockId = 0;
+// The project as of the last entry, to diff the next one against. Blocks
+// are not compared: edit sites report the ones they change (NoteBlockEdited)
+// and go through PlateInsert / PlateErase, so an entry costs what it records.
+thread_local vector<BlockRef> undoEdited;
+thread_local vector<PlateEdit> undoPlate;
+thread_local vector<Variable> undoVariables;   // by slot, valid for symbol epoch undoEpoch
+thread_local int undoEpoch = 0;
+thread_local vector<Sprite> undoSprites;   // by allSprites index; sprites added since are not undone
+thread_local int undoBackdrop = 0;
+thread_local unsigned undoMarkSerial = 0;
+
+// Run session: a whole script run is one undo entry (see beginRunSession)
+struct RunSession {
+    bool active = false;
+    int mutations = 0;   // runtime changes since the pre-run checkpoint
+    string trigger;      // what started the run, used in the history entry
+};
+thread_local RunSession runSession;
+thread_local bool keepHistory = true;   // undo log and history file; off for headless runs
 
 // =========================================================
 // Module Implementation Files
@@ -407,8 +973,11 @@ const int MAX_UNDO = 50;
 #include "davoud_input.cpp"
 
 // ==================== MAIN ====================
+// bench.cpp includes this file for the modules and brings its own main()
+#ifndef SCRATCH_NO_MAIN
 int main(int argc, char* argv[]) {
-    srand(static_cast<unsigned>(time(nullptr)));
+    if (argc > 1 && string(argv[1]) == "--headless") return RunHeadless(argc, argv);
+    seedScriptRand(static_cast<unsigned>(time(nullptr)));
 
     bool running = true;
     SDL_Event event;
@@ -425,58 +994,18 @@ int main(int argc, char* argv[]) {
     if (!renderer) cout << "Failed to create a renderer! Error: " << SDL_GetError() << endl;
     g_renderer = renderer;
     SDL_RenderSetLogicalSize(renderer, 1280, 720);
+#ifdef _WIN32
     SDL_SysWMinfo wmInfo;
     SDL_VERSION(&wmInfo.version);
     if (SDL_GetWindowWMInfo(window, &wmInfo)) {
         g_hwnd = wmInfo.info.win.window;
     }
+#endif
 
     catSound = Mix_LoadMUS("assets/freesound_community-cat-meow-6226.mp3");
     if (!catSound) cout << "Failed to load cat sound: " << Mix_GetError() << endl;
 
-    mainStage.rect = Stage1;
-    mainStage.currentBackdropIndex = 0;
-
-    auto createBackdrop = [&](const string& name, Uint8 r, Uint8 g, Uint8 b) {
-        Costume c;
-        c.name = name;
-        c.width = mainStage.rect.w;
-        c.height = mainStage.rect.h;
-        SDL_Surface* surf = SDL_CreateRGBSurface(0, c.width, c.height, 32, 0, 0, 0, 0);
-        SDL_FillRect(surf, NULL, SDL_MapRGB(surf->format, r, g, b));
-        c.texture = SDL_CreateTextureFromSurface(renderer, surf);
-        SDL_FreeSurface(surf);
-        mainStage.backdrops.push_back(c);
-    };
-
-    createBackdrop("back1", 255, 255, 255);
-
-    auto loadBackdropFromFile = [&](const string& path, const string& name) {
-        SDL_Surface* surf = IMG_Load(path.c_str());
-        if (!surf) { createBackdrop(name, 200, 200, 200); return; }
-        int stageW = mainStage.rect.w, stageH = mainStage.rect.h;
-        SDL_Surface* converted = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA8888, 0);
-        SDL_FreeSurface(surf);
-        if (!converted) { createBackdrop(name, 200, 200, 200); return; }
-        SDL_Surface* scaled = SDL_CreateRGBSurfaceWithFormat(0, stageW, stageH, 32, SDL_PIXELFORMAT_RGBA8888);
-        if (!scaled) { SDL_FreeSurface(converted); createBackdrop(name, 200, 200, 200); return; }
-        SDL_BlitScaled(converted, NULL, scaled, NULL);
-        SDL_FreeSurface(converted);
-        Costume c; c.name = name; c.width = stageW; c.height = stageH;
-        c.texture = SDL_CreateTextureFromSurface(renderer, scaled);
-        SDL_FreeSurface(scaled);
-        if (!c.texture) { createBackdrop(name, 200, 200, 200); return; }
-        mainStage.backdrops.push_back(c);
-    };
-    loadBackdropFromFile("assets/back2.jpg", "back2");
-    loadBackdropFromFile("assets/back3.jpg", "back3");
-
-    Sprite defaultSprite = Create_Sprite(1, "Cat");
-    defaultSprite.scratchx = 0; defaultSprite.scratchy = 0;
-    defaultSprite.penDown = false; defaultSprite.penColor = Orange; defaultSprite.penSize = 2;
-    defaultSprite.direction = 90.0;
-    Add_Costume_To_Sprite(renderer, defaultSprite, "Cat", "assets/catt.png");
-    allSprites.push_back(defaultSprite);
+    CreateDefaultProject(renderer);
 
     auto loadTex = [&](const char* file, int fw=1, int fh=1) -> SDL_Texture* {
         SDL_Surface* s = IMG_Load(file);
@@ -506,15 +1035,15 @@ int main(int argc, char* argv[]) {
     Define_Toolbar_BTN_Text(renderer, ToolBar_Button);
     Define_Blockbar_BTN_Text(renderer, BlockBar_Button);
     Define_Panel_BTN_Text(renderer, File_Panel_Button,3);
-    Define_Panel_BTN_Text(renderer, Edit_Panel_Button,2);
+    Define_Panel_BTN_Text(renderer, Edit_Panel_Button,4);
     Define_Panel_BTN_Text(renderer, Help_Panel_Button,3);
 
     File_BTN_Panel = {File_Panel, false, File_Panel_Button,3};
-    Edit_BTN_Panel = {Edit_Panel, false, Edit_Panel_Button,2};
+    Edit_BTN_Panel = {Edit_Panel, false, Edit_Panel_Button,4};
     Help_BTN_Panel = {Help_Panel, false, Help_Panel_Button,3};
 
     // Open font before creating textures
-    gFont = TTF_OpenFont("assets/OpenSans-Regular.ttf", 14);
+    gFont = GetFont(FONT_UI);
 
     // Create text for buttons (Pause and Step use images only)
     if (gFont) {
@@ -533,7 +1062,7 @@ int main(int argc, char* argv[]) {
     for (int i=0; i<10; i++) allButtons.push_back(&BlockBar_Button[i]);
     allButtons.push_back(&BlockBar_Button[10]); // AddExt — circle, handled in HandleButtonClick
     for (int i=0; i<3; i++) allButtons.push_back(&File_Panel_Button[i]);
-    for (int i=0; i<2; i++) allButtons.push_back(&Edit_Panel_Button[i]);
+    for (int i=0; i<4; i++) allButtons.push_back(&Edit_Panel_Button[i]);
     for (int i=0; i<3; i++) allButtons.push_back(&Help_Panel_Button[i]);
     allButtons.push_back(&Go);
     allButtons.push_back(&Stop);
@@ -546,12 +1075,12 @@ int main(int argc, char* argv[]) {
 
     BuildPaletteBlocksForCategory(currentCategory, renderer);
 
-    TTF_Font* loadFont = TTF_OpenFont("assets/OpenSans-Regular.ttf", 30);
     SDL_ShowWindow(window);
-    DrawLoading(renderer, loadFont); SDL_RenderPresent(renderer); SDL_Delay(2000);
+    DrawLoading(renderer); SDL_RenderPresent(renderer); SDL_Delay(2000);
     Render(renderer);
 
     const int FPS = 60, FRAME_DELAY = 1000/FPS;
+    Uint32 lastRenderTime = 0;
     while (running) {
         Uint32 frameStart = SDL_GetTicks();
         bool mouseDownThisFrame = false, mouseUpThisFrame = false;
@@ -577,6 +1106,14 @@ int main(int argc, char* argv[]) {
             if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_RIGHT) rightDown = true;
             if (event.type == SDL_MOUSEBUTTONDOWN) mouseDownThisFrame = true;
             if (event.type == SDL_MOUSEBUTTONUP) { mouseUpThisFrame = true; lastUpTime = event.button.timestamp; lastUpX = event.button.x; lastUpY = event.button.y; }
+            // Wheel over the history panel scrolls back through older items
+            // (or through the top blocks table while profiling)
+            if (event.type == SDL_MOUSEWHEEL && profilerEnabled && IsMouseOverRect(History_List, MOUUSE_X, MOUUSE_Y))
+                profileScroll = max(0, profileScroll - event.wheel.y);
+            else if (event.type == SDL_MOUSEWHEEL && IsMouseOverRect(History_List, MOUUSE_X, MOUUSE_Y))
+                historyScroll = max(0, min(historyScroll + event.wheel.y, undoCount - 1));
+            if (event.type == SDL_MOUSEWHEEL && IsMouseOverRect(Sprite_List, MOUUSE_X, MOUUSE_Y))
+                ScrollSpriteList(-event.wheel.y);
 
             if (editing || editingSpriteProp != -1) {
                 if (event.type == SDL_TEXTINPUT) {
@@ -586,6 +1123,7 @@ int main(int argc, char* argv[]) {
                 else if (event.type == SDL_KEYDOWN) {
                     if (event.key.keysym.sym == SDLK_RETURN || event.key.keysym.sym == SDLK_KP_ENTER) {
                         if (editing) {
+                            NoteBlockEdited(editingBlock);
                             if (editingFieldIndex == 2) {
                                 editingBlock->strValue = editInputString;
                                 // For blocks that show variable name or expression, use strValue as label
@@ -594,6 +1132,8 @@ int main(int argc, char* argv[]) {
                                     editingBlock->type == BLOCK_HIDE_VARIABLE ||
                                     editingBlock->type == BLOCK_DEFINE_VARIABLE) {
                                     editingBlock->label = editInputString;
+                                } else if (editingBlock->hasMessageAndSeconds()) {
+                                    editingBlock->label = MessageAndSecondsLabel(*editingBlock);
                                 } else {
                                     string newLabel = editingBlock->baseLabel;
                                     size_t pos = newLabel.find("{}");
@@ -604,21 +1144,32 @@ int main(int argc, char* argv[]) {
                                 int newVal = atoi(editInputString.c_str());
                                 if (editingFieldIndex == 0) editingBlock->value = newVal;
                                 else editingBlock->value2 = newVal;
+                                // wait and say / think for take fractional secs: whole secs in value, ms in value2
+                                bool timed = editingBlock->type == BLOCK_WAIT || editingBlock->hasMessageAndSeconds();
+                                if (timed) editingBlock->value2 = max(0, (int)lround(atof(editInputString.c_str()) * 1000));
                                 string newLabel = editingBlock->baseLabel;
                                 size_t pos1 = newLabel.find("{}");
-                                if (pos1 != string::npos) {
+                                if (editingBlock->hasMessageAndSeconds()) {
+                                    newLabel = MessageAndSecondsLabel(*editingBlock);
+                                } else if (timed && pos1 != string::npos) {
+                                    newLabel.replace(pos1, 2, FormatSeconds(editingBlock->value2));
+                                } else if (pos1 != string::npos) {
                                     newLabel.replace(pos1, 2, to_string(editingBlock->value));
                                     size_t pos2 = newLabel.find("{}", pos1+2);
                                     if (pos2 != string::npos) newLabel.replace(pos2, 2, to_string(editingBlock->value2));
                                 }
                                 editingBlock->label = newLabel;
                             }
+                            editingBlock->expr.reset(); editingBlock->expr2.reset();
+                            editingBlock->eventId = -1;
+                            InvalidateScript(editingBlock);
+                            IndexHat(editingBlock);
                             UpdateBlockTexture(editingBlock, renderer);
                             editing = false; SDL_StopTextInput();
-                            pushState("Changed block: " + editingBlock->label);
+                            pushState("Changed block: " + editingBlock->label.str());
                         } else if (editingSpriteProp != -1) {
                             double newVal = atof(spriteEditString.c_str());
-                            Sprite& s = allSprites[0];
+                            Sprite& s = TargetSprite(editingTarget);
                             switch (editingSpriteProp) {
                                 case 0: s.scratchx = newVal; break;
                                 case 1: s.scratchy = newVal; break;
@@ -646,9 +1197,9 @@ int main(int argc, char* argv[]) {
                     SDL_StopTextInput();
                     defineVariable("answer");
                     int idx = findVariable("answer");
-                    if (idx != -1) variables[idx].value = atoi(askAnswer.c_str());
+                    if (idx != -1) { variables[idx].value = atoi(askAnswer.c_str()); NoteVariableChanged(idx); }
                     askAnswer.clear();
-                    pushState("Answered");
+                    noteRunMutation("Answered");
                 } else if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_BACKSPACE && !askAnswer.empty()) {
                     askAnswer.pop_back();
                 }
@@ -663,7 +1214,7 @@ int main(int argc, char* argv[]) {
                     if (by >= itemRect.y && by <= itemRect.y + itemRect.h) {
                         if (event.button.button == SDL_BUTTON_RIGHT) {
                             // Right-click: rename
-                            string newName = showRenameDialog(renderer, mainStage.backdrops[i].name);
+                            string newName = showRenameDialog(renderer, "Rename Backdrop", mainStage.backdrops[i].name);
                             if (!newName.empty()) {
                                 mainStage.backdrops[i].name = newName;
                                 logAction("Renamed backdrop to: " + newName);
@@ -674,6 +1225,8 @@ int main(int argc, char* argv[]) {
                                 // Double-click: delete (keep at least 1 backdrop)
                                 if (mainStage.backdrops.size() > 1) {
                                     if (mainStage.backdrops[i].texture) SDL_DestroyTexture(mainStage.backdrops[i].texture);
+                                    if (mainStage.backdrops[i].surface) SDL_FreeSurface(mainStage.backdrops[i].surface);
+                                    MarkStageDirty();
                                     mainStage.backdrops.erase(mainStage.backdrops.begin() + i);
                                     if (mainStage.currentBackdropIndex >= (int)mainStage.backdrops.size())
                                         mainStage.currentBackdropIndex = (int)mainStage.backdrops.size() - 1;
@@ -692,6 +1245,29 @@ int main(int argc, char* argv[]) {
                     yOff += 32;
                 }
             }
+
+            // ---- Variable monitor right-click (rename) and double-click (delete) ----
+            if (event.type == SDL_MOUSEBUTTONDOWN) {
+                int slot = VariableMonitorAt(event.button.x, event.button.y);
+                if (slot != -1) {
+                    string name = variables[slot].name;
+                    if (event.button.button == SDL_BUTTON_RIGHT) {
+                        string newName = showRenameDialog(renderer, "Rename Variable", name);
+                        if (!newName.empty() && newName != name && renameVariable(name, newName)) {
+                            pushState("Renamed variable to: " + newName);
+                        }
+                    } else if (event.button.button == SDL_BUTTON_LEFT) {
+                        Uint32 now = SDL_GetTicks();
+                        if (lastMonitorClickSlot == slot && (now - lastMonitorClickTime) < 400) {
+                            if (deleteVariable(name)) pushState("Deleted variable: " + name);
+                            lastMonitorClickSlot = -1;
+                        } else {
+                            lastMonitorClickTime = now;
+                            lastMonitorClickSlot = slot;
+                        }
+                    }
+                }
+            }
         }
 
         SDL_GetMouseState(&MOUUSE_X, &MOUUSE_Y);
@@ -705,7 +1281,7 @@ int main(int argc, char* argv[]) {
                 Handle_Sprite_Drag_And_Drop(allSprites[i], mainStage, event, MOUUSE_X, MOUUSE_Y);
                 break;
             }
-            if (event.type == SDL_MOUSEBUTTONDOWN && IsMouseOverRect(allSprites[i].rect, MOUUSE_X, MOUUSE_Y)) {
+            if (event.type == SDL_MOUSEBUTTONDOWN && SpriteHitTest(allSprites[i], MOUUSE_X, MOUUSE_Y)) {
                 Handle_Sprite_Drag_And_Drop(allSprites[i], mainStage, event, MOUUSE_X, MOUUSE_Y);
                 break;
             }
@@ -761,17 +1337,18 @@ int main(int argc, char* argv[]) {
             scriptsRunning = true; isPaused = false; stepRequested = false; flagScripts.clear();
             startScriptsForHat(BLOCK_WHEN_FLAG);
             if (stepModeActive) { isPaused = true; stepRequested = true; }
-            pushState("Green flag clicked");
+            beginRunSession("Green flag clicked");
         }
         if (Stop.isselected && mouseUpThisFrame) {
             scriptsRunning = false; isPaused = false; stepRequested = false; stepModeActive = false;
-            flagScripts.clear(); spaceScripts.clear(); clickScripts.clear(); messageScripts.clear();
+            ClearScriptQueues();
             currentExecutingBlock = nullptr; StepBtn.isselected = false;
-            pushState("Stop clicked");
+            endRunSession();
+            logAction("Stop clicked");
         }
         if (Pause.isselected && mouseUpThisFrame) {
             isPaused = !isPaused;
-            pushState(isPaused ? "Paused" : "Resumed");
+            logAction(isPaused ? "Paused" : "Resumed");
         }
         if (StepBtn.isselected && mouseUpThisFrame) {
             if (!stepModeActive) {
@@ -782,6 +1359,7 @@ int main(int argc, char* argv[]) {
                     flagScripts.clear();
                     startScriptsForHat(BLOCK_WHEN_FLAG);
                     scriptsRunning = true;
+                    beginRunSession("Green flag (step mode)");
                 }
                 stepRequested = true;
             } else {
@@ -805,7 +1383,7 @@ int main(int argc, char* argv[]) {
             File_Panel_Button[0].isselected = false;
             ToolBar_Button[0].isselected = false;
             // Only warn if there are changes (scriptBlocks not empty or undoStack has more than 1 state)
-            bool hasChanges = !scriptBlocks.empty() || variables.size() > 0;
+            bool hasChanges = !scriptBlocks.empty() || liveVariableCount() > 0;
             if (hasChanges) {
                 if (showNewFileDialog(renderer)) {
                     resetProject(renderer);
@@ -837,6 +1415,33 @@ int main(int argc, char* argv[]) {
             ToolBar_Button[0].isselected = false; // close File panel
         }
 
+        // Turbo mode toggle (Edit panel button[1])
+        if (Edit_Panel_Button[1].isselected && mouseUpThisFrame) {
+            Edit_Panel_Button[1].isselected = false;
+            ToolBar_Button[1].isselected = false; // close Edit panel
+            turboMode = !turboMode;
+            Set_Panel_BTN_Text(renderer, Edit_Panel_Button[1], turboMode ? "Turn off Turbo Mode" : "Turn on Turbo Mode");
+            logAction(turboMode ? "Turbo mode ON" : "Turbo mode OFF");
+        }
+
+        // Profiler toggle and CSV export (Edit panel buttons[2] and [3]);
+        // turning it on starts a fresh profile, turning it off keeps the
+        // numbers for export
+        if (Edit_Panel_Button[2].isselected && mouseUpThisFrame) {
+            Edit_Panel_Button[2].isselected = false;
+            ToolBar_Button[1].isselected = false;
+            if (!profilerEnabled) ResetProfile();
+            profilerEnabled = !profilerEnabled;
+            Set_Panel_BTN_Text(renderer, Edit_Panel_Button[2], profilerEnabled ? "Turn off Profiler" : "Turn on Profiler");
+            logAction(profilerEnabled ? "Profiler ON" : "Profiler OFF");
+        }
+        if (Edit_Panel_Button[3].isselected && mouseUpThisFrame) {
+            Edit_Panel_Button[3].isselected = false;
+            ToolBar_Button[1].isselected = false;
+            string filename = getProfileSaveFileName();
+            if (!filename.empty()) ExportProfileCsv(filename);
+        }
+
         // About dialog (Help panel button[0])
         if (Help_Panel_Button[0].isselected && mouseUpThisFrame) {
             Help_Panel_Button[0].isselected = false;
@@ -844,17 +1449,21 @@ int main(int argc, char* argv[]) {
             showAboutDialog(renderer);
         }
 
-        if (spaceDown) { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "space"); if (!spaceScripts.empty()) scriptsRunning = true; pushState("Space key pressed"); if (stepModeActive) { isPaused = true; stepRequested = true; } }
-        if (upDown)    { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "up");    if (!spaceScripts.empty()) scriptsRunning = true; pushState("Up key pressed");    if (stepModeActive) { isPaused = true; stepRequested = true; } }
-        if (downDown)  { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "down");  if (!spaceScripts.empty()) scriptsRunning = true; pushState("Down key pressed");  if (stepModeActive) { isPaused = true; stepRequested = true; } }
-        if (leftDown)  { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "left");  if (!spaceScripts.empty()) scriptsRunning = true; pushState("Left key pressed");  if (stepModeActive) { isPaused = true; stepRequested = true; } }
-        if (rightDown) { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "right"); if (!spaceScripts.empty()) scriptsRunning = true; pushState("Right key pressed"); if (stepModeActive) { isPaused = true; stepRequested = true; } }
-
-        if (mouseUpThisFrame && !uiClicked && IsMouseOverRect(allSprites[0].rect, MOUUSE_X, MOUUSE_Y)) {
-            clickScripts.clear(); startScriptsForHat(BLOCK_WHEN_CLICKED);
-            if (!clickScripts.empty()) scriptsRunning = true;
+        if (spaceDown) { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "space"); if (!spaceScripts.empty()) { scriptsRunning = true; beginRunSession("Space key pressed"); } if (stepModeActive) { isPaused = true; stepRequested = true; } }
+        if (upDown)    { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "up");    if (!spaceScripts.empty()) { scriptsRunning = true; beginRunSession("Up key pressed"); }    if (stepModeActive) { isPaused = true; stepRequested = true; } }
+        if (downDown)  { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "down");  if (!spaceScripts.empty()) { scriptsRunning = true; beginRunSession("Down key pressed"); }  if (stepModeActive) { isPaused = true; stepRequested = true; } }
+        if (leftDown)  { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "left");  if (!spaceScripts.empty()) { scriptsRunning = true; beginRunSession("Left key pressed"); }  if (stepModeActive) { isPaused = true; stepRequested = true; } }
+        if (rightDown) { spaceScripts.clear(); startScriptsForHat(BLOCK_WHEN_KEY, "right"); if (!spaceScripts.empty()) { scriptsRunning = true; beginRunSession("Right key pressed"); } if (stepModeActive) { isPaused = true; stepRequested = true; } }
+
+        // A click on the stage runs the "when clicked" scripts of the sprite
+        // on top under the mouse, or the stage's own
+        if (mouseUpThisFrame && !uiClicked && IsMouseOverRect(mainStage.rect, MOUUSE_X, MOUUSE_Y)) {
+            int clicked = STAGE_TARGET;
+            for (int i = allSprites.size()-1; i>=0 && clicked == STAGE_TARGET; i--)
+                if (allSprites[i].isVisible && SpriteHitTest(allSprites[i], MOUUSE_X, MOUUSE_Y)) clicked = i;
+            clickScripts.clear(); startScriptsForHatId(BLOCK_WHEN_CLICKED, -1, -1, -1, clicked);
+            if (!clickScripts.empty()) { scriptsRunning = true; beginRunSession(clicked == STAGE_TARGET ? "Stage clicked" : "Sprite clicked"); }
             if (stepModeActive) { isPaused = true; stepRequested = true; }
-            pushState("Sprite clicked");
         }
 
         if (mouseUpThisFrame && !uiClicked && IsMouseOverRect(BackDrop_List, MOUUSE_X, MOUUSE_Y)) {
@@ -873,38 +1482,56 @@ int main(int argc, char* argv[]) {
         }
 
         if (mouseUpThisFrame && !uiClicked && IsMouseOverRect(Sprite_List, MOUUSE_X, MOUUSE_Y)) {
-            int hx = Sprite_List.x + 5, hw = Sprite_List.w - 10, lineH = 20;
-            int total = historyLog.size();
-            int start = max(0, total - 14);
-            int y = Sprite_List.y + 5;
-            for (int idx = total - 1; idx >= start; idx--) {
+            int tile = SpriteTileAt(MOUUSE_X, MOUUSE_Y);
+            if (tile != ANY_TARGET) SelectTarget(tile);
+        }
+
+        if (mouseUpThisFrame && !uiClicked && profilerEnabled && IsMouseOverRect(History_List, MOUUSE_X, MOUUSE_Y)) {
+            HandleProfilePanelClick(MOUUSE_X, MOUUSE_Y);
+        } else if (mouseUpThisFrame && !uiClicked && IsMouseOverRect(History_List, MOUUSE_X, MOUUSE_Y)) {
+            endRunSession();  // commit a running script first so its entry is listed
+            commitPendingEdits();
+            int hx = History_List.x + 5, hw = History_List.w - 10, lineH = 20;
+            int newest = undoCount - 1 - historyScroll;
+            int start = max(0, newest - 13);
+            int y = History_List.y + 5;
+            for (int idx = newest; idx >= start; idx--) {
                 SDL_Rect itemRect = {hx, y, hw, lineH};
                 if (MOUUSE_Y >= itemRect.y && MOUUSE_Y <= itemRect.y + itemRect.h) {
-                    if (historyLog[idx].stateIndex >= 0 && historyLog[idx].stateIndex != undoIndex) {
-                        restoreState(historyLog[idx].stateIndex, renderer);
-                    }
+                    if (idx != undoIndex) restoreState(idx, renderer);
                     break;
                 }
                 y += lineH + 2;
-                if (y + lineH > Sprite_List.y + Sprite_List.h - 5) break;
+                if (y + lineH > History_List.y + History_List.h - 5) break;
             }
         }
 
         UpdateSprites(allSprites, mainStage, MOUUSE_X, MOUUSE_Y, mouseDownThisFrame, mouseUpThisFrame, uiClicked, renderer);
-        if (scriptsRunning) ExecuteScripts(renderer);
-        if (!isPaused && flagScripts.empty() && spaceScripts.empty() && clickScripts.empty() && messageScripts.empty()) {
+        ExecuteScripts(renderer);   // also times out bubbles once the scripts end
+        if (!isPaused && !AnyScriptsQueued()) {
             scriptsRunning = false; Go.isselected = false;
+            endRunSession();
         }
         if (!running) break;
-        Render(renderer);
+        // In turbo mode a running project only redraws a few times a second
+        if (!turboMode || !scriptsRunning || frameStart - lastRenderTime >= (Uint32)(1000 / TURBO_RENDER_FPS)) {
+            Render(renderer);
+            lastRenderTime = frameStart;
+        }
+        // Spare frame time rasterizes labels queued by a load
+        PrewarmLabelTextures(renderer, frameStart + FRAME_DELAY);
         int frameTime = SDL_GetTicks() - frameStart;
         if (frameTime < FRAME_DELAY) SDL_Delay(FRAME_DELAY - frameTime);
     }
 
-    FreeBlockTextures(); if (gFont) TTF_CloseFont(gFont);
+    // Drop every block (and the palette's) while the thread_local label
+    // cache they count into is still alive, then the textures with it
+    ReleaseEngine();
+    FreeBlockTextures(); CloseFonts();
     if (catSound) Mix_FreeMusic(catSound);
     Mix_CloseAudio();
     SDL_DestroyRenderer(renderer); SDL_DestroyWindow(window);
     TTF_Quit(); SDL_Quit();
     return 0;
 }
+#endif
@@ -1,14 +1,270 @@
-void UpdateBlockTexture(shared_ptr<Block> block, SDL_Renderer* renderer) {
-    if (block->textTexture) { SDL_DestroyTexture(block->textTexture); block->textTexture = nullptr; }
-    if (gFont) {
-        SDL_Surface* surf = TTF_RenderUTF8_Blended(gFont, block->label.c_str(), White);
-        block->textTexture = SDL_CreateTextureFromSurface(renderer, surf);
-        SDL_FreeSurface(surf);
+// ==================== TEXT ====================
+// Each font size has a glyph atlas: a glyph is rendered once (in white) onto
+// the atlas surface and uploaded into its texture; a string is then drawn as
+// one batch of quads tinted through the vertex colour. Drawing text does not
+// create textures or surfaces once its glyphs are cached.
+FontAtlas* GetFontAtlas(int size) {
+    auto it = fontAtlases.find(size);
+    if (it != fontAtlases.end()) return it->second.font ? &it->second : nullptr;
+    FontAtlas& fa = fontAtlases[size];
+    fa.font = TTF_OpenFont(FONT_PATH, size);
+    if (!fa.font) {
+        cout << "Error loading font size " << size << ": " << TTF_GetError() << endl;
+        return nullptr;
     }
+    fa.height = TTF_FontHeight(fa.font);
+    return &fa;
+}
+
+TTF_Font* GetFont(int size) {
+    FontAtlas* fa = GetFontAtlas(size);
+    return fa ? fa->font : nullptr;
+}
+
+void CloseFonts() {
+    for (auto& it : fontAtlases) {
+        FontAtlas& fa = it.second;
+        if (fa.texture) SDL_DestroyTexture(fa.texture);
+        if (fa.pixels) SDL_FreeSurface(fa.pixels);
+        if (fa.font) TTF_CloseFont(fa.font);
+    }
+    fontAtlases.clear();
+    gFont = nullptr;
+}
+
+Uint32 NextCodepoint(const string& s, size_t& i) {
+    unsigned char c = s[i++];
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+    Uint32 cp = extra == 3 ? (c & 0x07) : extra == 2 ? (c & 0x0F) : extra == 1 ? (c & 0x1F) : c;
+    for (int k = 0; k < extra && i < s.size() && ((unsigned char)s[i] & 0xC0) == 0x80; k++)
+        cp = (cp << 6) | ((unsigned char)s[i++] & 0x3F);
+    return cp;
+}
+
+Glyph& GlyphOf(FontAtlas& fa, Uint32 ch) {
+    Glyph& g = ch < 256 ? fa.latin[ch] : fa.others[ch];
+    if (!g.measured) {
+        g.measured = true;
+        int minx, maxx, miny, maxy, advance;
+        if (TTF_GlyphMetrics32(fa.font, ch, &minx, &maxx, &miny, &maxy, &advance) == 0) g.advance = advance;
+    }
+    return g;
+}
+
+// Doubles the atlas height, keeping the glyphs packed so far
+bool GrowAtlas(FontAtlas& fa) {
+    int h = fa.pixels->h * 2;
+    if (h > ATLAS_MAX_HEIGHT) return false;
+    SDL_Surface* bigger = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, h, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!bigger) return false;
+    SDL_SetSurfaceBlendMode(fa.pixels, SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(fa.pixels, NULL, bigger, NULL);
+    SDL_FreeSurface(fa.pixels);
+    fa.pixels = bigger;
+    if (fa.texture) { SDL_DestroyTexture(fa.texture); fa.texture = nullptr; }
+    return true;
+}
+
+void RasterizeGlyph(SDL_Renderer* r, FontAtlas& fa, Uint32 ch, Glyph& g) {
+    g.rasterized = true;
+    SDL_Surface* s = TTF_RenderGlyph32_Blended(fa.font, ch, White);
+    if (!s) return;   // blank glyph (space) or missing from the font
+    if (!fa.pixels) fa.pixels = SDL_CreateRGBSurfaceWithFormat(0, ATLAS_WIDTH, 128, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!fa.pixels || s->w > ATLAS_WIDTH) { SDL_FreeSurface(s); return; }
+    if (fa.shelfX + s->w > ATLAS_WIDTH) { fa.shelfX = 0; fa.shelfY += fa.shelfH; fa.shelfH = 0; }
+    while (fa.shelfY + s->h > fa.pixels->h) {
+        if (!GrowAtlas(fa)) { SDL_FreeSurface(s); return; }
+    }
+    SDL_Rect dst = {fa.shelfX, fa.shelfY, s->w, s->h};
+    SDL_SetSurfaceBlendMode(s, SDL_BLENDMODE_NONE);
+    SDL_BlitSurface(s, NULL, fa.pixels, &dst);
+    SDL_FreeSurface(s);
+    fa.shelfX += dst.w + 1;
+    fa.shelfH = max(fa.shelfH, dst.h + 1);
+    g.src = dst;
+
+    if (!fa.texture) {
+        fa.texture = SDL_CreateTexture(r, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, fa.pixels->w, fa.pixels->h);
+        if (!fa.texture) return;
+        SDL_SetTextureBlendMode(fa.texture, SDL_BLENDMODE_BLEND);
+        SDL_UpdateTexture(fa.texture, NULL, fa.pixels->pixels, fa.pixels->pitch);
+    } else {
+        const Uint8* px = (const Uint8*)fa.pixels->pixels + dst.y * fa.pixels->pitch + dst.x * 4;
+        SDL_UpdateTexture(fa.texture, &dst, px, fa.pixels->pitch);
+    }
+}
+
+// Lays out txt from (x, y) and returns its width. With a renderer the glyphs
+// are drawn; maxW >= 0 stops before the first glyph that would cross it.
+int TextRun(SDL_Renderer* r, FontAtlas& fa, int x, int y, const string& txt, SDL_Color col, int maxW) {
+    textVerts.clear();
+    textIndices.clear();
+    int pen = 0;
+    Uint32 prev = 0;
+    for (size_t i = 0; i < txt.size(); ) {
+        Uint32 ch = NextCodepoint(txt, i);
+        int kern = prev ? TTF_GetFontKerningSizeGlyphs32(fa.font, prev, ch) : 0;
+        prev = ch;
+        Glyph& g = GlyphOf(fa, ch);
+        if (r && !g.rasterized) RasterizeGlyph(r, fa, ch, g);
+        if (maxW >= 0 && pen + kern + max(g.src.w, g.advance) > maxW) break;
+        pen += kern;
+        if (r && g.src.w > 0) {
+            // tex_coord in atlas pixels until submit: the atlas may still grow
+            float x0 = (float)(x + pen), y0 = (float)y, x1 = x0 + g.src.w, y1 = y0 + g.src.h;
+            float u0 = (float)g.src.x, v0 = (float)g.src.y, u1 = u0 + g.src.w, v1 = v0 + g.src.h;
+            int base = (int)textVerts.size();
+            textVerts.push_back({{x0, y0}, col, {u0, v0}});
+            textVerts.push_back({{x1, y0}, col, {u1, v0}});
+            textVerts.push_back({{x1, y1}, col, {u1, v1}});
+            textVerts.push_back({{x0, y1}, col, {u0, v1}});
+            int quad[6] = {base, base + 1, base + 2, base, base + 2, base + 3};
+            textIndices.insert(textIndices.end(), quad, quad + 6);
+        }
+        pen += g.advance;
+    }
+    if (r && !textIndices.empty() && fa.texture) {
+        float sx = 1.0f / fa.pixels->w, sy = 1.0f / fa.pixels->h;
+        for (auto& v : textVerts) { v.tex_coord.x *= sx; v.tex_coord.y *= sy; }
+        SDL_RenderGeometry(r, fa.texture, textVerts.data(), (int)textVerts.size(), textIndices.data(), (int)textIndices.size());
+    }
+    return pen;
+}
+
+int DrawString(SDL_Renderer* r, int x, int y, const string& txt, SDL_Color col, int size = FONT_UI, int maxW = -1) {
+    FontAtlas* fa = GetFontAtlas(size);
+    return fa ? TextRun(r, *fa, x, y, txt, col, maxW) : 0;
+}
+
+int TextWidth(const string& txt, int size = FONT_UI) {
+    FontAtlas* fa = GetFontAtlas(size);
+    return fa ? TextRun(nullptr, *fa, 0, 0, txt, White, -1) : 0;
+}
+
+int TextHeight(int size = FONT_UI) {
+    FontAtlas* fa = GetFontAtlas(size);
+    return fa ? fa->height : 0;
+}
+
+void RenderText(SDL_Renderer* r, int x, int y, const string& txt, SDL_Color col) {
+    DrawString(r, x, y, txt, col, FONT_UI);
+}
+
+// ==================== LABEL TEXTURES ====================
+// Blocks with the same label share one texture. Acquiring only registers the
+// entry and queues it; the texture is made when the label is first drawn or
+// by PrewarmLabelTextures in spare frame time. Rasterized textures sit on an
+// LRU list and the least recently drawn are destroyed once they exceed
+// LABEL_TEXTURE_BUDGET (a referenced entry is simply rasterized again).
+Uint64 LabelTextureKey(int size, SDL_Color c) {
+    return (Uint64)size << 32 | (Uint32)c.r << 24 | (Uint32)c.g << 16 | (Uint32)c.b << 8 | c.a;
+}
+
+LabelTextureRef AcquireLabelTexture(const string& label, int size, SDL_Color color) {
+    auto key = make_pair(label, LabelTextureKey(size, color));
+    auto it = labelTextureIds.find(key);
+    if (it != labelTextureIds.end()) return LabelTextureRef(it->second);
+    int id;
+    if (!freeLabelTextures.empty()) { id = freeLabelTextures.back(); freeLabelTextures.pop_back(); }
+    else { id = (int)labelTextures.size(); labelTextures.push_back(LabelTexture()); }
+    LabelTexture& e = labelTextures[id];
+    e = LabelTexture();
+    e.label = label; e.size = size; e.color = color; e.inUse = true;
+    labelTextureIds[key] = id;
+    labelPrewarm.push_back(id);
+    return LabelTextureRef(id);
+}
+
+void LruUnlink(int id) {
+    LabelTexture& e = labelTextures[id];
+    if (e.lruPrev >= 0) labelTextures[e.lruPrev].lruNext = e.lruNext; else labelLruHead = e.lruNext;
+    if (e.lruNext >= 0) labelTextures[e.lruNext].lruPrev = e.lruPrev; else labelLruTail = e.lruPrev;
+    e.lruPrev = e.lruNext = -1;
+}
+
+void LruPushFront(int id) {
+    LabelTexture& e = labelTextures[id];
+    e.lruPrev = -1;
+    e.lruNext = labelLruHead;
+    if (labelLruHead >= 0) labelTextures[labelLruHead].lruPrev = id; else labelLruTail = id;
+    labelLruHead = id;
+}
+
+void FreeLabelEntry(int id) {
+    LabelTexture& e = labelTextures[id];
+    labelTextureIds.erase(make_pair(e.label, LabelTextureKey(e.size, e.color)));
+    e = LabelTexture();
+    freeLabelTextures.push_back(id);
+}
+
+void EvictLabelTexture(int id) {
+    LabelTexture& e = labelTextures[id];
+    LruUnlink(id);
+    SDL_DestroyTexture(e.texture);
+    e.texture = nullptr;
+    labelTextureBytes -= (size_t)e.w * e.h * 4;
+    if (e.refs == 0) FreeLabelEntry(id);
+}
+
+void ReleaseLabelTexture(int id) {
+    LabelTexture& e = labelTextures[id];
+    if (--e.refs > 0) return;
+    if (!e.texture) FreeLabelEntry(id);   // otherwise kept until the LRU evicts it
+}
+
+bool RasterizeLabel(int id, SDL_Renderer* renderer) {
+    LabelTexture& e = labelTextures[id];
+    TTF_Font* f = GetFont(e.size);
+    if (!f || e.label.empty()) return false;
+    SDL_Surface* surf = TTF_RenderUTF8_Blended(f, e.label.c_str(), e.color);
+    if (!surf) return false;
+    e.texture = SDL_CreateTextureFromSurface(renderer, surf);
+    e.w = surf->w; e.h = surf->h;
+    SDL_FreeSurface(surf);
+    if (!e.texture) return false;
+    labelTextureBytes += (size_t)e.w * e.h * 4;
+    LruPushFront(id);
+    while (labelTextureBytes > LABEL_TEXTURE_BUDGET && labelLruTail >= 0 && labelLruTail != id)
+        EvictLabelTexture(labelLruTail);
+    return true;
+}
+
+SDL_Texture* LabelTextureFor(const LabelTextureRef& ref, SDL_Renderer* renderer, int* w, int* h) {
+    if (ref.id < 0) return nullptr;
+    LabelTexture& e = labelTextures[ref.id];
+    if (!e.texture) {
+        if (!RasterizeLabel(ref.id, renderer)) return nullptr;
+    } else if (labelLruHead != ref.id) {
+        LruUnlink(ref.id);
+        LruPushFront(ref.id);
+    }
+    *w = e.w; *h = e.h;
+    return e.texture;
+}
+
+// Rasterizes queued labels until the deadline (SDL_GetTicks) or the budget
+void PrewarmLabelTextures(SDL_Renderer* renderer, Uint32 deadline) {
+    while (!labelPrewarm.empty() && !SDL_TICKS_PASSED(SDL_GetTicks(), deadline)) {
+        int id = labelPrewarm.front();
+        LabelTexture& e = labelTextures[id];
+        if (e.inUse && e.refs > 0 && !e.texture) {
+            if (labelTextureBytes >= LABEL_TEXTURE_BUDGET) break;
+            RasterizeLabel(id, renderer);
+        }
+        labelPrewarm.pop_front();
+    }
+}
+
+void ClearLabelTextures() {
+    while (labelLruTail >= 0) EvictLabelTexture(labelLruTail);
+    labelPrewarm.clear();
+}
+
+void UpdateBlockTexture(BlockRef block, SDL_Renderer* renderer) {
+    block->labelTexture = AcquireLabelTexture(block->label, FONT_UI, White);
 }
 
 void BuildPaletteBlocksForCategory(Category cat, SDL_Renderer* renderer) {
-    for (auto& b : paletteBlocks) if (b.textTexture) SDL_DestroyTexture(b.textTexture);
     paletteBlocks.clear();
 
     int x = BlocksFuncs.x+10, y = BlocksFuncs.y+10, w = BlocksFuncs.w-20, h = BLOCK_HEIGHT;
@@ -23,8 +279,8 @@ void BuildPaletteBlocksForCategory(Category cat, SDL_Renderer* renderer) {
             if (type >= BLOCK_ADD && type <= BLOCK_SQRT) {
                 // For operators, we want the label to be the expression itself
                 label = str;
-            } else if (type == BLOCK_SAY || type == BLOCK_THINK) {
-                // say/think: single {} replaced with strValue (text message)
+            } else if (type == BLOCK_SAY || type == BLOCK_THINK || type == BLOCK_TOUCHING) {
+                // say/think: single {} replaced with strValue (text message); touching: its target
                 label.replace(p1, 2, str.empty() ? "Hello!" : str);
             } else if (type == BLOCK_SAY_FOR || type == BLOCK_THINK_FOR) {
                 // say/think for: first {} = message (str), second {} = seconds (val)
@@ -43,11 +299,7 @@ void BuildPaletteBlocksForCategory(Category cat, SDL_Renderer* renderer) {
             if (p != string::npos) label.replace(p, 2, str);
         }
         b.label = label;
-        if (gFont) {
-            SDL_Surface* surf = TTF_RenderUTF8_Blended(gFont, label.c_str(), White);
-            b.textTexture = SDL_CreateTextureFromSurface(renderer, surf);
-            SDL_FreeSurface(surf);
-        }
+        b.labelTexture = AcquireLabelTexture(label, FONT_UI, White);
         paletteBlocks.push_back(b);
         y += h+5;
     };
@@ -106,11 +358,15 @@ void BuildPaletteBlocksForCategory(Category cat, SDL_Renderer* renderer) {
             add(BLOCK_IF_ELSE, "if else", 0, 0, "", ControlColor);
             add(BLOCK_WAIT_UNTIL, "wait until", 0, 0, "", ControlColor);
             add(BLOCK_STOP_ALL, "stop all", 0, 0, "", ControlColor);
+            add(BLOCK_WHEN_CLONE_START, "when I start as a clone", 0, 0, "", ControlColor);
+            add(BLOCK_CREATE_CLONE, "create clone of myself", 0, 0, "", ControlColor);
+            add(BLOCK_DELETE_CLONE, "delete this clone", 0, 0, "", ControlColor);
             add(BLOCK_END, "end", 0, 0, "", ControlColor);
             break;
         case CAT_SENSING:
-            add(BLOCK_TOUCHING, "touching mouse-pointer?", 0, 0, "", SensingColor);
-            add(BLOCK_TOUCHING_COLOR, "touching color ?", 0, 0, "", SensingColor);
+            add(BLOCK_TOUCHING, "touching {}?", 0, 0, "mouse-pointer", SensingColor);
+            add(BLOCK_TOUCHING, "touching {}?", 0, 0, "edge", SensingColor);
+            add(BLOCK_TOUCHING_COLOR, "touching color {}?", 0, 0, "", SensingColor);
             add(BLOCK_DISTANCE_TO, "distance to mouse-pointer", 0, 0, "", SensingColor);
             add(BLOCK_ASK, "ask {} and wait", 0, 0, "What's your name?", SensingColor);
             add(BLOCK_KEY_PRESSED, "key space pressed?", 0, 0, "space", SensingColor);
@@ -166,8 +422,15 @@ void BuildPaletteBlocksForCategory(Category cat, SDL_Renderer* renderer) {
     }
 }
 
-void DrawBlock(const Block& block, SDL_Renderer* renderer) {
-    SDL_SetRenderDrawColor(renderer, block.color.r, block.color.g, block.color.b, 255);
+// heat (0..1, from the profiler) blends the block's colour towards red
+void DrawBlock(const Block& block, SDL_Renderer* renderer, float heat) {
+    SDL_Color c = block.color;
+    if (heat > 0) {
+        c.r = (Uint8)(c.r + (230 - c.r) * heat);
+        c.g = (Uint8)(c.g + (30 - c.g) * heat);
+        c.b = (Uint8)(c.b + (30 - c.b) * heat);
+    }
+    SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, 255);
     SDL_RenderFillRect(renderer, &block.rect);
     // Draw blue border if this is the currently executing block in step mode
     if (stepModeActive && currentExecutingBlock && currentExecutingBlock.get() == &block) {
@@ -180,18 +443,32 @@ void DrawBlock(const Block& block, SDL_Renderer* renderer) {
         SDL_SetRenderDrawColor(renderer, 0,0,0,255);
         SDL_RenderDrawRect(renderer, &block.rect);
     }
-    if (block.textTexture) {
-        int tw, th;
-        SDL_QueryTexture(block.textTexture, NULL, NULL, &tw, &th);
+    int tw, th;
+    if (SDL_Texture* t = LabelTextureFor(block.labelTexture, renderer, &tw, &th)) {
         SDL_Rect r = {block.rect.x+5, block.rect.y+(block.rect.h-th)/2, tw, th};
-        SDL_RenderCopy(renderer, block.textTexture, NULL, &r);
+        SDL_RenderCopy(renderer, t, NULL, &r);
     }
 }
 
 void DrawAllBlocks(SDL_Renderer* renderer) {
-    for (auto& b : paletteBlocks) DrawBlock(b, renderer);
-    for (auto& b : scriptBlocks) DrawBlock(*b, renderer);
-    if (draggedBlock) DrawBlock(*draggedBlock, renderer);
+    for (auto& b : paletteBlocks) DrawBlock(b, renderer, 0);
+    // Profiler heat map: each block by its share of the hottest block's
+    // time on this target, hats by their script's share of the hottest script's
+    long long hottest = 0, hottestScript = 0;
+    if (profilerEnabled) {
+        for (auto& b : scriptBlocks) {
+            if (b->owner != editingTarget) continue;
+            long long& m = b->isHat() ? hottestScript : hottest;
+            m = max(m, ProfileNs(b));
+        }
+    }
+    auto heatOf = [&](const BlockRef& b) -> float {
+        long long m = b->isHat() ? hottestScript : hottest;
+        return m > 0 ? (float)ProfileNs(b) / m : 0;
+    };
+    for (auto& b : scriptBlocks)
+        if (b->owner == editingTarget) DrawBlock(*b, renderer, heatOf(b));
+    if (draggedBlock) DrawBlock(*draggedBlock, renderer, heatOf(draggedBlock));
     if (draggedBlock && snapCandidate) {
         bool above = snapCandidate->rect.y < draggedBlock->rect.y;
         int x1 = (above ? snapCandidate->rect.x : draggedBlock->rect.x) + (above ? snapCandidate->rect.w : draggedBlock->rect.w)/2;
@@ -202,32 +479,97 @@ void DrawAllBlocks(SDL_Renderer* renderer) {
     }
     if (editing && editingBlock) {
         int fieldX, fieldY, fieldW = 60, fieldH = editingBlock->rect.h-10;
+        bool messageAndSeconds = editingBlock->hasMessageAndSeconds();
         if (editingFieldIndex == 0) {
-            fieldX = editingBlock->rect.x + editingBlock->rect.w - 130;
+            fieldX = editingBlock->rect.x + editingBlock->rect.w - (messageAndSeconds ? 65 : 130);
         } else if (editingFieldIndex == 1) {
             fieldX = editingBlock->rect.x + editingBlock->rect.w - 65;
         } else {
             fieldX = editingBlock->rect.x + editingBlock->rect.w - 130;
-            fieldW = 120;
+            fieldW = messageAndSeconds ? 60 : 120;
         }
         fieldY = editingBlock->rect.y + 5;
         SDL_Rect r = {fieldX, fieldY, fieldW, fieldH};
         SDL_SetRenderDrawColor(renderer,255,255,255,255); SDL_RenderFillRect(renderer,&r);
         SDL_SetRenderDrawColor(renderer,0,0,0,255); SDL_RenderDrawRect(renderer,&r);
-        if (gFont) {
-            SDL_Surface* s = TTF_RenderUTF8_Blended(gFont, editInputString.c_str(), Black);
-            SDL_Texture* t = SDL_CreateTextureFromSurface(renderer,s);
-            int tw,th; SDL_QueryTexture(t,NULL,NULL,&tw,&th);
-            SDL_Rect tr = {r.x+2, r.y+(r.h-th)/2, min(tw,r.w-4), th};
-            SDL_RenderCopy(renderer,t,NULL,&tr);
-            SDL_DestroyTexture(t); SDL_FreeSurface(s);
+        if (gFont) DrawString(renderer, r.x+2, r.y+(r.h-TextHeight())/2, editInputString, Black, FONT_UI, r.w-4);
+    }
+}
+
+// ==================== PROFILER PANEL ====================
+// While profiling, the history panel shows the project's top blocks: label,
+// total ms, times run and average us per run. Clicking a number column's
+// header sorts by it, the wheel scrolls (see main).
+const int PROFILE_ROW_H = 20;
+
+// col 0 is the label; cols 1..3 are the numbers, in ProfileSort order
+SDL_Rect ProfileHeaderRect(int col) {
+    static const int x[] = {5, 205, 270, 335}, w[] = {195, 60, 60, 61};
+    return {History_List.x + x[col], History_List.y + 5, w[col], PROFILE_ROW_H};
+}
+
+void DrawProfilePanel(SDL_Renderer* r) {
+    SDL_Rect panel = History_List;
+    SDL_SetRenderDrawColor(r, 240,240,240,255);
+    SDL_RenderFillRect(r, &panel);
+    SDL_SetRenderDrawColor(r, 180,180,180,255);
+    SDL_RenderDrawRect(r, &panel);
+    static const char* titles[] = {"block", "ms", "runs", "avg us"};
+    for (int c = 0; c < 4; c++) {
+        SDL_Rect cell = ProfileHeaderRect(c);
+        bool sorted = c > 0 && c - 1 == profileSort;
+        if (sorted) SDL_SetRenderDrawColor(r, 200,230,255,255);
+        else SDL_SetRenderDrawColor(r, 255,255,255,255);
+        SDL_RenderFillRect(r, &cell);
+        SDL_SetRenderDrawColor(r, 0,0,0,255);
+        SDL_RenderDrawRect(r, &cell);
+        DrawString(r, cell.x + 2, cell.y + 2, string(titles[c]) + (sorted ? " v" : ""), Black, FONT_UI, cell.w - 4);
+    }
+
+    int shown = (panel.h - 10) / PROFILE_ROW_H - 1;
+    vector<ProfileRow> rows = CollectProfileRows(profileSort, profileScroll + shown);
+    if (rows.empty()) {
+        RenderText(r, panel.x + 7, panel.y + 7 + PROFILE_ROW_H, "Profiling: run the project", Black);
+        profileScroll = 0;
+        return;
+    }
+    profileScroll = max(0, min(profileScroll, (int)rows.size() - shown));
+    char num[32];
+    for (int k = 0; k < shown && profileScroll + k < (int)rows.size(); k++) {
+        const ProfileRow& row = rows[profileScroll + k];
+        const BlockProfile& p = row.stats;
+        for (int c = 0; c < 4; c++) {
+            SDL_Rect cell = ProfileHeaderRect(c);
+            cell.y += (k + 1) * PROFILE_ROW_H;
+            SDL_SetRenderDrawColor(r, 255,255,255,255);
+            SDL_RenderFillRect(r, &cell);
+            SDL_SetRenderDrawColor(r, 200,200,200,255);
+            SDL_RenderDrawRect(r, &cell);
+            string text;
+            if (c == 0) text = TargetSprite(row.block->owner).name + ": " + row.block->label.str();
+            else if (c == 1) { snprintf(num, sizeof num, "%.2f", p.ns / 1e6); text = num; }
+            else if (c == 2) text = to_string(p.count);
+            else { snprintf(num, sizeof num, "%.2f", p.ns / 1e3 / p.count); text = num; }
+            DrawString(r, cell.x + 2, cell.y + 2, text, Black, FONT_UI, cell.w - 4);
         }
     }
 }
 
-void FreeBlockTexture(Block& b) { if (b.textTexture) { SDL_DestroyTexture(b.textTexture); b.textTexture = nullptr; } }
+void HandleProfilePanelClick(int x, int y) {
+    for (int c = 1; c < 4; c++) {
+        SDL_Rect cell = ProfileHeaderRect(c);
+        if (!IsMouseOverRect(cell, x, y)) continue;
+        profileSort = (ProfileSort)(c - 1);
+        profileScroll = 0;
+        logAction(string("Profile sorted by ") + (c == 1 ? "time" : c == 2 ? "runs" : "time per run"));
+    }
+}
+
 
-void InsertBlockAtSnap(shared_ptr<Block> block, shared_ptr<Block> target, bool above) {
+void InsertBlockAtSnap(BlockRef block, BlockRef target, bool above) {
+    NoteBlockEdited(block);
+    NoteBlockEdited(target);
+    NoteBlockEdited(above ? target->next : target->prev.lock());
     if (above) {
         block->next = target->next;
         if (target->next) target->next->prev = block;
@@ -242,7 +584,11 @@ void InsertBlockAtSnap(shared_ptr<Block> block, shared_ptr<Block> target, bool a
         block->rect.y = target->rect.y - block->rect.h - GAP;
     }
     block->rect.x = target->rect.x;
-    pushState("Snapped block: " + block->label);
+    InvalidateScript(block);
+    InvalidateScript(target);
+    IndexHat(block);
+    IndexHat(target);
+    pushState("Snapped block: " + block->label.str());
 }
 
 void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown, bool mouseUp, SDL_Renderer* renderer) {
@@ -251,12 +597,18 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
         if (now - lastUpTime < 500 && abs(mouseX - lastUpX) < 5 && abs(mouseY - lastUpY) < 5) {
             for (int i = scriptBlocks.size()-1; i>=0; i--) {
                 auto& b = scriptBlocks[i];
+                if (b->owner != editingTarget) continue;
                 if (mouseX >= b->rect.x && mouseX <= b->rect.x+b->rect.w && mouseY >= b->rect.y && mouseY <= b->rect.y+b->rect.h) {
-                    if (auto p = b->prev.lock()) p->next = b->next;
-                    if (b->next) b->next->prev = b->prev;
-                    FreeBlockTexture(*b);
-                    scriptBlocks.erase(scriptBlocks.begin()+i);
-                    pushState("Deleted block: " + b->label);
+                    BlockRef deleted = b;
+                    InvalidateScript(deleted);
+                    NoteBlockEdited(deleted->prev.lock());
+                    NoteBlockEdited(deleted->next);
+                    if (auto p = deleted->prev.lock()) p->next = deleted->next;
+                    if (deleted->next) deleted->next->prev = deleted->prev;
+                    UnindexHat(deleted);
+                    IndexHat(deleted->next);
+                    PlateErase(i);
+                    pushState("Deleted block: " + deleted->label.str());
                     return;
                 }
             }
@@ -265,14 +617,10 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
         for (size_t i=0; i<paletteBlocks.size(); i++) {
             auto& pb = paletteBlocks[i];
             if (mouseX >= pb.rect.x && mouseX <= pb.rect.x+pb.rect.w && mouseY >= pb.rect.y && mouseY <= pb.rect.y+pb.rect.h) {
-                auto nb = make_shared<Block>(pb);
+                auto nb = NewBlock(pb);
                 nb->inPalette = false; nb->rect.x = mouseX; nb->rect.y = mouseY;
+                nb->owner = editingTarget;
                 nb->isDragging = true; dragOffX = mouseX - nb->rect.x; dragOffY = mouseY - nb->rect.y;
-                if (gFont) {
-                    SDL_Surface* s = TTF_RenderUTF8_Blended(gFont, nb->label.c_str(), White);
-                    nb->textTexture = SDL_CreateTextureFromSurface(renderer, s);
-                    SDL_FreeSurface(s);
-                }
                 draggedBlock = nb; draggingFromPalette = true; snapCandidate = nullptr;
                 return;
             }
@@ -280,9 +628,10 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
 
         for (int i = scriptBlocks.size()-1; i>=0; i--) {
             auto& b = scriptBlocks[i];
+            if (b->owner != editingTarget) continue;
             if (mouseX >= b->rect.x && mouseX <= b->rect.x+b->rect.w && mouseY >= b->rect.y && mouseY <= b->rect.y+b->rect.h) {
                 potentialDrag = true;
-                clickStartX = mouseX; clickStartY = mouseY; clickStartTime = now; clickBlock = b;
+                clickStartX = mouseX; clickStartY = mouseY; clickStartTime = now; clickBlock = b; clickIndex = i;
                 // Determine if click is in editable area
                 if (b->hasTwoEditableValues()) {
                     int field1_x = b->rect.x + b->rect.w - 130;
@@ -292,9 +641,14 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
                     clickInValue2Area = (mouseX >= field2_x && mouseX <= field2_x + field_w);
                     clickInStringArea = false;
                 } else if (b->hasEditableValue()) {
-                    // For say/think, treat the {} as a string field
-                    if (b->type == BLOCK_SAY || b->type == BLOCK_SAY_FOR ||
-                        b->type == BLOCK_THINK || b->type == BLOCK_THINK_FOR) {
+                    if (b->hasMessageAndSeconds()) {
+                        // say/think for: the message, then the seconds
+                        int strX = b->rect.x + b->rect.w - 130;
+                        clickInStringArea = (mouseX >= strX && mouseX <= strX + 60);
+                        clickInValueArea = (mouseX >= strX + 65 && mouseX <= strX + 125);
+                        clickInValue2Area = false;
+                    } else if (b->type == BLOCK_SAY || b->type == BLOCK_THINK || b->type == BLOCK_TOUCHING) {
+                        // For say/think, treat the {} as a string field
                         int strX = b->rect.x + b->rect.w - 130;
                         int strW = 120;
                         clickInStringArea = (mouseX >= strX && mouseX <= strX + strW);
@@ -321,9 +675,16 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
     if (potentialDrag && event.type == SDL_MOUSEMOTION) {
         int dx = mouseX - clickStartX, dy = mouseY - clickStartY;
         if (abs(dx) > DRAG_THRESHOLD || abs(dy) > DRAG_THRESHOLD) {
+            InvalidateScript(clickBlock);
+            NoteBlockEdited(clickBlock);
+            NoteBlockEdited(clickBlock->prev.lock());
+            NoteBlockEdited(clickBlock->next);
             if (auto p = clickBlock->prev.lock()) p->next = clickBlock->next;
             if (clickBlock->next) clickBlock->next->prev = clickBlock->prev;
+            auto oldNext = clickBlock->next;
             clickBlock->prev.reset(); clickBlock->next = nullptr;
+            IndexHat(clickBlock);
+            IndexHat(oldNext);
             clickBlock->isDragging = true;
             dragOffX = mouseX - clickBlock->rect.x; dragOffY = mouseY - clickBlock->rect.y;
             draggedBlock = clickBlock; draggingFromPalette = false; snapCandidate = nullptr;
@@ -335,7 +696,7 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
         draggedBlock->rect.x = mouseX - dragOffX; draggedBlock->rect.y = mouseY - dragOffY;
         int best = SNAP_DIST; snapCandidate = nullptr;
         for (auto& b : scriptBlocks) {
-            if (b == draggedBlock) continue;
+            if (b == draggedBlock || b->owner != draggedBlock->owner) continue;
             int da = abs((b->rect.y + b->rect.h) - draggedBlock->rect.y);
             if (da < best && abs(b->rect.x - draggedBlock->rect.x) < 40) { best = da; snapCandidate = b; }
             int db = abs((draggedBlock->rect.y + draggedBlock->rect.h) - b->rect.y);
@@ -351,14 +712,20 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
                 bool above = (snapCandidate->rect.y < draggedBlock->rect.y);
                 InsertBlockAtSnap(draggedBlock, snapCandidate, above);
             } else {
+                NoteBlockEdited(draggedBlock);
                 draggedBlock->next = nullptr; draggedBlock->prev.reset();
             }
-            if (!draggingFromPalette) scriptBlocks.erase(find(scriptBlocks.begin(), scriptBlocks.end(), draggedBlock));
-            scriptBlocks.push_back(draggedBlock);
-            pushState("Placed block: " + draggedBlock->label);
+            // a dropped block goes on top: to the end of scriptBlocks
+            if (!draggingFromPalette) PlateRemove(draggedBlock, clickIndex);
+            PlateAppend(draggedBlock);
+            IndexHat(draggedBlock);
+            pushState("Placed block: " + draggedBlock->label.str());
         } else {
-            FreeBlockTexture(*draggedBlock);
-            if (!draggingFromPalette) scriptBlocks.erase(find(scriptBlocks.begin(), scriptBlocks.end(), draggedBlock));
+            UnindexHat(draggedBlock);
+            if (!draggingFromPalette) {
+                PlateRemove(draggedBlock, clickIndex);
+                pushState("Deleted block: " + draggedBlock->label.str());
+            }
         }
         draggedBlock = nullptr; snapCandidate = nullptr;
     }
@@ -381,10 +748,11 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
                 editingBlock = clickBlock;
                 editingFieldIndex = 0;
                 // For say/think blocks, always use string editing
-                if (clickBlock->type == BLOCK_SAY || clickBlock->type == BLOCK_SAY_FOR ||
-                    clickBlock->type == BLOCK_THINK || clickBlock->type == BLOCK_THINK_FOR) {
+                if (clickBlock->type == BLOCK_SAY || clickBlock->type == BLOCK_THINK || clickBlock->type == BLOCK_TOUCHING) {
                     editingFieldIndex = 2;
                     editInputString = editingBlock->strValue;
+                } else if (clickBlock->type == BLOCK_WAIT || clickBlock->hasMessageAndSeconds()) {
+                    editInputString = FormatSeconds(BlockDurationMs(*editingBlock));
                 } else {
                     editInputString = to_string(editingBlock->value);
                 }
@@ -400,21 +768,10 @@ void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown,
     }
 }
 
-void RenderText(SDL_Renderer* r, int x, int y, const string& txt, SDL_Color col) {
-    if (!gFont) return;
-    SDL_Surface* s = TTF_RenderUTF8_Blended(gFont, txt.c_str(), col);
-    if (!s) return;
-    SDL_Texture* t = SDL_CreateTextureFromSurface(r, s);
-    int tw, th; SDL_QueryTexture(t, NULL, NULL, &tw, &th);
-    SDL_Rect rect = {x, y, tw, th};
-    SDL_RenderCopy(r, t, NULL, &rect);
-    SDL_DestroyTexture(t);
-    SDL_FreeSurface(s);
-}
-
 void HandleSpriteInfoEvents(int mouseX, int mouseY, bool mouseUp, SDL_Renderer* renderer) {
     if (!mouseUp) return;
     if (!IsMouseOverRect(Sprite_Info, mouseX, mouseY)) return;
+    if (editingTarget == STAGE_TARGET) return;
 
     int infoX = Sprite_Info.x + 15;
     int infoY = Sprite_Info.y + 15;
@@ -431,7 +788,7 @@ void HandleSpriteInfoEvents(int mouseX, int mouseY, bool mouseUp, SDL_Renderer*
     for (int i=0; i<4; i++) {
         if (IsMouseOverRect(rects[i], mouseX, mouseY)) {
             editingSpriteProp = i;
-            Sprite& s = allSprites[0];
+            Sprite& s = allSprites[editingTarget];
             switch (i) {
                 case 0: spriteEditString = to_string((int)s.scratchx); break;
                 case 1: spriteEditString = to_string((int)s.scratchy); break;
@@ -451,7 +808,6 @@ void DrawSpriteInfo(SDL_Renderer* renderer) {
 
     if (!gFont) return;
 
-    Sprite& s = allSprites[0];
     int infoX = bg.x + 15;
     int infoY = bg.y + 15;
     int lineH = 24;
@@ -463,6 +819,14 @@ void DrawSpriteInfo(SDL_Renderer* renderer) {
         RenderText(renderer, x, y, txt, col);
     };
 
+    if (editingTarget == STAGE_TARGET) {
+        drawText(infoX, infoY, "Stage", valueColor);
+        if (!mainStage.backdrops.empty())
+            drawText(infoX, infoY + lineH, "backdrop: " + mainStage.backdrops[mainStage.currentBackdropIndex].name, labelColor);
+        return;
+    }
+    Sprite& s = allSprites[editingTarget];
+
     drawText(infoX, infoY, "x:", labelColor);
     drawText(infoX + colW, infoY, "y:", labelColor);
     drawText(infoX, infoY + lineH, "dir:", labelColor);
@@ -496,16 +860,93 @@ void DrawSpriteInfo(SDL_Renderer* renderer) {
         SDL_RenderFillRect(renderer, &inputRect);
         SDL_SetRenderDrawColor(renderer, 0,0,0,255);
         SDL_RenderDrawRect(renderer, &inputRect);
-        if (!spriteEditString.empty() && gFont) {
-            SDL_Surface* s = TTF_RenderUTF8_Blended(gFont, spriteEditString.c_str(), Black);
-            if (s) {
-                SDL_Texture* t = SDL_CreateTextureFromSurface(renderer, s);
-                int tw,th; SDL_QueryTexture(t,NULL,NULL,&tw,&th);
-                SDL_Rect tr = {inputRect.x + 4, inputRect.y + (inputRect.h - th)/2, min(tw, inputRect.w-8), th};
-                SDL_RenderCopy(renderer, t, NULL, &tr);
-                SDL_DestroyTexture(t);
-                SDL_FreeSurface(s);
-            }
+        if (!spriteEditString.empty() && gFont)
+            DrawString(renderer, inputRect.x + 4, inputRect.y + (inputRect.h - TextHeight())/2, spriteEditString, Black, FONT_UI, inputRect.w-8);
+    }
+}
+
+// ==================== SPRITE LIST ====================
+// One tile per target: the stage first, then the sprites in layer order.
+// Clicking a tile puts its scripts on the plate.
+const int SPRITE_TILE_W = 70, SPRITE_TILE_GAP = 4;
+
+// Tile k: 0 is the stage, k > 0 is allSprites[k - 1]
+SDL_Rect SpriteTileRect(int k) {
+    int x = Sprite_List.x + 5 + (k - spriteListScroll) * (SPRITE_TILE_W + SPRITE_TILE_GAP);
+    return {x, Sprite_List.y + 5, SPRITE_TILE_W, Sprite_List.h - 10};
+}
+
+int SpriteTilesShown() {
+    return (Sprite_List.w - 10 + SPRITE_TILE_GAP) / (SPRITE_TILE_W + SPRITE_TILE_GAP);
+}
+
+void ScrollSpriteList(int tiles) {
+    int last = max(0, (int)allSprites.size() + 1 - SpriteTilesShown());
+    spriteListScroll = max(0, min(spriteListScroll + tiles, last));
+}
+
+// Target of the tile under a window point, ANY_TARGET for none
+int SpriteTileAt(int x, int y) {
+    int end = min((int)allSprites.size() + 1, spriteListScroll + SpriteTilesShown());
+    for (int k = spriteListScroll; k < end; k++) {
+        SDL_Rect r = SpriteTileRect(k);
+        if (IsMouseOverRect(r, x, y)) return k - 1;
+    }
+    return ANY_TARGET;
+}
+
+void SelectTarget(int target) {
+    if (target == editingTarget) return;
+    if (editing || editingSpriteProp != -1) SDL_StopTextInput();
+    editing = false; editingBlock = nullptr; editingSpriteProp = -1;
+    potentialDrag = false; clickBlock = nullptr;
+    editingTarget = target;
+    int k = target + 1, shown = SpriteTilesShown();
+    if (k < spriteListScroll) spriteListScroll = k;
+    else if (k >= spriteListScroll + shown) spriteListScroll = k - shown + 1;
+    logAction("Editing " + TargetSprite(target).name);
+}
+
+void DrawSpriteList(SDL_Renderer* renderer) {
+    SDL_Rect panel = Sprite_List;
+    SDL_SetRenderDrawColor(renderer, 240,240,240,255);
+    SDL_RenderFillRect(renderer, &panel);
+    SDL_SetRenderDrawColor(renderer, 180,180,180,255);
+    SDL_RenderDrawRect(renderer, &panel);
+    int end = min((int)allSprites.size() + 1, spriteListScroll + SpriteTilesShown());
+    for (int k = spriteListScroll; k < end; k++) {
+        int target = k - 1;
+        SDL_Rect tile = SpriteTileRect(k);
+        SDL_SetRenderDrawColor(renderer, 255,255,255,255);
+        SDL_RenderFillRect(renderer, &tile);
+
+        // Thumbnail: the current costume, or backdrop for the stage
+        const Costume* c = nullptr;
+        if (target == STAGE_TARGET) {
+            if (!mainStage.backdrops.empty()) c = &mainStage.backdrops[mainStage.currentBackdropIndex];
+        } else {
+            const Sprite& sp = allSprites[target];
+            if (sp.currentCostumeIndex >= 0 && sp.currentCostumeIndex < (int)sp.costumes.size())
+                c = &sp.costumes[sp.currentCostumeIndex];
+        }
+        int boxW = tile.w - 8, boxH = tile.h - TextHeight() - 6;
+        if (c && c->texture && c->width > 0 && c->height > 0 && boxH > 0) {
+            double sc = min((double)boxW / c->width, (double)boxH / c->height);
+            SDL_Rect dst = {0, 0, (int)(c->width * sc), (int)(c->height * sc)};
+            dst.x = tile.x + (tile.w - dst.w) / 2;
+            dst.y = tile.y + 2 + (boxH - dst.h) / 2;
+            SDL_RenderCopy(renderer, c->texture, NULL, &dst);
+        }
+        if (gFont) DrawString(renderer, tile.x + 3, tile.y + tile.h - TextHeight() - 2, TargetSprite(target).name, Black, FONT_UI, tile.w - 6);
+
+        if (target == editingTarget) {
+            SDL_SetRenderDrawColor(renderer, 0,100,255,255);
+            SDL_RenderDrawRect(renderer, &tile);
+            SDL_Rect inner = {tile.x+1, tile.y+1, tile.w-2, tile.h-2};
+            SDL_RenderDrawRect(renderer, &inner);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 100,100,100,255);
+            SDL_RenderDrawRect(renderer, &tile);
         }
     }
 }
@@ -570,17 +1011,13 @@ void drawSpriteAtIndex(SDL_Renderer* renderer, const Sprite& sprite, int costume
 }
 
 void Draw_Sprite(SDL_Renderer* renderer, Sprite& sprite, Stage& stage) {
-    for (const auto& stamp : sprite.stamps) {
-        drawSpriteAtIndex(renderer, sprite, stamp.costumeIndex, stamp.x, stamp.y, stamp.size, stamp.direction);
-    }
-
     if (!sprite.isVisible) return;
     Update_Sprite_Render_Rect(sprite, stage);
     int cx = sprite.rect.x + sprite.rect.w / 2;
     int cy = sprite.rect.y + sprite.rect.h / 2;
     drawSpriteAtIndex(renderer, sprite, sprite.currentCostumeIndex, cx, cy, sprite.size, sprite.direction);
 
-    if (!sprite.message.empty() && sprite.messageTimer > 0) {
+    if (!sprite.message.empty() && sprite.messageUntil != 0) {
         int bx = sprite.rect.x + sprite.rect.w/2 - 60;
         int by = sprite.rect.y - 40;
         int bw = 120, bh = 30;
@@ -598,19 +1035,11 @@ void Draw_Sprite(SDL_Renderer* renderer, Sprite& sprite, Stage& stage) {
 }
 
 // ==================== UI FUNCTIONS ====================
-void DrawLoading(SDL_Renderer* renderer, TTF_Font* font1) {
-    SDL_Surface* s; SDL_Texture* t; SDL_Rect r;
+void DrawLoading(SDL_Renderer* renderer) {
     SDL_SetRenderDrawColor(renderer, Blue.r, Blue.g, Blue.b, Blue.a);
     SDL_RenderClear(renderer);
-    s = TTF_RenderText_Blended(font1, "Scratch is loading...", (SDL_Color{255,255,255,255}));
-    if (s) {
-        t = SDL_CreateTextureFromSurface(renderer, s);
-        SDL_QueryTexture(t, NULL, NULL, &r.w, &r.h);
-        r.x = (1280 - r.w)/2; r.y = (720 - r.h)/2;
-        SDL_RenderCopy(renderer, t, NULL, &r);
-        SDL_FreeSurface(s); SDL_DestroyTexture(t);
-    }
-    TTF_CloseFont(font1);
+    const string msg = "Scratch is loading...";
+    DrawString(renderer, (1280 - TextWidth(msg, 30))/2, (720 - TextHeight(30))/2, msg, White, 30);
 }
 void DrawStage(SDL_Renderer* r, SDL_Rect& s, SDL_Color c) {
     roundedBoxRGBA(r, s.x, s.y, s.x+s.w, s.y+s.h, 10, c.r,c.g,c.b,c.a);
@@ -687,9 +1116,8 @@ void Draw_Full_BlockBar_Menu(SDL_Renderer* r, SDL_Rect& bb, Button b[11]) {
     SDL_SetRenderDrawColor(r,200,200,200,255); SDL_RenderDrawRect(r,&bb);
 }
 void Define_Toolbar_BTN_Text(SDL_Renderer* r, Button btn[4]) {
-    TTF_Font* f = TTF_OpenFont("assets/OpenSans-Regular.ttf", 18); if(!f) return;
+    TTF_Font* f = GetFont(18); if(!f) return;
     for (int i=0;i<4;i++) { SDL_Surface* s = TTF_RenderText_Solid(f, btn[i].text.c_str(), White); btn[i].text_texture1 = SDL_CreateTextureFromSurface(r,s); SDL_FreeSurface(s); }
-    TTF_CloseFont(f);
 }
 void Draw_Circle_BTN(SDL_Renderer* r, Button& btn) {
     SDL_Color col = Blue;
@@ -707,6 +1135,22 @@ void Draw_Circle_BTN(SDL_Renderer* r, Button& btn) {
     }
 }
 
+// Variable monitors are drawn as a column of text lines; Render and the
+// hit test below share this layout
+const int MONITOR_X = 800, MONITOR_Y = 400, MONITOR_W = 150, MONITOR_ROW_H = 20;
+
+// Returns the slot of the monitor under (x, y), or -1
+int VariableMonitorAt(int x, int y) {
+    if (x < MONITOR_X || x > MONITOR_X + MONITOR_W) return -1;
+    int varY = MONITOR_Y;
+    for (size_t i = 0; i < variables.size(); i++) {
+        if (!variables[i].alive || !variables[i].isShown) continue;
+        if (y >= varY && y < varY + MONITOR_ROW_H) return i;
+        varY += MONITOR_ROW_H;
+    }
+    return -1;
+}
+
 void Render(SDL_Renderer* r) {
     SDL_SetRenderDrawColor(r, Background.r, Background.g, Background.b, Background.a);
     SDL_RenderClear(r);
@@ -717,8 +1161,8 @@ void Render(SDL_Renderer* r) {
     DrawBlockbar_Funcs(r, Plate, White);
     DrawStage(r, BackDrop_List, White);
     DrawStage(r, Sprite_Info, White);
-    DrawStage(r, Sprite_List, White);
-    DrawBlockbar_Funcs(r, Sprite_List, Background);
+    DrawStage(r, History_List, White);
+    DrawBlockbar_Funcs(r, History_List, Background);
     DrawMenuButton(r, Go);
     DrawMenuButton(r, Stop);
     DrawMenuButton(r, Pause);
@@ -728,17 +1172,23 @@ void Render(SDL_Renderer* r) {
     // DrawMenuButton(r, RedoBtn);
     DrawAllBlocks(r);
     SDL_RenderSetClipRect(r, &mainStage.rect);
-    DrawPenLines(r);
+    DrawPenCanvas(r);
+    // clones (oldest first) behind the sprites
+    for (int id : clones.live) {
+        Draw_Sprite(r, LoadClone(id), mainStage);
+        StoreClone(id);
+    }
     for (auto& s : allSprites) Draw_Sprite(r, s, mainStage);
     SDL_RenderSetClipRect(r, NULL);
     DrawSpriteInfo(r);
+    DrawSpriteList(r);
 
-    int varY = 400;
+    int varY = MONITOR_Y;
     for (auto& var : variables) {
-        if (var.isShown) {
+        if (var.alive && var.isShown) {
             string text = var.name + " = " + to_string(var.value);
-            RenderText(r, 800, varY, text, Black);
-            varY += 20;
+            RenderText(r, MONITOR_X, varY, text, Black);
+            varY += MONITOR_ROW_H;
         }
     }
 
@@ -774,7 +1224,7 @@ void Render(SDL_Renderer* r) {
     }
 
     // ========== History panel ==========
-    SDL_Rect historyPanel = Sprite_List;
+    SDL_Rect historyPanel = History_List;
     SDL_SetRenderDrawColor(r, 240,240,240,255);
     SDL_RenderFillRect(r, &historyPanel);
     SDL_SetRenderDrawColor(r, 180,180,180,255);
@@ -782,10 +1232,19 @@ void Render(SDL_Renderer* r) {
     int hx = historyPanel.x + 5;
     int hw = historyPanel.w - 10;
     int lineH = 20;
-    int total = historyLog.size();
-    int start = max(0, total - 14);
+    int newest = undoCount - 1 - historyScroll;
+    int start = max(0, newest - 13);
+    if (historyRows.empty() || historyRowsNewest != newest) {
+        historyRows.clear();
+        for (int idx = newest; idx >= start; idx--) {
+            string display = historyDescription(idx);
+            if (display.length() > 25) display = display.substr(0,22) + "...";
+            historyRows.push_back(display);
+        }
+        historyRowsNewest = newest;
+    }
     int y = historyPanel.y + 5;
-    for (int idx = total - 1; idx >= start; idx--) {
+    for (int idx = newest; idx >= start; idx--) {
         SDL_Rect itemRect = {hx, y, hw, lineH};
         if (idx == undoIndex) {
             SDL_SetRenderDrawColor(r, 200,230,255,255);
@@ -796,13 +1255,13 @@ void Render(SDL_Renderer* r) {
         }
         SDL_SetRenderDrawColor(r, 0,0,0,255);
         SDL_RenderDrawRect(r, &itemRect);
-        string display = historyLog[idx].description;
-        if (display.length() > 25) display = display.substr(0,22) + "...";
-        RenderText(r, itemRect.x + 2, itemRect.y + 2, display, Black);
+        RenderText(r, itemRect.x + 2, itemRect.y + 2, historyRows[newest - idx], Black);
         y += lineH + 2;
         if (y + lineH > historyPanel.y + historyPanel.h - 5) break;
     }
 
+    if (profilerEnabled) DrawProfilePanel(r);
+
     // ========== Error/Log bar ==========
     SDL_Rect logBar = {60, 720-35, 1220, 35};
     SDL_SetRenderDrawColor(r, 255,255,255,255);
@@ -814,6 +1273,10 @@ void Render(SDL_Renderer* r) {
     } else if (!lastNormalLog.empty()) {
         RenderText(r, 70, 720-28, lastNormalLog, Black);
     }
+    if (scriptsRunning && blocksPerSecond > 0) {
+        string rate = to_string(blocksPerSecond) + " blocks/s" + (turboMode ? " (turbo)" : "");
+        RenderText(r, 1280-230, 720-28, rate, turboMode ? Red : Black);
+    }
 
     Draw_Circle_BTN(r, Sprite_Choosing);
     Draw_Circle_BTN(r, Add_BackDrop);
@@ -862,7 +1325,7 @@ void Define_Blockbar_BTN_Text(SDL_Renderer* r, Button btn[11]) {
         if (btn[i].text_texture1) { SDL_DestroyTexture(btn[i].text_texture1); btn[i].text_texture1 = nullptr; }
         if (btn[i].text_texture2) { SDL_DestroyTexture(btn[i].text_texture2); btn[i].text_texture2 = nullptr; }
     }
-    TTF_Font* f = TTF_OpenFont("assets/OpenSans-Regular.ttf", 10); if(!f) return;
+    TTF_Font* f = GetFont(10); if(!f) return;
     SDL_Surface* s;
     SDL_Color textBlack = {0,0,0,255};
     for (int i=0;i<10;i++) {
@@ -874,12 +1337,16 @@ void Define_Blockbar_BTN_Text(SDL_Renderer* r, Button btn[11]) {
         btn[i].text_texture2 = SDL_CreateTextureFromSurface(r,s); SDL_FreeSurface(s);
     }
     s = IMG_Load("assets/icons8-add-properties-32.png"); if(s) { btn[10].Picture1 = SDL_CreateTextureFromSurface(r,s); SDL_FreeSurface(s); }
-    TTF_CloseFont(f);
 }
 void Define_Panel_BTN_Text(SDL_Renderer* r, Button btn[], int cnt) {
-    TTF_Font* f = TTF_OpenFont("assets/OpenSans-Regular.ttf", 30); if(!f) return;
+    TTF_Font* f = GetFont(30); if(!f) return;
     for (int i=0;i<cnt;i++) { SDL_Surface* s = TTF_RenderUTF8_Blended(f, btn[i].text.c_str(), btn[i].textcolor); btn[i].text_texture1 = SDL_CreateTextureFromSurface(r,s); SDL_FreeSurface(s); }
-    TTF_CloseFont(f);
+}
+void Set_Panel_BTN_Text(SDL_Renderer* r, Button& btn, const string& text) {
+    btn.text = text;
+    TTF_Font* f = GetFont(30); if(!f) return;
+    if (btn.text_texture1) SDL_DestroyTexture(btn.text_texture1);
+    SDL_Surface* s = TTF_RenderUTF8_Blended(f, btn.text.c_str(), btn.textcolor); btn.text_texture1 = SDL_CreateTextureFromSurface(r,s); SDL_FreeSurface(s);
 }
 void Draw_Panel(SDL_Renderer* r, Panel p) { DrawToolbar(r, p.rect, Blue); for (int i=0;i<p.count;i++) Draw_Panel_Btn(r, p.btn[i]); }
 void Draw_Panel_Btn(SDL_Renderer* r, Button& btn) {
@@ -912,12 +1379,6 @@ void UpdateAllButtons(vector<Button*> bts, int mx, int my, bool md, bool mu, boo
     }
 }
 void UpdateSprites(vector<Sprite>& sp, Stage& st, int mx, int my, bool isDown, bool isUp, bool uiHandled, SDL_Renderer* renderer) {
-    for (auto& s : sp) {
-        if (s.messageTimer > 0) {
-            s.messageTimer--;
-            if (s.messageTimer == 0) s.message.clear();
-        }
-    }
     for (auto& s : sp) {
         Update_Sprite_Render_Rect(s, st);
         Clamp_Sprite_To_Stage_Bounds(s, st);
@@ -925,7 +1386,7 @@ void UpdateSprites(vector<Sprite>& sp, Stage& st, int mx, int my, bool isDown, b
     if (isUp) for (auto& s : sp) s.isBeingDragged = false;
     if (isDown && !uiHandled) {
         for (int i = sp.size()-1; i >= 0; i--) {
-            if (IsMouseOverRect(sp[i].rect, mx, my)) {
+            if (SpriteHitTest(sp[i], mx, my)) {
                 bool any = false;
                 for (auto& s : sp) if (s.isBeingDragged) any = true;
                 if (!any && sp[i].isDraggable) {
@@ -959,14 +1420,14 @@ void Add_Costume_To_Sprite(SDL_Renderer* r, Sprite& s, const string& name, const
     c.name = name;
     SDL_Surface* surf = IMG_Load(path);
     if (!surf) {
-        cout << "Failed to load costume: " << IMG_GetError() << endl;
+        cerr << "Failed to load costume: " << IMG_GetError() << endl;
         return;
     }
 
     SDL_Surface* rgbaSurf = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA8888, 0);
     SDL_FreeSurface(surf);
     if (!rgbaSurf) {
-        cout << "Failed to convert surface to RGBA: " << SDL_GetError() << endl;
+        cerr << "Failed to convert surface to RGBA: " << SDL_GetError() << endl;
         return;
     }
 
@@ -987,7 +1448,7 @@ void Add_Costume_To_Sprite(SDL_Renderer* r, Sprite& s, const string& name, const
 
     SDL_Surface* scaledSurf = SDL_CreateRGBSurfaceWithFormat(0, newW, newH, 32, SDL_PIXELFORMAT_RGBA8888);
     if (!scaledSurf) {
-        cout << "Failed to create scaled surface: " << SDL_GetError() << endl;
+        cerr << "Failed to create scaled surface: " << SDL_GetError() << endl;
         SDL_FreeSurface(rgbaSurf);
         return;
     }
@@ -997,7 +1458,9 @@ void Add_Costume_To_Sprite(SDL_Renderer* r, Sprite& s, const string& name, const
     c.texture = SDL_CreateTextureFromSurface(r, scaledSurf);
     c.width = newW;
     c.height = newH;
-    SDL_FreeSurface(scaledSurf);
+    c.surface = scaledSurf;
+    c.mask = BuildCollisionMask(scaledSurf);
+    c.path = path;
 
     s.costumes.push_back(c);
 
@@ -1028,9 +1491,11 @@ void Define_FilePanel_Btn(Button b[3]) {
     b[1]={{100,b[0].rect.y+b[0].rect.h,b[0].rect.w,30},Blue,Blue,DarkerBlue,White,Button_Normal,BTN_LoadFile,"Load from your computer",false};
     b[2]={{100,b[1].rect.y+b[1].rect.h,b[0].rect.w,30},Blue,Blue,DarkerBlue,White,Button_Normal,BTN_SaveFile,"Save to your computer",false};
 }
-void Define_EditPanel_Btn(Button b[2]) {
+void Define_EditPanel_Btn(Button b[4]) {
     b[0]={{145,45,200,30},Blue,Blue,DarkerBlue,LightBlue,Button_Normal,BTN_Restore,"Restore",false};
     b[1]={{145,b[0].rect.y+b[0].rect.h,200,30},Blue,Blue,DarkerBlue,White,Button_Normal,BTN_Turbo,"Turn on Turbo Mode",false};
+    b[2]={{145,b[1].rect.y+b[1].rect.h,200,30},Blue,Blue,DarkerBlue,White,Button_Normal,BTN_Profile,"Turn on Profiler",false};
+    b[3]={{145,b[2].rect.y+b[2].rect.h,200,30},Blue,Blue,DarkerBlue,White,Button_Normal,BTN_ExportProfile,"Export Profile (CSV)",false};
 }
 void Define_HelpPanel_Btn(Button b[3]) {
     b[0]={{1080,45,200,30},Blue,Blue,DarkerBlue,White,Button_Normal,BTN_About,"About",false};
@@ -1074,15 +1539,16 @@ void HandleButtonClick(vector<Button*> bts, Button& btn, int x, int y, bool up,
         } else if (btn.buttonID == BTN_Play) {
             scriptsRunning = true; isPaused = false; stepRequested = false; flagScripts.clear();
             startScriptsForHat(BLOCK_WHEN_FLAG);
-            pushState("Green flag clicked");
+            beginRunSession("Green flag clicked");
         } else if (btn.buttonID == BTN_Stop) {
             scriptsRunning = false; isPaused = false; stepRequested = false; stepModeActive = false;
-            flagScripts.clear(); spaceScripts.clear(); clickScripts.clear(); messageScripts.clear();
+            ClearScriptQueues();
             currentExecutingBlock = nullptr; StepBtn.isselected = false;
-            pushState("Stop clicked");
+            endRunSession();
+            logAction("Stop clicked");
         } else if (btn.buttonID == BTN_Pause) {
             isPaused = !isPaused;
-            pushState(isPaused ? "Paused" : "Resumed");
+            logAction(isPaused ? "Paused" : "Resumed");
         } else if (btn.buttonID == BTN_Step) {
             if (!stepModeActive) {
                 // Enter step mode and execute first step
@@ -1092,14 +1558,15 @@ void HandleButtonClick(vector<Button*> bts, Button& btn, int x, int y, bool up,
                     flagScripts.clear();
                     startScriptsForHat(BLOCK_WHEN_FLAG);
                     scriptsRunning = true;
+                    beginRunSession("Green flag (step mode)");
                 }
                 stepRequested = true;
-                pushState("Step mode ON");
+                logAction("Step mode ON");
             } else {
                 // Already in step mode: advance exactly one step
                 stepRequested = true;
                 isPaused = false;
-                pushState("Step");
+                logAction("Step");
             }
         } else if (btn.buttonID == BTN_Undo) {
             if (renderer) undo(renderer);
@@ -1107,6 +1574,19 @@ void HandleButtonClick(vector<Button*> bts, Button& btn, int x, int y, bool up,
             if (renderer) redo(renderer);
         } else if (btn.buttonID == BTN_AddExt) {
             showExtPanel = !showExtPanel;
+        } else if (btn.buttonID == BTN_SChoose) {
+            // Open file dialog for the new sprite's costume
+            const char* filters[] = { "*.png", "*.jpg", "*.jpeg", "*.bmp", "*.gif" };
+            const char* filePath = tinyfd_openFileDialog("Choose Sprite Image", "", 5, filters, "Image Files", 0);
+            if (filePath && renderer) {
+                string fp(filePath);
+                string fname = fp;
+                size_t slash = fp.find_last_of("/\\");
+                if (slash != string::npos) fname = fp.substr(slash+1);
+                size_t dot = fname.find_last_of('.');
+                if (dot != string::npos) fname = fname.substr(0, dot);
+                addSpriteFromFile(renderer, fp, fname);
+            }
         } else if (btn.buttonID == BTN_AddBack) {
             // Open file dialog for image upload
             const char* filters[] = { "*.png", "*.jpg", "*.jpeg", "*.bmp", "*.gif" };
@@ -1142,6 +1622,7 @@ void Update_Sprite_Render_Rect(Sprite& s, Stage& st) {
     int sx = cx + (int)s.scratchx, sy = cy - (int)s.scratchy;
     s.rect.x = sx - s.rect.w/2;
     s.rect.y = sy - s.rect.h/2;
+    MarkSpriteMoved(s);
 }
 void Move_Sprite(Sprite& s, Stage& st, double steps) {
     double rad = s.direction * M_PI/180;
@@ -9,22 +9,52 @@
 //        manual state, struct-heavy, no polymorphism.
 // ============================================================
 
-void UpdateBlockTexture(shared_ptr<Block> block, SDL_Renderer* renderer);
+Uint64 LabelTextureKey(int size, SDL_Color c);
+LabelTextureRef AcquireLabelTexture(const string& label, int size, SDL_Color color);
+void LruUnlink(int id);
+void LruPushFront(int id);
+void FreeLabelEntry(int id);
+void EvictLabelTexture(int id);
+void ReleaseLabelTexture(int id);
+bool RasterizeLabel(int id, SDL_Renderer* renderer);
+SDL_Texture* LabelTextureFor(const LabelTextureRef& ref, SDL_Renderer* renderer, int* w, int* h);
+void PrewarmLabelTextures(SDL_Renderer* renderer, Uint32 deadline);
+void ClearLabelTextures();
+void UpdateBlockTexture(BlockRef block, SDL_Renderer* renderer);
 void BuildPaletteBlocksForCategory(Category cat, SDL_Renderer* renderer);
-void DrawBlock(const Block& block, SDL_Renderer* renderer);
+void DrawBlock(const Block& block, SDL_Renderer* renderer, float heat);
 void DrawAllBlocks(SDL_Renderer* renderer);
-void FreeBlockTexture(Block& block);
-void InsertBlockAtSnap(shared_ptr<Block> block, shared_ptr<Block> target, bool above);
+SDL_Rect ProfileHeaderRect(int col);
+void DrawProfilePanel(SDL_Renderer* r);
+void HandleProfilePanelClick(int x, int y);
+void InsertBlockAtSnap(BlockRef block, BlockRef target, bool above);
 void HandleBlockEvents(SDL_Event& event, int mouseX, int mouseY, bool mouseDown, bool mouseUp, SDL_Renderer* renderer);
 
+FontAtlas* GetFontAtlas(int size);
+TTF_Font* GetFont(int size);
+void CloseFonts();
+Uint32 NextCodepoint(const string& s, size_t& i);
+Glyph& GlyphOf(FontAtlas& fa, Uint32 ch);
+bool GrowAtlas(FontAtlas& fa);
+void RasterizeGlyph(SDL_Renderer* r, FontAtlas& fa, Uint32 ch, Glyph& g);
+int  TextRun(SDL_Renderer* r, FontAtlas& fa, int x, int y, const string& txt, SDL_Color col, int maxW);
+int  DrawString(SDL_Renderer* r, int x, int y, const string& txt, SDL_Color col, int size = FONT_UI, int maxW = -1);
+int  TextWidth(const string& txt, int size = FONT_UI);
+int  TextHeight(int size = FONT_UI);
 void RenderText(SDL_Renderer* r, int x, int y, const string& txt, SDL_Color col);
 
 void HandleSpriteInfoEvents(int mouseX, int mouseY, bool mouseUp, SDL_Renderer* renderer);
 void DrawSpriteInfo(SDL_Renderer* renderer);
+SDL_Rect SpriteTileRect(int k);
+int  SpriteTilesShown();
+void ScrollSpriteList(int tiles);
+int  SpriteTileAt(int x, int y);
+void SelectTarget(int target);
+void DrawSpriteList(SDL_Renderer* renderer);
 void drawSpriteAtIndex(SDL_Renderer* renderer, const Sprite& sprite, int costumeIndex, int x, int y, double size, double direction);
 void Draw_Sprite(SDL_Renderer* renderer, Sprite& sprite, Stage& stage);
 
-void DrawLoading(SDL_Renderer* renderer, TTF_Font* font1);
+void DrawLoading(SDL_Renderer* renderer);
 void DrawStage(SDL_Renderer* renderer, SDL_Rect& stage, SDL_Color color);
 void DrawToolbar(SDL_Renderer* r, SDL_Rect& t, SDL_Color c);
 void DrawBlockbar_Funcs(SDL_Renderer* renderer, SDL_Rect& blockbar, SDL_Color color);
@@ -36,16 +66,18 @@ void Draw_Full_BlockBar_Menu(SDL_Renderer* renderer, SDL_Rect& blockbar, Button
 void Draw_Stage(SDL_Renderer* renderer, Stage& stage);
 void Draw_Panel(SDL_Renderer* renderer, Panel p);
 void Draw_Panel_Btn(SDL_Renderer* renderer, Button& btn);
+int  VariableMonitorAt(int x, int y);
 void Render(SDL_Renderer* renderer);
 
 void Define_Toolbar(SDL_Renderer* renderer, Button toolbar_BTN[4]);
 void Define_BlockBar(Button blockbar_BTN[11]);
 void Define_FilePanel_Btn(Button btn[3]);
 void Define_HelpPanel_Btn(Button btn[3]);
-void Define_EditPanel_Btn(Button btn[2]);
+void Define_EditPanel_Btn(Button btn[4]);
 void Define_Toolbar_BTN_Text(SDL_Renderer* renderer, Button btn[4]);
 void Define_Blockbar_BTN_Text(SDL_Renderer* renderer, Button btn[11]);
 void Define_Panel_BTN_Text(SDL_Renderer* renderer, Button btn[], int count);
+void Set_Panel_BTN_Text(SDL_Renderer* renderer, Button& btn, const string& text);
 
 bool IsMouseOverRect(SDL_Rect& rect, int mouseX, int mouseY);
 bool IsMouseOverCircle(Button& btn, int mouseX, int mouseY);
@@ -58,6 +90,9 @@ void False_Selected(Button btn[], int count);
 
 void Add_Costume_To_Sprite(SDL_Renderer* renderer, Sprite& sprite, const string& costumeName, const char* filePath);
 Sprite Create_Sprite(int id, string name);
+Sprite& TargetSprite(int target);
+void FreeSpriteCostumes(Sprite& sprite);
+void TruncateSprites(size_t n);
 void Update_Sprite_Render_Rect(Sprite& sprite, Stage& stage);
 void Move_Sprite(Sprite& sprite, Stage& stage, double steps);
 void Turn_Sprite(Sprite& sprite, double degrees);
@@ -0,0 +1,366 @@
+// ============================================================
+// stress.cpp — Large project generator & scaling benchmark
+// ============================================================
+// Writes synthetic "#ScratchProject 2" files of any size, and
+// measures how the editor's whole-project operations grow with
+// them: loadProject, saveProject, pushState, a DrawAllBlocks
+// frame and the snap-candidate search while a block is dragged
+// (through HandleBlockEvents, as the mouse would drive it).
+// Drawing goes to a software renderer, so no window is opened.
+//
+//   g++ -O2 -std=c++14 stress.cpp tinyfiledialogs.c -o scratch_stress \
+//       -lSDL2 -lSDL2_image -lSDL2_mixer -lSDL2_ttf -lSDL2_gfx -pthread
+//   ./scratch_stress --generate out.txt [project options]
+//   ./scratch_stress [--sizes 10000,50000,200000] [--out table.json]
+//                    [--dir DIR] [--keep] [project options]
+//   project options: --blocks N --depth D --vars V --fanout F --seed S
+// ============================================================
+#define SCRATCH_NO_MAIN
+#include "main.cpp"
+
+// ==================== PROJECT GENERATOR ====================
+// Scripts come in groups: a green flag script that ends by broadcasting
+// the group's message, then 'fanout' scripts receiving it. Script bodies
+// mix motion and variable blocks with repeat / if nested up to 'depth'.
+// The block count is exact; stacks are laid out in columns on the plate.
+
+struct GenOptions {
+    int blocks = 10000;
+    int depth = 3;       // deepest repeat / if nesting
+    int vars = 20;
+    int fanout = 4;      // receivers per broadcast message
+    unsigned seed = 1;
+};
+
+struct GenBlock {
+    BlockType type;
+    Category category;
+    string base, label, str;
+    int value = 0;
+    SDL_Rect rect = {0, 0, 0, 0};
+    int next = -1;
+};
+
+const int GEN_COLUMNS = 6;
+
+struct ProjectGen {
+    GenOptions opt;
+    unsigned rng = 1;
+    vector<GenBlock> blocks;
+    int last = -1;                    // previous block of the stack being built
+    int column = 0;
+    int columnY[GEN_COLUMNS] = {};
+};
+
+int GenRand(ProjectGen& g, int n) {
+    g.rng = g.rng * 1103515245u + 12345u;
+    return (int)((g.rng >> 8) % (unsigned)n);
+}
+
+string GenVar(ProjectGen& g) {
+    return "v" + to_string(GenRand(g, g.opt.vars));
+}
+
+void GenEmit(ProjectGen& g, BlockType type, Category cat, const string& base, const string& label,
+             const string& str = "", int value = 0) {
+    GenBlock b;
+    b.type = type; b.category = cat; b.base = base; b.label = label; b.str = str; b.value = value;
+    int& y = g.columnY[g.column];
+    b.rect = { Plate.x + 10 + g.column * 230, y, 200, BLOCK_HEIGHT };
+    y += BLOCK_HEIGHT + GAP;
+    if (g.last >= 0) g.blocks[g.last].next = (int)g.blocks.size();
+    g.last = (int)g.blocks.size();
+    g.blocks.push_back(b);
+}
+
+void GenStatement(ProjectGen& g) {
+    int kind = GenRand(g, g.opt.vars > 0 ? 5 : 3);
+    if (kind == 0) {
+        int v = 1 + GenRand(g, 10);
+        GenEmit(g, BLOCK_MOVE_STEPS, CAT_MOTION, "move {} steps", "move " + to_string(v) + " steps", "", v);
+    } else if (kind == 1) {
+        int v = 1 + GenRand(g, 30);
+        GenEmit(g, BLOCK_TURN_RIGHT, CAT_MOTION, "turn right {} degrees", "turn right " + to_string(v) + " degrees", "", v);
+    } else if (kind == 2) {
+        int v = GenRand(g, 21) - 10;
+        GenEmit(g, BLOCK_CHANGE_X, CAT_MOTION, "change x by {}", "change x by " + to_string(v), "", v);
+    } else if (kind == 3) {
+        string a = GenVar(g);
+        GenEmit(g, BLOCK_CHANGE_VAR, CAT_VARIABLES, "change {} by {}", "change " + a + " by 1", a + "=1", 1);
+    } else {
+        string a = GenVar(g), b = GenVar(g);
+        GenEmit(g, BLOCK_SET_VAR, CAT_VARIABLES, "set {} to {}", "set " + a + " to " + b + "+1", a + "=" + b + "+1");
+    }
+}
+
+// Appends exactly 'budget' blocks at nesting level 'level'
+void GenBody(ProjectGen& g, int budget, int level) {
+    while (budget > 0) {
+        if (level < g.opt.depth && budget >= 4 && GenRand(g, 4) == 0) {
+            bool isIf = GenRand(g, 2) == 1;
+            int overhead = isIf ? 3 : 2;   // condition + IF + END, or REPEAT + END
+            int inner = 1 + GenRand(g, min(budget - overhead, 12));
+            if (isIf) {
+                string cond = g.opt.vars > 0 ? GenVar(g) + "<" + to_string(GenRand(g, 100)) : "1<2";
+                GenEmit(g, BLOCK_LESS_THAN, CAT_OPERATORS, "{}", cond, cond);
+                GenEmit(g, BLOCK_IF, CAT_CONTROL, "if then", "if then");
+            } else {
+                int times = 2 + GenRand(g, 9);
+                GenEmit(g, BLOCK_REPEAT, CAT_CONTROL, "repeat {}", "repeat " + to_string(times), "", times);
+            }
+            GenBody(g, inner, level + 1);
+            GenEmit(g, BLOCK_END, CAT_CONTROL, "end", "end");
+            budget -= overhead + inner;
+        } else {
+            GenStatement(g);
+            budget--;
+        }
+    }
+}
+
+// One stack of 'length' blocks under the hat; 'broadcast' ends it when set
+void GenStack(ProjectGen& g, int length, const string& receive, const string& broadcast) {
+    g.last = -1;
+    g.column = (g.column + 1) % GEN_COLUMNS;
+    if (g.columnY[g.column] == 0) g.columnY[g.column] = Plate.y + 10;
+    if (receive.empty()) GenEmit(g, BLOCK_WHEN_FLAG, CAT_EVENTS, "when flag clicked", "when flag clicked");
+    else GenEmit(g, BLOCK_WHEN_RECEIVE, CAT_EVENTS, "when I receive message1", "when I receive " + receive, receive);
+    int body = length - 1;
+    if (!broadcast.empty() && body > 0) body--;
+    GenBody(g, body, 0);
+    if (!broadcast.empty() && length > 1)
+        GenEmit(g, BLOCK_BROADCAST, CAT_EVENTS, "broadcast message1", "broadcast " + broadcast, broadcast);
+    g.columnY[g.column] += 30;
+}
+
+bool GenerateProject(const GenOptions& opt, const string& path) {
+    ProjectGen g;
+    g.opt = opt;
+    g.rng = opt.seed;
+    g.blocks.reserve(opt.blocks);
+    for (int group = 0; (int)g.blocks.size() < opt.blocks; group++) {
+        string msg = "msg" + to_string(group);
+        for (int s = 0; s <= opt.fanout && (int)g.blocks.size() < opt.blocks; s++) {
+            int length = min(opt.blocks - (int)g.blocks.size(), 10 + GenRand(g, 30));
+            GenStack(g, length, s == 0 ? "" : msg, s == 0 && opt.fanout > 0 ? msg : "");
+        }
+    }
+
+    ofstream file(path);
+    if (!file.is_open()) return false;
+    file << "#ScratchProject 2\n";
+    file << "Sprite 0 0 90 100 1 0 255 165 0 2\n";
+    file << "Backdrop 0\n";
+    file << "Variables " << opt.vars << "\n";
+    for (int v = 0; v < opt.vars; v++) file << "Var v" << v << " 0 0\n";
+    file << "Blocks " << g.blocks.size() << "\n";
+    for (size_t i = 0; i < g.blocks.size(); i++) {
+        const GenBlock& b = g.blocks[i];
+        file << "Block " << i << " " << (int)b.type << " " << (int)b.category << " "
+             << "|" << b.base << "|" << "|" << b.label << "|" << "|" << b.str << "|"
+             << " " << b.value << " 0"
+             << " " << b.rect.x << " " << b.rect.y << " " << b.rect.w << " " << b.rect.h
+             << " " << b.next << "\n";
+    }
+    return (bool)file;
+}
+
+// ==================== SCALING BENCHMARK ====================
+// Every size runs on a thread of its own, so it starts from a fresh engine
+// (see the thread_local note at the top of main.cpp). All sizes share one
+// software renderer, made on the main thread with the font atlases.
+
+struct StressRow {
+    int blocks = 0;
+    double loadMs = 0, saveMs = 0, pushMs = 0, drawMs = 0, snapUs = 0;
+    string error;
+};
+
+const int STRESS_PUSHES = 10;
+const int STRESS_FRAMES = 5;
+const int STRESS_DRAG_MOVES = 200;
+
+double MsSince(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+}
+
+void RunStressSize(const string& path, const string& savePath, SDL_Renderer* renderer, StressRow& row) {
+    keepHistory = true;
+    CreateDefaultProject(nullptr);
+
+    auto t0 = chrono::steady_clock::now();
+    loadProject(path, renderer);
+    row.loadMs = MsSince(t0);
+    if (projectPath != path) {
+        row.error = errorMessage;
+        ReleaseEngine();
+        return;
+    }
+    row.blocks = (int)scriptBlocks.size();
+
+    t0 = chrono::steady_clock::now();
+    saveProject(savePath);
+    row.saveMs = MsSince(t0);
+
+    // one stack nudged per entry, as a small edit would
+    t0 = chrono::steady_clock::now();
+    for (int i = 0; i < STRESS_PUSHES; i++) {
+        for (BlockRef b = scriptBlocks[0]; b; b = b->next) {
+            NoteBlockEdited(b);
+            b->rect.x += i % 2 ? -5 : 5;
+        }
+        pushState("Stress edit");
+    }
+    row.pushMs = MsSince(t0) / STRESS_PUSHES;
+
+    for (int i = 0; i < 2; i++) DrawAllBlocks(renderer);   // labels are rasterized on first sight
+    t0 = chrono::steady_clock::now();
+    for (int i = 0; i < STRESS_FRAMES; i++) {
+        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+        SDL_RenderClear(renderer);
+        DrawAllBlocks(renderer);
+    }
+    row.drawMs = MsSince(t0) / STRESS_FRAMES;
+
+    // Grab a block in the middle of the project and sweep it over the plate
+    SDL_Rect grab = scriptBlocks[scriptBlocks.size() / 2]->rect;
+    int x = grab.x + 10, y = grab.y + 10;
+    SDL_Event ev = {};
+    ev.type = SDL_MOUSEBUTTONDOWN;
+    HandleBlockEvents(ev, x, y, true, false, renderer);
+    ev.type = SDL_MOUSEMOTION;
+    HandleBlockEvents(ev, x + DRAG_THRESHOLD * 4, y + DRAG_THRESHOLD * 4, false, false, renderer);
+    t0 = chrono::steady_clock::now();
+    for (int i = 0; i < STRESS_DRAG_MOVES; i++)
+        HandleBlockEvents(ev, Plate.x + (i * 37) % Plate.w, Plate.y + (i * 53) % Plate.h, false, false, renderer);
+    row.snapUs = MsSince(t0) * 1000 / STRESS_DRAG_MOVES;
+    ev.type = SDL_MOUSEBUTTONUP;
+    HandleBlockEvents(ev, Plate.x + 20, Plate.y + 20, false, true, renderer);
+
+    closeHistoryFile();   // and removes it
+    ReleaseEngine();
+}
+
+// Per block costs, and each one's growth over the smallest size: a linear
+// operation stays near 1x, anything past STRESS_NONLINEAR is flagged
+const double STRESS_NONLINEAR = 1.5;
+
+void PrintStressTable(const vector<StressRow>& rows) {
+    printf("%10s %11s %11s %11s %11s %11s\n", "blocks", "load ms", "save ms", "push ms", "draw ms", "snap us");
+    for (auto& r : rows)
+        printf("%10d %11.2f %11.2f %11.3f %11.3f %11.2f\n", r.blocks, r.loadMs, r.saveMs, r.pushMs, r.drawMs, r.snapUs);
+    if (rows.empty()) return;
+
+    printf("\nns per block (growth over %d blocks, '!' = not linear)\n", rows[0].blocks);
+    printf("%10s %17s %17s %17s %17s %17s\n", "blocks", "load", "save", "push", "draw", "snap");
+    auto perBlock = [](const StressRow& r, int col) {
+        double v[] = { r.loadMs * 1e6, r.saveMs * 1e6, r.pushMs * 1e6, r.drawMs * 1e6, r.snapUs * 1e3 };
+        return v[col] / max(1, r.blocks);
+    };
+    for (auto& r : rows) {
+        printf("%10d", r.blocks);
+        for (int c = 0; c < 5; c++) {
+            double ns = perBlock(r, c), base = perBlock(rows[0], c);
+            double growth = base > 0 ? ns / base : 1;
+            printf(" %9.2f %5.1fx%c", ns, growth, growth > STRESS_NONLINEAR ? '!' : ' ');
+        }
+        printf("\n");
+    }
+}
+
+void WriteStressJson(ostream& out, const GenOptions& opt, const vector<StressRow>& rows) {
+    out << "{\n  \"depth\": " << opt.depth << ", \"vars\": " << opt.vars << ", \"fanout\": " << opt.fanout
+        << ", \"seed\": " << opt.seed << ",\n  \"sizes\": [\n";
+    for (size_t i = 0; i < rows.size(); i++) {
+        const StressRow& r = rows[i];
+        out << "    {\"blocks\": " << r.blocks << ", \"load_ms\": " << jsonNumber(r.loadMs)
+            << ", \"save_ms\": " << jsonNumber(r.saveMs) << ", \"push_ms\": " << jsonNumber(r.pushMs)
+            << ", \"draw_ms\": " << jsonNumber(r.drawMs) << ", \"snap_us\": " << jsonNumber(r.snapUs) << "}"
+            << (i + 1 < rows.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+// ==================== MAIN ====================
+int main(int argc, char* argv[]) {
+    const char* usage =
+        "usage: scratch_stress --generate out.txt [--blocks N] [--depth D] [--vars V] [--fanout F] [--seed S]\n"
+        "       scratch_stress [--sizes N,N,...] [--out table.json] [--dir DIR] [--keep] [--depth D] [--vars V] [--fanout F] [--seed S]\n";
+    GenOptions opt;
+    string generatePath, outPath, dir = ".";
+    vector<int> sizes = { 10000, 50000, 200000 };
+    bool keep = false;
+    for (int i = 1; i < argc; i++) {
+        string a = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (a == "--generate" && hasValue) generatePath = argv[++i];
+        else if (a == "--blocks" && hasValue) opt.blocks = atoi(argv[++i]);
+        else if (a == "--depth" && hasValue) opt.depth = atoi(argv[++i]);
+        else if (a == "--vars" && hasValue) opt.vars = atoi(argv[++i]);
+        else if (a == "--fanout" && hasValue) opt.fanout = atoi(argv[++i]);
+        else if (a == "--seed" && hasValue) opt.seed = (unsigned)strtoul(argv[++i], nullptr, 10);
+        else if (a == "--out" && hasValue) outPath = argv[++i];
+        else if (a == "--dir" && hasValue) dir = argv[++i];
+        else if (a == "--keep") keep = true;
+        else if (a == "--sizes" && hasValue) {
+            sizes.clear();
+            string list = argv[++i];
+            for (size_t p = 0; p < list.size(); ) {
+                size_t comma = list.find(',', p);
+                if (comma == string::npos) comma = list.size();
+                sizes.push_back(atoi(list.substr(p, comma - p).c_str()));
+                p = comma + 1;
+            }
+        }
+        else { fprintf(stderr, "%s", usage); return 2; }
+    }
+    bool badSize = sizes.empty();
+    for (int n : sizes) badSize = badSize || n < 1;
+    if (opt.blocks < 1 || opt.depth < 0 || opt.vars < 0 || opt.fanout < 0 || badSize) {
+        fprintf(stderr, "%s", usage);
+        return 2;
+    }
+
+    if (!generatePath.empty()) {
+        if (!GenerateProject(opt, generatePath)) { fprintf(stderr, "Cannot write %s\n", generatePath.c_str()); return 1; }
+        printf("%s: %d blocks\n", generatePath.c_str(), opt.blocks);
+        return 0;
+    }
+
+    if (SDL_Init(SDL_INIT_TIMER) < 0) fprintf(stderr, "Error initializing SDL timer: %s\n", SDL_GetError());
+    if (TTF_Init() < 0) fprintf(stderr, "Error initializing Font: %s\n", TTF_GetError());
+    SDL_Surface* frame = SDL_CreateRGBSurfaceWithFormat(0, 1280, 720, 32, SDL_PIXELFORMAT_RGBA8888);
+    SDL_Renderer* renderer = frame ? SDL_CreateSoftwareRenderer(frame) : nullptr;
+    if (!renderer) { fprintf(stderr, "Cannot create a software renderer: %s\n", SDL_GetError()); return 1; }
+    gFont = GetFont(FONT_UI);
+
+    vector<StressRow> rows;
+    int status = 0;
+    for (int n : sizes) {
+        GenOptions o = opt;
+        o.blocks = n;
+        string path = dir + "/stress_" + to_string(n) + ".txt";
+        string savePath = dir + "/stress_" + to_string(n) + "_saved.txt";
+        if (!GenerateProject(o, path)) { fprintf(stderr, "Cannot write %s\n", path.c_str()); status = 1; break; }
+        StressRow row;
+        thread t(RunStressSize, cref(path), cref(savePath), renderer, ref(row));
+        t.join();
+        if (!keep) { remove(path.c_str()); remove(savePath.c_str()); }
+        if (!row.error.empty()) { fprintf(stderr, "%s: %s\n", path.c_str(), row.error.c_str()); status = 1; break; }
+        rows.push_back(row);
+        fprintf(stderr, "%d blocks done\n", n);
+    }
+    PrintStressTable(rows);
+
+    if (!outPath.empty()) {
+        ofstream out(outPath);
+        if (out) WriteStressJson(out, opt, rows);
+        else { fprintf(stderr, "Cannot write %s\n", outPath.c_str()); status = 1; }
+    }
+    CloseFonts();
+    SDL_DestroyRenderer(renderer);
+    SDL_FreeSurface(frame);
+    TTF_Quit();
+    SDL_Quit();
+    return status;
+}
@@ -1,102 +1,926 @@
+// ==================== HISTORY FILE ====================
+// Append-only binary log of every undo entry (and periodic checkpoints),
+// next to the project file, or in the temp directory for an untitled one.
+// If it cannot be created the whole history stays in memory instead. Blocks are named by undoId; a block that is no
+// longer alive when an old entry is read back is re-created from the type,
+// category and base label stored with the entry.
+
+string historyFileName() {
+#ifdef _WIN32
+    long pid = GetCurrentProcessId();
+#else
+    long pid = getpid();
+#endif
+    string name = projectPath;
+    if (name.empty()) {
+#ifdef _WIN32
+        char dir[MAX_PATH + 1];
+        DWORD n = GetTempPathA(sizeof dir, dir);
+        name = string(dir, n > sizeof dir ? 0 : n) + "untitled";
+#else
+        const char* dir = getenv("TMPDIR");
+        name = string(dir && *dir ? dir : "/tmp") + "/untitled";
+#endif
+    }
+    name += "." + to_string(pid);
+    if (historySerial > 1) name += "-" + to_string(historySerial);
+    return name + ".history";
+}
+
+void openHistoryFile() {
+    static atomic<int> historyFilesOpened(0);
+    if (historyInMemory) return;
+    if (historyFile.is_open()) {
+        string path = historyFileName();
+        if (path == historyPath) return;
+        // The project was saved or loaded under a new name: the history moves next to it
+        historyFile.close();
+        historyIndex.close();
+        if (rename(historyPath.c_str(), path.c_str()) == 0) {
+            if (rename((historyPath + ".index").c_str(), (path + ".index").c_str()) == 0) historyPath = path;
+            else rename(path.c_str(), historyPath.c_str());
+        }
+        historyFile.open(historyPath, ios::in | ios::out | ios::binary);
+        historyIndex.open(historyPath + ".index", ios::in | ios::out | ios::binary);
+    } else {
+        historySerial = ++historyFilesOpened;
+        historyPath = historyFileName();
+        historyFile.open(historyPath, ios::in | ios::out | ios::binary | ios::trunc);
+        historyIndex.open(historyPath + ".index", ios::in | ios::out | ios::binary | ios::trunc);
+        historyEnd = 0;
+    }
+    historyAppending = false;
+    indexPutAt = -1;
+    if (historyFile.is_open() && historyIndex.is_open()) return;
+    if (historyEnd == 0) {
+        // Nothing spilled yet: keep every entry in memory from now on
+        historyFile.close();
+        historyIndex.close();
+        remove(historyPath.c_str());
+        remove((historyPath + ".index").c_str());
+        historyInMemory = true;
+        setError("Cannot write history file " + historyPath + ", keeping the history in memory");
+    } else {
+        setError("Cannot write history file " + historyPath);
+    }
+}
+
+void closeHistoryFile() {
+    historyInMemory = false;   // the next project tries the file again
+    if (!historyFile.is_open()) return;
+    historyFile.close();
+    historyIndex.close();
+    remove(historyPath.c_str());
+    remove((historyPath + ".index").c_str());
+    historyPath.clear();
+    historyEnd = 0;
+}
+
+// Appends go through histWrite and reads through histRead, so both ends are
+// known without asking the stream: a length read back is checked against them
+void histWrite(const void* p, size_t n) {
+    if (!historyFile.write((const char*)p, n)) return;
+    historyEnd += n;
+}
+void histRead(void* p, size_t n) {
+    historyFile.read((char*)p, n);
+    histReadPos += n;
+}
+streamoff histAppendAt() {
+    openHistoryFile();
+    if (!historyAppending) { historyFile.seekp(historyEnd); historyAppending = true; }
+    return historyEnd;
+}
+void histSeek(streamoff at) {
+    historyAppending = false;
+    historyFile.clear();
+    historyFile.seekg(at);
+    histReadPos = at;
+}
+
+void histPutInt(long long v) { histWrite(&v, sizeof v); }
+void histPutStr(const string& s) { histPutInt(s.size()); histWrite(s.data(), s.size()); }
+long long histGetInt() { long long v = 0; histRead(&v, sizeof v); return v; }
+string histGetStr() {
+    long long n = histGetInt();
+    if (n <= 0 || !historyFile) return "";
+    if (n > historyEnd - histReadPos) { historyFile.setstate(ios::failbit); return ""; }
+    string s(n, '\0');
+    histRead(&s[0], n);
+    return s;
+}
+
+// Index records: five numbers per entry, entry n at n * UNDO_RECORD_SIZE
+const int UNDO_RECORD_SIZE = 5 * sizeof(long long);
+
+void putUndoRecord(int n, const UndoRecord& rec) {
+    long long v[5] = { rec.offset, rec.checkpointAt, rec.checkpointCost, rec.cost, rec.costSince };
+    streamoff at = (streamoff)n * UNDO_RECORD_SIZE;
+    if (indexPutAt != at) { historyIndex.clear(); historyIndex.seekp(at); }
+    historyIndex.write((const char*)v, sizeof v);
+    indexPutAt = at + sizeof v;
+}
+
+// Record of entry n, from memory or read back from the index
+UndoRecord undoRecordAt(int n) {
+    if (n >= recordFirst && n < recordFirst + (int)undoRecords.size()) return undoRecords[n - recordFirst];
+    UndoRecord rec;
+    long long v[5] = { -1, -1, 0, 1, 0 };
+    indexPutAt = -1;
+    historyIndex.clear();
+    historyIndex.seekg((streamoff)n * UNDO_RECORD_SIZE);
+    if (!historyIndex.read((char*)v, sizeof v)) setError("History file is damaged: " + historyPath);
+    rec.offset = v[0]; rec.checkpointAt = v[1]; rec.checkpointCost = v[2]; rec.cost = v[3]; rec.costSince = v[4];
+    return rec;
+}
+
+// Description of entry n; every entry starts with it in the history file
+string historyDescription(int n) {
+    if (n >= historyFirst && n < historyFirst + (int)historyLog.size()) return historyLog[n - historyFirst].description;
+    UndoRecord rec = undoRecordAt(n);
+    if (!historyFile.is_open() || rec.offset < 0) return "state " + to_string(n);
+    histSeek(rec.offset);
+    string desc = histGetStr();
+    return historyFile ? desc : "state " + to_string(n);
+}
+
+int undoIdOf(const BlockRef& b) {
+    if (!b) return 0;
+    if (b->undoId == 0) b->undoId = ++nextUndoBlockId;
+    return b->undoId;
+}
+
+// The blocks a record refers to, with what is needed to re-create them
+void histPutBlockTable(const vector<BlockRef>& refs) {
+    histPutInt(refs.size());
+    for (auto& b : refs) {
+        histPutInt(undoIdOf(b));
+        histPutInt(b->type);
+        histPutInt(b->category);
+        histPutStr(b->baseLabel);
+        histPutInt(b->owner);
+    }
+}
+
+void histNoteRef(vector<BlockRef>& refs, unsigned mark, const BlockRef& b) {
+    if (!b || b->undoMark == mark) return;
+    b->undoMark = mark;
+    refs.push_back(b);
+}
+
+void histPutFields(const BlockFields& f) {
+    histPutStr(f.label);
+    histPutStr(f.strValue);
+    histPutInt(f.value); histPutInt(f.value2);
+    histPutInt(f.rect.x); histPutInt(f.rect.y); histPutInt(f.rect.w); histPutInt(f.rect.h);
+    histPutInt(undoIdOf(f.next));
+    histPutInt(undoIdOf(f.prev.lock()));
+}
+
+void histPutVariable(const Variable& v) {
+    histPutStr(v.name);
+    histPutInt(v.value); histPutInt(v.isShown); histPutInt(v.alive);
+}
+
+void histPutSprite(const Sprite& s) {
+    histPutInt(s.currentCostumeIndex); histPutInt(s.isVisible);
+    histWrite(&s.size, sizeof(double));
+    histWrite(&s.direction, sizeof(double));
+    histWrite(&s.scratchx, sizeof(double));
+    histWrite(&s.scratchy, sizeof(double));
+    histPutInt(s.penDown); histPutInt(s.penSize);
+    histPutInt(s.penColor.r); histPutInt(s.penColor.g); histPutInt(s.penColor.b); histPutInt(s.penColor.a);
+    histPutStr(s.message); histPutInt(s.messageUntil); histPutInt(s.isThinking);
+}
+
+streamoff writeUndoEntry(const UndoEntry& e, const string& desc) {
+    streamoff at = histAppendAt();
+    histPutStr(desc);
+    vector<BlockRef> refs;
+    unsigned mark = ++undoMarkSerial;
+    for (auto& d : e.blocks) {
+        histNoteRef(refs, mark, d.block);
+        histNoteRef(refs, mark, d.before.next); histNoteRef(refs, mark, d.before.prev.lock());
+        histNoteRef(refs, mark, d.after.next); histNoteRef(refs, mark, d.after.prev.lock());
+    }
+    for (auto& p : e.plate) histNoteRef(refs, mark, p.block);
+    histPutBlockTable(refs);
+    histPutInt(e.blocks.size());
+    for (auto& d : e.blocks) {
+        histPutInt(undoIdOf(d.block));
+        histPutInt(d.listedBefore); histPutInt(d.listedAfter);
+        histPutFields(d.before);
+        histPutFields(d.after);
+    }
+    histPutInt(e.plate.size());
+    for (auto& p : e.plate) { histPutInt(undoIdOf(p.block)); histPutInt(p.index); histPutInt(p.insert); }
+    histPutInt(e.variables.size());
+    for (auto& d : e.variables) { histPutVariable(d.before); histPutVariable(d.after); }
+    histPutInt(e.sprites.size());
+    for (auto& d : e.sprites) { histPutInt(d.index); histPutSprite(d.before); histPutSprite(d.after); }
+    histPutInt(e.backdropBefore); histPutInt(e.backdropAfter);
+    return at;
+}
+
+streamoff writeCheckpoint(const UndoCheckpoint& cp) {
+    streamoff at = histAppendAt();
+    vector<BlockRef> refs;
+    unsigned mark = ++undoMarkSerial;
+    for (size_t i = 0; i < cp.blocks.size(); i++) {
+        histNoteRef(refs, mark, cp.blocks[i]);
+        histNoteRef(refs, mark, cp.fields[i].next);
+        histNoteRef(refs, mark, cp.fields[i].prev.lock());
+    }
+    histPutBlockTable(refs);
+    histPutInt(cp.blocks.size());
+    for (size_t i = 0; i < cp.blocks.size(); i++) {
+        histPutInt(undoIdOf(cp.blocks[i]));
+        histPutFields(cp.fields[i]);
+    }
+    histPutInt(cp.variables.size());
+    for (auto& v : cp.variables) histPutVariable(v);
+    histPutInt(cp.sprites.size());
+    for (auto& sp : cp.sprites) histPutSprite(sp);
+    histPutInt(cp.backdropIndex);
+    return at;
+}
+
+// Blocks known by undoId while reading records back: the plate, blocks the
+// in-memory entries hold, and blocks re-created along the way
+void buildUndoResolver(map<int, BlockRef>& known) {
+    auto add = [&](const BlockRef& b) { if (b && b->undoId) known[b->undoId] = b; };
+    for (auto& b : scriptBlocks) add(b);
+    for (auto& e : undoStack) {
+        for (auto& d : e.blocks) {
+            add(d.block);
+            add(d.before.next); add(d.before.prev.lock());
+            add(d.after.next); add(d.after.prev.lock());
+        }
+    }
+}
+
+// Reads a block table, re-creating blocks that are gone; returns id -> block
+map<int, BlockRef> histGetBlockTable(map<int, BlockRef>& known) {
+    map<int, BlockRef> table;
+    long long n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) {
+        int id = histGetInt();
+        BlockType type = (BlockType)histGetInt();
+        Category category = (Category)histGetInt();
+        string baseLabel = histGetStr();
+        int owner = histGetInt();
+        auto it = known.find(id);
+        if (it == known.end()) {
+            auto b = NewBlock();
+            b->type = type;
+            b->category = category;
+            b->baseLabel = baseLabel;
+            b->color = getCategoryColor(category);
+            b->inPalette = false;
+            b->value = 0;
+            b->owner = owner;
+            b->undoId = id;
+            it = known.insert(make_pair(id, b)).first;
+        }
+        table[id] = it->second;
+    }
+    return table;
+}
+
+BlockFields histGetFields(map<int, BlockRef>& table) {
+    BlockFields f;
+    f.label = histGetStr();
+    f.strValue = histGetStr();
+    f.value = histGetInt(); f.value2 = histGetInt();
+    f.rect.x = histGetInt(); f.rect.y = histGetInt(); f.rect.w = histGetInt(); f.rect.h = histGetInt();
+    int next = histGetInt(), prev = histGetInt();
+    if (next) f.next = table[next];
+    if (prev) f.prev = table[prev];
+    return f;
+}
+
+Variable histGetVariable() {
+    Variable v;
+    v.name = histGetStr();
+    v.value = histGetInt(); v.isShown = histGetInt(); v.alive = histGetInt();
+    v.rect = {0, 0, 0, 0};
+    return v;
+}
+
+Sprite histGetSprite() {
+    Sprite s;
+    s.currentCostumeIndex = histGetInt(); s.isVisible = histGetInt();
+    histRead(&s.size, sizeof(double));
+    histRead(&s.direction, sizeof(double));
+    histRead(&s.scratchx, sizeof(double));
+    histRead(&s.scratchy, sizeof(double));
+    s.penDown = histGetInt(); s.penSize = histGetInt();
+    s.penColor.r = histGetInt(); s.penColor.g = histGetInt(); s.penColor.b = histGetInt(); s.penColor.a = histGetInt();
+    s.message = histGetStr(); s.messageUntil = histGetInt(); s.isThinking = histGetInt();
+    return s;
+}
+
+bool readUndoEntry(streamoff at, UndoEntry& e, map<int, BlockRef>& known) {
+    if (!historyFile.is_open() || at < 0) return false;
+    histSeek(at);
+    histGetStr();   // the description
+    auto table = histGetBlockTable(known);
+    long long n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) {
+        BlockDelta d;
+        d.block = table[histGetInt()];
+        d.listedBefore = histGetInt(); d.listedAfter = histGetInt();
+        d.before = histGetFields(table);
+        d.after = histGetFields(table);
+        if (d.block) e.blocks.push_back(d);
+    }
+    n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) {
+        PlateEdit p;
+        p.block = table[histGetInt()];
+        p.index = histGetInt();
+        p.insert = histGetInt();
+        if (p.block) e.plate.push_back(p);
+    }
+    n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) {
+        VariableDelta d;
+        d.before = histGetVariable();
+        d.after = histGetVariable();
+        e.variables.push_back(d);
+    }
+    n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) {
+        SpriteDelta d;
+        d.index = histGetInt();
+        d.before = histGetSprite();
+        d.after = histGetSprite();
+        e.sprites.push_back(d);
+    }
+    e.backdropBefore = histGetInt(); e.backdropAfter = histGetInt();
+    if (!historyFile) { setError("History file is damaged: " + historyPath); return false; }
+    return true;
+}
+
+bool readCheckpoint(streamoff at, UndoCheckpoint& cp, map<int, BlockRef>& known) {
+    if (!historyFile.is_open() || at < 0) return false;
+    histSeek(at);
+    auto table = histGetBlockTable(known);
+    long long n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) {
+        auto b = table[histGetInt()];
+        BlockFields f = histGetFields(table);
+        if (!b) continue;
+        cp.blocks.push_back(b);
+        cp.fields.push_back(f);
+    }
+    n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) cp.variables.push_back(histGetVariable());
+    n = histGetInt();
+    for (long long i = 0; i < n && historyFile; i++) cp.sprites.push_back(histGetSprite());
+    cp.backdropIndex = histGetInt();
+    if (!historyFile) { setError("History file is damaged: " + historyPath); return false; }
+    return true;
+}
+
+// Entry n, read back from the file into the in-memory window if needed.
+// The window stays contiguous; a far jump starts a new one.
+UndoEntry* undoEntryAt(int n, map<int, BlockRef>& known, bool& resolverBuilt) {
+    if (n < 0 || n >= undoCount) return nullptr;
+    int last = undoFirst + (int)undoStack.size() - 1;
+    if (n >= undoFirst && n <= last) return &undoStack[n - undoFirst];
+    if (!resolverBuilt) { buildUndoResolver(known); resolverBuilt = true; }
+    if (undoStack.empty() || n < undoFirst - UNDO_MEMORY || n > last + UNDO_MEMORY) {
+        undoStack.clear();
+        undoFirst = n;
+        last = n - 1;
+    }
+    while (n < undoFirst) {
+        UndoEntry e;
+        if (!readUndoEntry(undoRecordAt(undoFirst - 1).offset, e, known)) return nullptr;
+        undoStack.push_front(move(e));
+        undoFirst--;
+        if ((int)undoStack.size() > UNDO_MEMORY) undoStack.pop_back();
+    }
+    while (n > undoFirst + (int)undoStack.size() - 1) {
+        UndoEntry e;
+        if (!readUndoEntry(undoRecordAt(undoFirst + undoStack.size()).offset, e, known)) return nullptr;
+        undoStack.push_back(move(e));
+        if ((int)undoStack.size() > UNDO_MEMORY) { undoStack.pop_front(); undoFirst++; }
+    }
+    return &undoStack[n - undoFirst];
+}
+
+// ==================== UNDO LOG ====================
+// pushState records what changed since the previous entry: the blocks the
+// edit sites reported (undoEdited, against undoBase on each block) with the
+// plate edits in order (undoPlate), and the variables and sprites that differ
+// from undoVariables / undoSprites. Undo and redo apply one entry's
+// differences backwards or forwards.
+
+// Edit sites call this for every block whose fields (label, values, rect,
+// links) they change, before the next pushState
+void NoteBlockEdited(const BlockRef& b) {
+    if (!b || b->undoEdited || !keepHistory) return;
+    b->undoEdited = true;
+    undoEdited.push_back(b);
+}
+
+// scriptBlocks is only changed through these, so undo knows the order
+void PlateInsert(int index, const BlockRef& b) {
+    index = min(index, (int)scriptBlocks.size());
+    scriptBlocks.insert(scriptBlocks.begin() + index, b);
+    if (!keepHistory) return;
+    NoteBlockEdited(b);
+    undoPlate.push_back({b, index, true});
+}
+
+void PlateErase(int index) {
+    BlockRef b = scriptBlocks[index];
+    scriptBlocks.erase(scriptBlocks.begin() + index);
+    if (!keepHistory) return;
+    NoteBlockEdited(b);
+    undoPlate.push_back({b, index, false});
+}
+
+void PlateAppend(const BlockRef& b) {
+    PlateInsert(scriptBlocks.size(), b);
+}
+
+// Removes b, looking at index first (where it was last seen)
+void PlateRemove(const BlockRef& b, int index) {
+    if (index < 0 || index >= (int)scriptBlocks.size() || scriptBlocks[index] != b)
+        index = find(scriptBlocks.begin(), scriptBlocks.end(), b) - scriptBlocks.begin();
+    if (index < (int)scriptBlocks.size()) PlateErase(index);
+}
+
+void PlateClear() {
+    while (!scriptBlocks.empty()) PlateErase(scriptBlocks.size() - 1);
+}
+
+// Edits not in an entry yet (a block still being dragged) get one before the
+// history moves, so every entry is applied to the state it was recorded from
+void commitPendingEdits() {
+    if (!undoEdited.empty()) pushState("Edited blocks");
+}
+
+// Forgets unrecorded edits (the history they would go into is being dropped)
+void clearUndoEdits() {
+    for (auto& b : undoEdited) b->undoEdited = false;
+    undoEdited.clear();
+    undoPlate.clear();
+}
+
+BlockFields blockFieldsOf(const Block& b) {
+    BlockFields f;
+    f.label = b.label;
+    f.strValue = b.strValue;
+    f.value = b.value;
+    f.value2 = b.value2;
+    f.rect = b.rect;
+    f.next = b.next;
+    f.prev = b.prev;
+    return f;
+}
+
+bool sameBlockFields(const BlockFields& a, const BlockFields& b) {
+    return a.value == b.value && a.value2 == b.value2 &&
+           a.rect.x == b.rect.x && a.rect.y == b.rect.y && a.rect.w == b.rect.w && a.rect.h == b.rect.h &&
+           a.next == b.next && a.prev.lock() == b.prev.lock() &&
+           a.label == b.label && a.strValue == b.strValue;
+}
+
+bool sameVariable(const Variable& a, const Variable& b) {
+    return a.alive == b.alive && a.value == b.value && a.isShown == b.isShown && a.name == b.name;
+}
+
+bool sameSpriteState(const Sprite& a, const Sprite& b) {
+    return a.currentCostumeIndex == b.currentCostumeIndex && a.isVisible == b.isVisible &&
+           a.size == b.size && a.direction == b.direction &&
+           a.scratchx == b.scratchx && a.scratchy == b.scratchy &&
+           a.penDown == b.penDown && a.penSize == b.penSize &&
+           a.penColor.r == b.penColor.r && a.penColor.g == b.penColor.g &&
+           a.penColor.b == b.penColor.b && a.penColor.a == b.penColor.a &&
+           a.message == b.message && a.messageUntil == b.messageUntil && a.isThinking == b.isThinking;
+}
+
+void applySpriteState(Sprite& sp, const Sprite& s) {
+    sp.currentCostumeIndex = s.currentCostumeIndex;
+    sp.isVisible = s.isVisible;
+    sp.size = s.size;
+    sp.direction = s.direction;
+    sp.scratchx = s.scratchx;
+    sp.scratchy = s.scratchy;
+    sp.penDown = s.penDown;
+    sp.penColor = s.penColor;
+    sp.penSize = s.penSize;
+    sp.message = s.message;
+    sp.messageUntil = s.messageUntil;
+    NoteMessageUntil(sp.messageUntil);
+    sp.isThinking = s.isThinking;
+}
+
+// Blocks: the reported ones whose fields or plate membership changed, and
+// the plate edits as they happened. A block taken out and put back (dropped
+// stacks go to the end of scriptBlocks) is kept even if nothing else changed.
+void diffBlocks(UndoEntry& e) {
+    vector<bool> onPlateEdit(undoEdited.size(), false), listed(undoEdited.size());
+    for (size_t k = 0; k < undoEdited.size(); k++) {
+        undoEdited[k]->undoDelta = k;
+        listed[k] = undoEdited[k]->undoListed;
+    }
+    for (auto& p : undoPlate) {
+        int k = p.block->undoDelta;
+        onPlateEdit[k] = true;
+        listed[k] = p.insert;
+    }
+    for (size_t k = 0; k < undoEdited.size(); k++) {
+        Block& b = *undoEdited[k];
+        b.undoEdited = false;
+        b.undoDelta = -1;
+        BlockFields now = blockFieldsOf(b);
+        if (!b.undoListed && !listed[k]) continue;   // never made it onto the plate
+        if (!onPlateEdit[k] && sameBlockFields(b.undoBase, now)) continue;
+        BlockDelta d;
+        d.block = undoEdited[k];
+        d.listedBefore = b.undoListed;
+        d.listedAfter = listed[k];
+        d.before = b.undoBase;
+        d.after = now;
+        b.undoBase = now;
+        b.undoListed = listed[k];
+        e.blocks.push_back(move(d));
+    }
+    // all plate edits are kept, also those of a block that came and went:
+    // the indexes of the others count it
+    e.plate.swap(undoPlate);
+    undoEdited.clear();
+}
+
+void diffVariables(UndoEntry& e) {
+    if (undoEpoch != symbolEpoch) {
+        // Slots were dropped (load / new project): match by name
+        for (auto& old : undoVariables) {
+            if (!old.alive) continue;
+            int slot = lookupSymbol(old.name);
+            VariableDelta d;
+            d.before = old;
+            if (slot != -1) d.after = variables[slot];
+            else { d.after = old; d.after.alive = false; }
+            if (!sameVariable(d.before, d.after)) e.variables.push_back(d);
+        }
+        for (auto& v : variables) {
+            if (!v.alive) continue;
+            bool known = false;
+            for (auto& old : undoVariables) if (old.alive && old.name == v.name) { known = true; break; }
+            if (known) continue;
+            VariableDelta d;
+            d.before = v;
+            d.before.alive = false;
+            d.after = v;
+            e.variables.push_back(d);
+        }
+    } else {
+        for (size_t slot = 0; slot < variables.size(); slot++) {
+            const Variable& now = variables[slot];
+            if (slot < undoVariables.size()) {
+                if (sameVariable(undoVariables[slot], now)) continue;
+                e.variables.push_back({undoVariables[slot], now});
+            } else if (now.alive) {
+                VariableDelta d;
+                d.before = now;
+                d.before.alive = false;
+                d.after = now;
+                e.variables.push_back(d);
+            }
+        }
+    }
+    undoVariables = variables;
+    undoEpoch = symbolEpoch;
+}
+
+shared_ptr<UndoCheckpoint> makeCheckpoint() {
+    auto cp = make_shared<UndoCheckpoint>();
+    cp->blocks = scriptBlocks;
+    cp->fields.reserve(scriptBlocks.size());
+    for (auto& b : scriptBlocks) cp->fields.push_back(blockFieldsOf(*b));
+    for (auto& v : variables) if (v.alive) cp->variables.push_back(v);
+    cp->sprites.reserve(allSprites.size());
+    for (auto& sp : allSprites) cp->sprites.push_back(sp.cloneState());
+    cp->backdropIndex = mainStage.currentBackdropIndex;
+    return cp;
+}
+
 void pushState(const string& actionDesc) {
-    vector<shared_ptr<Block>> blocksClone;
-    for (auto& b : scriptBlocks) {
-        blocksClone.push_back(b->clone());
-    }
-    State s;
-    s.scriptBlocks = blocksClone;
-    s.sprite = allSprites[0].cloneState();
-    s.variables = variables;
-    s.backdropIndex = mainStage.currentBackdropIndex;
-
-    // If we're not at the end of the stack, remove future states AND their history entries
-    if ((int)undoStack.size() > undoIndex + 1) {
-        // Remove history entries that point to states beyond undoIndex
-        historyLog.erase(
-            remove_if(historyLog.begin(), historyLog.end(),
-                [](const HistoryItem& h){ return h.stateIndex > undoIndex; }),
-            historyLog.end()
-        );
-        undoStack.erase(undoStack.begin() + undoIndex + 1, undoStack.end());
-    }
-    undoStack.push_back(s);
-    if (undoStack.size() > MAX_UNDO) {
-        undoStack.erase(undoStack.begin());
-        if (undoIndex > 0) undoIndex--;
-        // Fix history stateIndex references
-        for (auto& h : historyLog) if (h.stateIndex > 0) h.stateIndex--;
-    }
-    undoIndex = undoStack.size() - 1;
+    if (!keepHistory) return;
+    UndoEntry e;
+    diffBlocks(e);
+    diffVariables(e);
+    // Sprites are compared in place and only changed ones copied, so an
+    // entry stays cheap with many sprites; new sprites just start a baseline
+    if (undoSprites.size() > allSprites.size()) undoSprites.resize(allSprites.size());
+    for (size_t i = 0; i < allSprites.size(); i++) {
+        if (i == undoSprites.size()) { undoSprites.push_back(allSprites[i].cloneState()); continue; }
+        if (sameSpriteState(undoSprites[i], allSprites[i])) continue;
+        SpriteDelta d;
+        d.index = i;
+        d.before = undoSprites[i];
+        d.after = allSprites[i].cloneState();
+        undoSprites[i] = d.after;
+        e.sprites.push_back(move(d));
+    }
+    e.backdropBefore = undoBackdrop;
+    e.backdropAfter = undoBackdrop = mainStage.currentBackdropIndex;
+
+    // If we're not at the end of the history, drop the undone entries and their items
+    if (undoCount > undoIndex + 1) {
+        while (!historyLog.empty() && historyLog.back().stateIndex > undoIndex) historyLog.pop_back();
+        while (!undoRecords.empty() && recordFirst + (int)undoRecords.size() - 1 > undoIndex) undoRecords.pop_back();
+        undoCount = undoIndex + 1;
+        while (!undoStack.empty() && undoFirst + (int)undoStack.size() - 1 > undoIndex) undoStack.pop_back();
+    }
+    // The windows must end right before the new entry
+    if (undoFirst + (int)undoStack.size() != undoCount) {
+        undoStack.clear();
+        undoFirst = undoCount;
+    }
+    if (undoRecords.empty()) recordFirst = undoCount;
+
+    UndoRecord rec;
+    rec.cost = undoEntryCost(e);
+    openHistoryFile();
+    if (!historyInMemory) rec.offset = writeUndoEntry(e, actionDesc);
+    // Keep a full checkpoint once replaying the entries since the last one
+    // costs as much as loading one; the first entry is where walks start from
+    if (undoCount > 0 && !historyInMemory) {
+        rec.costSince = undoRecordAt(undoCount - 1).costSince + rec.cost;
+        int size = checkpointCost();
+        if (rec.costSince >= size) {
+            rec.checkpointAt = writeCheckpoint(*makeCheckpoint());
+            rec.checkpointCost = size;
+            rec.costSince = 0;
+        }
+    }
+    undoRecords.push_back(rec);
+    undoStack.push_back(move(e));
+    if (!historyInMemory) {
+        putUndoRecord(undoCount, rec);
+        if ((int)undoRecords.size() > HISTORY_MEMORY) { undoRecords.pop_front(); recordFirst++; }
+        if ((int)undoStack.size() > UNDO_MEMORY) { undoStack.pop_front(); undoFirst++; }
+    }
+    undoIndex = undoCount++;
+    historyScroll = 0;
 
     logAction(actionDesc, undoIndex);
 }
 
-void restoreState(int idx, SDL_Renderer* renderer) {
-    if (idx < 0 || idx >= (int)undoStack.size()) return;
-    const auto& s = undoStack[idx];
-    scriptBlocks.clear();
-    for (auto& b : s.scriptBlocks) {
-        auto newb = b->clone();
-        scriptBlocks.push_back(newb);
-        UpdateBlockTexture(newb, renderer);
+// Puts recorded fields back on a block; only relabelled blocks, and blocks
+// back on the plate (their label texture went when they left), get a new texture
+void setBlockFields(Block& b, const BlockFields& f, SDL_Renderer* renderer, const BlockRef& self, bool relisted) {
+    bool relabel = relisted || b.label != f.label;
+    if (b.strValue != f.strValue) {
+        b.expr.reset(); b.expr2.reset();
+        b.eventId = -1;
     }
+    b.label = f.label;
+    b.strValue = f.strValue;
+    b.value = f.value;
+    b.value2 = f.value2;
+    b.rect = f.rect;
+    b.next = f.next;
+    b.prev = f.prev;
+    b.undoBase = f;
+    if (relabel) UpdateBlockTexture(self, renderer);
+}
+
+void applyUndoEntry(const UndoEntry& e, bool forward, SDL_Renderer* renderer) {
+    // Scripts of the touched blocks, as linked before the change
+    for (auto& d : e.blocks) InvalidateScript(d.block);
+
+    // Plate edits: replayed in order, or each inverted in reverse order
+    auto replay = [](const PlateEdit& p, bool insert) {
+        if (insert) {
+            scriptBlocks.insert(scriptBlocks.begin() + min(p.index, (int)scriptBlocks.size()), p.block);
+        } else if (p.index < (int)scriptBlocks.size() && scriptBlocks[p.index] == p.block) {
+            scriptBlocks.erase(scriptBlocks.begin() + p.index);
+        } else {
+            scriptBlocks.erase(remove(scriptBlocks.begin(), scriptBlocks.end(), p.block), scriptBlocks.end()); // defensive
+        }
+    };
+    if (forward) for (auto& p : e.plate) replay(p, p.insert);
+    else for (auto p = e.plate.rbegin(); p != e.plate.rend(); ++p) replay(*p, !p->insert);
+
+    for (auto& d : e.blocks) {
+        bool relisted = !d.block->undoListed && (forward ? d.listedAfter : d.listedBefore);
+        setBlockFields(*d.block, forward ? d.after : d.before, renderer, d.block, relisted);
+        d.block->undoListed = forward ? d.listedAfter : d.listedBefore;
+    }
+    for (auto& d : e.blocks) {
+        if (d.block->undoListed) {
+            InvalidateScript(d.block);
+            IndexHat(d.block);
+        } else {
+            UnindexHat(d.block);
+        }
+    }
+
+    for (auto& d : e.variables) {
+        const Variable& v = forward ? d.after : d.before;
+        int slot = internVariable(v.name);
+        variables[slot] = v;
+        if (slot >= (int)undoVariables.size()) undoVariables.resize(slot + 1);
+        undoVariables[slot] = v;
+        NoteVariableChanged(slot);
+    }
+    undoEpoch = symbolEpoch;
+
+    for (auto& d : e.sprites) {
+        if (d.index >= (int)allSprites.size()) continue;   // removed by a later load / new project
+        const Sprite& s = forward ? d.after : d.before;
+        if (d.index < (int)undoSprites.size()) undoSprites[d.index] = s;
+        applySpriteState(allSprites[d.index], s);
+    }
+    mainStage.currentBackdropIndex = undoBackdrop = forward ? e.backdropAfter : e.backdropBefore;
+}
+
+void applyCheckpoint(const UndoCheckpoint& cp, SDL_Renderer* renderer) {
+    unsigned mark = ++undoMarkSerial;
+    for (auto& b : cp.blocks) b->undoMark = mark;
     for (auto& b : scriptBlocks) {
-        if (b->next) b->next->prev = b;
-    }
-    Sprite& sp = allSprites[0];
-    sp.currentCostumeIndex = s.sprite.currentCostumeIndex;
-    sp.isVisible = s.sprite.isVisible;
-    sp.size = s.sprite.size;
-    sp.direction = s.sprite.direction;
-    sp.scratchx = s.sprite.scratchx;
-    sp.scratchy = s.sprite.scratchy;
-    sp.penDown = s.sprite.penDown;
-    sp.penColor = s.sprite.penColor;
-    sp.penSize = s.sprite.penSize;
-    sp.message = s.sprite.message;
-    sp.messageTimer = s.sprite.messageTimer;
-    sp.isThinking = s.sprite.isThinking;
-    variables = s.variables;
-    mainStage.currentBackdropIndex = s.backdropIndex;
-    undoIndex = idx;
+        if (b->undoMark == mark) continue;
+        b->undoListed = false;
+        UnindexHat(b);
+    }
+    scriptBlocks = cp.blocks;
+    for (size_t i = 0; i < cp.blocks.size(); i++) {
+        auto& b = cp.blocks[i];
+        setBlockFields(*b, cp.fields[i], renderer, b, !b->undoListed);
+        b->undoListed = true;
+        b->program.reset();
+    }
+    for (auto& b : scriptBlocks) IndexHat(b);
+    restoreVariables(cp.variables);
+    undoVariables = variables;
+    undoEpoch = symbolEpoch;
+    for (size_t i = 0; i < cp.sprites.size() && i < allSprites.size(); i++) {
+        if (i < undoSprites.size()) undoSprites[i] = cp.sprites[i];
+        applySpriteState(allSprites[i], cp.sprites[i]);
+    }
+    mainStage.currentBackdropIndex = undoBackdrop = cp.backdropIndex;
+}
+
+// Rough cost of applying an entry: the number of things it touches
+int undoEntryCost(const UndoEntry& e) {
+    return 1 + e.blocks.size() + e.variables.size() + e.sprites.size();
+}
+
+// The same for a checkpoint of the project as it is now
+int checkpointCost() {
+    return 1 + scriptBlocks.size() + variables.size() + allSprites.size();
+}
+
+void restoreState(int idx, SDL_Renderer* renderer) {
+    if (idx < 0 || idx >= undoCount || idx == undoIndex) return;
+    // Walk the entries in between, unless loading the checkpoint nearest
+    // idx and walking from there is cheaper; either search gives up as soon
+    // as it costs more than the best way found so far
+    const int far = 1 << 30;
+    int from = undoIndex, best = far;
+    for (int c = idx, cost = 0; c >= 0; c--) {
+        UndoRecord rec = undoRecordAt(c);
+        if (rec.checkpointAt >= 0) {
+            best = cost + rec.checkpointCost;
+            from = c;
+            break;
+        }
+        cost += rec.cost;
+    }
+    for (int c = idx + 1, cost = 0; c < undoCount && cost < best; c++) {
+        UndoRecord rec = undoRecordAt(c);
+        cost += rec.cost;
+        if (rec.checkpointAt >= 0) {
+            int total = cost + rec.checkpointCost;
+            if (total < best) { best = total; from = c; }
+            break;
+        }
+    }
+    int walk = 0;
+    for (int k = min(idx, undoIndex) + 1; k <= max(idx, undoIndex) && walk <= best; k++) walk += undoRecordAt(k).cost;
+    if (walk <= best) from = undoIndex;
+
+    map<int, BlockRef> known;
+    bool resolverBuilt = false;
+    if (from != undoIndex) {
+        buildUndoResolver(known);
+        resolverBuilt = true;
+        UndoCheckpoint cp;
+        if (!readCheckpoint(undoRecordAt(from).checkpointAt, cp, known)) return;
+        applyCheckpoint(cp, renderer);
+        undoIndex = from;
+    }
+    for (int k = undoIndex; k > idx; k--) {
+        UndoEntry* e = undoEntryAt(k, known, resolverBuilt);
+        if (!e) return;
+        applyUndoEntry(*e, false, renderer);
+        undoIndex = k - 1;
+    }
+    for (int k = undoIndex + 1; k <= idx; k++) {
+        UndoEntry* e = undoEntryAt(k, known, resolverBuilt);
+        if (!e) return;
+        applyUndoEntry(*e, true, renderer);
+        undoIndex = k;
+    }
 }
 
 void undo(SDL_Renderer* renderer) {
+    endRunSession();  // commit a run in progress so it is the entry being undone
+    commitPendingEdits();
     if (undoIndex > 0) {
         restoreState(undoIndex - 1, renderer);
-        string desc = (undoIndex < (int)historyLog.size()) ? historyLog[undoIndex].description : "state " + to_string(undoIndex);
-        logAction("Undo: " + desc);
+        logAction("Undo: " + historyDescription(undoIndex));
     }
 }
 
 void redo(SDL_Renderer* renderer) {
-    if (undoIndex < (int)undoStack.size() - 1) {
+    endRunSession();  // a run in progress is committed before the stack moves
+    commitPendingEdits();
+    if (undoIndex < undoCount - 1) {
         restoreState(undoIndex + 1, renderer);
-        string desc = (undoIndex < (int)historyLog.size()) ? historyLog[undoIndex].description : "state " + to_string(undoIndex);
-        logAction("Redo: " + desc);
+        logAction("Redo: " + historyDescription(undoIndex));
     }
 }
 
+// ==================== RUN SESSIONS ====================
+// A script run is one transaction: the top of the undo stack is the pre-run
+// checkpoint, blocks only count their changes, and the whole run is committed
+// as a single undo entry when it ends. Undoing it restores the pre-run state.
+
+void beginRunSession(const string& trigger) {
+    if (runSession.active) return;   // e.g. a key press while the flag scripts run
+    // Every edit is pushed where it happens, so the top of the stack is
+    // already the pre-run state; only an empty history needs a checkpoint.
+    if (undoIndex < 0) pushState(trigger);
+    runSession.active = true;
+    runSession.mutations = 0;
+    runSession.trigger = trigger;
+}
+
+void noteRunMutation(const char* desc) {
+    if (!runSession.active) {
+        if (!scriptsRunning) { pushState(desc); return; }
+        // Scripts kept running after an undo/commit: the current state is
+        // already the top of the undo stack, so it is the checkpoint.
+        runSession.active = true;
+        runSession.mutations = 0;
+        runSession.trigger = "Script run";
+    }
+    runSession.mutations++;
+}
+
+void endRunSession() {
+    if (!runSession.active) return;
+    runSession.active = false;
+    if (runSession.mutations == 0) return;  // nothing changed, the checkpoint is enough
+    pushState("Run: " + runSession.trigger + " (" + to_string(runSession.mutations) + " changes)");
+}
+
 void resetProject(SDL_Renderer* renderer) {
-    FreeBlockTextures();
     scriptBlocks.clear();
-    variables.clear();
+    resetSymbols();
+    hatIndex.clear();
     historyLog.clear();
+    historyFirst = 0;
+    historyScroll = 0;
     undoStack.clear();
+    undoFirst = 0;
+    undoRecords.clear();
+    recordFirst = 0;
+    undoCount = 0;
+    closeHistoryFile();   // the next entry starts a fresh file
+    projectPath.clear();
     undoIndex = -1;
-    flagScripts.clear(); spaceScripts.clear(); clickScripts.clear(); messageScripts.clear();
+    clearUndoEdits();
+    undoVariables.clear();
+    undoEpoch = symbolEpoch;
+    ClearScriptQueues();
     scriptsRunning = false; isPaused = false; stepRequested = false; stepModeActive = false;
+    runSession = RunSession();
     currentExecutingBlock = nullptr;
     draggedBlock = nullptr; snapCandidate = nullptr;
     editing = false; editingBlock = nullptr; editingSpriteProp = -1;
     errorMessage = ""; lastNormalLog = "";
+    TruncateSprites(1);   // a new project starts with the default sprite
+    editingTarget = allSprites.empty() ? STAGE_TARGET : 0;
     if (!allSprites.empty()) {
         Sprite& s = allSprites[0];
         s.scratchx = 0; s.scratchy = 0; s.direction = 90.0; s.size = 100.0;
-        s.isVisible = true; s.penDown = false; s.message = ""; s.messageTimer = 0;
-        s.penStrokes.clear(); s.stamps.clear();
+        s.isVisible = true; s.penDown = false; s.message = ""; s.messageUntil = 0;
     }
+    ClearPenCanvas(renderer);
     mainStage.currentBackdropIndex = 0;
+    undoSprites.clear();
+    for (auto& sp : allSprites) undoSprites.push_back(sp.cloneState());
+    undoBackdrop = 0;
     logAction("New project");
 }
 
@@ -157,14 +981,108 @@ void addBackdropFromFile(SDL_Renderer* renderer, const string& filePath, const s
     c.width = stageW;
     c.height = stageH;
     c.texture = SDL_CreateTextureFromSurface(renderer, scaled);
-    SDL_FreeSurface(scaled);
-    if (!c.texture) { setError("Failed to create backdrop texture"); return; }
+    if (!c.texture) { SDL_FreeSurface(scaled); setError("Failed to create backdrop texture"); return; }
+    c.surface = scaled;
     mainStage.backdrops.push_back(c);
     mainStage.currentBackdropIndex = (int)mainStage.backdrops.size() - 1;
     logAction("Added backdrop: " + name);
 }
 
-string showRenameDialog(SDL_Renderer* renderer, const string& currentName) {
+// The stage, its three backdrops and the default sprite the editor starts
+// with. renderer may be null (headless runs): then only the surfaces are
+// made, which is all running and sensing need.
+void CreateDefaultProject(SDL_Renderer* renderer) {
+    mainStage.rect = Stage1;
+    mainStage.currentBackdropIndex = 0;
+
+    auto createBackdrop = [&](const string& name, Uint8 r, Uint8 g, Uint8 b) {
+        Costume c;
+        c.name = name;
+        c.width = mainStage.rect.w;
+        c.height = mainStage.rect.h;
+        SDL_Surface* surf = SDL_CreateRGBSurface(0, c.width, c.height, 32, 0, 0, 0, 0);
+        SDL_FillRect(surf, NULL, SDL_MapRGB(surf->format, r, g, b));
+        c.texture = SDL_CreateTextureFromSurface(renderer, surf);
+        c.surface = surf;   // kept for color sensing
+        mainStage.backdrops.push_back(c);
+    };
+
+    createBackdrop("back1", 255, 255, 255);
+
+    auto loadBackdropFromFile = [&](const string& path, const string& name) {
+        SDL_Surface* surf = IMG_Load(path.c_str());
+        if (!surf) { createBackdrop(name, 200, 200, 200); return; }
+        int stageW = mainStage.rect.w, stageH = mainStage.rect.h;
+        SDL_Surface* converted = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGBA8888, 0);
+        SDL_FreeSurface(surf);
+        if (!converted) { createBackdrop(name, 200, 200, 200); return; }
+        SDL_Surface* scaled = SDL_CreateRGBSurfaceWithFormat(0, stageW, stageH, 32, SDL_PIXELFORMAT_RGBA8888);
+        if (!scaled) { SDL_FreeSurface(converted); createBackdrop(name, 200, 200, 200); return; }
+        SDL_BlitScaled(converted, NULL, scaled, NULL);
+        SDL_FreeSurface(converted);
+        Costume c; c.name = name; c.width = stageW; c.height = stageH;
+        c.texture = SDL_CreateTextureFromSurface(renderer, scaled);
+        if (!c.texture && renderer) { SDL_FreeSurface(scaled); createBackdrop(name, 200, 200, 200); return; }
+        c.surface = scaled;
+        mainStage.backdrops.push_back(c);
+    };
+    loadBackdropFromFile("assets/back2.jpg", "back2");
+    loadBackdropFromFile("assets/back3.jpg", "back3");
+
+    Sprite defaultSprite = Create_Sprite(1, "Cat");
+    defaultSprite.scratchx = 0; defaultSprite.scratchy = 0;
+    defaultSprite.penDown = false; defaultSprite.penColor = Orange; defaultSprite.penSize = 2;
+    defaultSprite.direction = 90.0;
+    Add_Costume_To_Sprite(renderer, defaultSprite, "Cat", "assets/catt.png");
+    allSprites.push_back(defaultSprite);
+    stageTarget = Create_Sprite(0, "Stage");
+    stageTarget.isVisible = false; stageTarget.isDraggable = false;
+}
+
+// Frees everything the calling thread's engine holds, before the thread
+// ends: its thread_local globals are destroyed in no fixed order, so by then
+// none of them may still reference a block, a costume or the arena.
+void ReleaseEngine() {
+    ClearScriptQueues();
+    scriptsRunning = false;
+    currentExecutingBlock = nullptr;
+    draggedBlock = nullptr; snapCandidate = nullptr; clickBlock = nullptr; editingBlock = nullptr;
+    potentialDrag = false; editing = false;
+    hatIndex.clear();
+    scriptBlocks.clear();
+    paletteBlocks.clear();
+    undoStack.clear();
+    undoRecords.clear();
+    recordFirst = 0;
+    undoCount = 0;
+    clearUndoEdits();
+    undoIndex = -1;
+    closeHistoryFile();
+    TruncateSprites(0);
+    FreeSpriteCostumes(stageTarget);
+    for (auto& c : mainStage.backdrops) {
+        if (c.surface) SDL_FreeSurface(c.surface);
+        if (c.texture) SDL_DestroyTexture(c.texture);
+    }
+    mainStage.backdrops.clear();
+    compositeBackdrop = nullptr;
+    FreePenCanvas();
+    while (labelLruTail >= 0) EvictLabelTexture(labelLruTail);   // textures of the engine's renderer
+    FreeBlockArena();
+}
+
+// New sprite on top of the others, with one costume; its scripts go on the plate
+void addSpriteFromFile(SDL_Renderer* renderer, const string& filePath, const string& name) {
+    Sprite s = Create_Sprite(allSprites.size(), name);
+    s.penColor = Orange; s.penSize = 2;
+    Add_Costume_To_Sprite(renderer, s, name, filePath.c_str());
+    if (s.costumes.empty()) { setError("Failed to load image: " + string(IMG_GetError())); return; }
+    allSprites.push_back(s);
+    SelectTarget(allSprites.size() - 1);
+    logAction("Added sprite: " + name);
+}
+
+string showRenameDialog(SDL_Renderer* renderer, const string& title, const string& currentName) {
     const int DIALOG_W = 400, DIALOG_H = 160;
     int scrW, scrH;
     SDL_GetRendererOutputSize(renderer, &scrW, &scrH);
@@ -198,7 +1116,7 @@ string showRenameDialog(SDL_Renderer* renderer, const string& currentName) {
         SDL_SetRenderDrawColor(renderer, 77,151,255,255);  SDL_RenderDrawRect(renderer, &dialogRect);
         SDL_Rect titleBar = {dialogRect.x, dialogRect.y, dialogRect.w, 35};
         SDL_SetRenderDrawColor(renderer, 77,151,255,255); SDL_RenderFillRect(renderer, &titleBar);
-        RenderText(renderer, dialogRect.x+15, dialogRect.y+8, "Rename Backdrop", {255,255,255,255});
+        RenderText(renderer, dialogRect.x+15, dialogRect.y+8, title, {255,255,255,255});
         RenderText(renderer, dialogRect.x+15, dialogRect.y+45, "New name:", {30,30,30,255});
         SDL_SetRenderDrawColor(renderer, 255,255,255,255); SDL_RenderFillRect(renderer, &inputRect);
         SDL_SetRenderDrawColor(renderer, 77,151,255,255); SDL_RenderDrawRect(renderer, &inputRect);
@@ -206,8 +1124,7 @@ string showRenameDialog(SDL_Renderer* renderer, const string& currentName) {
         // Cursor blink
         if ((SDL_GetTicks()/500) % 2 == 0) {
             if (gFont) {
-                SDL_Surface* ms = TTF_RenderUTF8_Blended(gFont, inputStr.c_str(), {0,0,0,255});
-                int tw = ms ? ms->w : 0; if (ms) SDL_FreeSurface(ms);
+                int tw = TextWidth(inputStr, FONT_UI);
                 SDL_SetRenderDrawColor(renderer, 0,0,0,255);
                 SDL_RenderDrawLine(renderer, inputRect.x+7+tw, inputRect.y+5, inputRect.x+7+tw, inputRect.y+inputRect.h-5);
             }
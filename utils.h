@@ -3,20 +3,81 @@
 // ali_utils.h — Ali Dehghan
 // Undo/Redo, Dialogs & Project Lifecycle
 // ============================================================
-// State snapshot system (pushState/restoreState), undo/redo,
-// project reset, backdrop loading, and all modal dialogs.
-// Style: snapshot-based state management, defensive checks,
+// Delta undo log (pushState/restoreState) spilled to an
+// append-only history file with periodic checkpoints, undo/redo,
+// script run sessions (one undo entry per run), project reset,
+// backdrop loading, and all modal dialogs.
+// Style: delta-based state management, defensive checks,
 //        consistent comments, moderate abstraction.
 // ============================================================
 
+string historyFileName();
+void openHistoryFile();
+void closeHistoryFile();
+void histWrite(const void* p, size_t n);
+void histRead(void* p, size_t n);
+streamoff histAppendAt();
+void histSeek(streamoff at);
+void histPutInt(long long v);
+void histPutStr(const string& s);
+long long histGetInt();
+string histGetStr();
+void putUndoRecord(int n, const UndoRecord& rec);
+UndoRecord undoRecordAt(int n);
+string historyDescription(int n);
+int  undoIdOf(const BlockRef& b);
+void histPutBlockTable(const vector<BlockRef>& refs);
+void histNoteRef(vector<BlockRef>& refs, unsigned mark, const BlockRef& b);
+void histPutFields(const BlockFields& f);
+void histPutVariable(const Variable& v);
+void histPutSprite(const Sprite& s);
+streamoff writeUndoEntry(const UndoEntry& e, const string& desc);
+streamoff writeCheckpoint(const UndoCheckpoint& cp);
+void buildUndoResolver(map<int, BlockRef>& known);
+map<int, BlockRef> histGetBlockTable(map<int, BlockRef>& known);
+BlockFields histGetFields(map<int, BlockRef>& table);
+Variable histGetVariable();
+Sprite histGetSprite();
+bool readUndoEntry(streamoff at, UndoEntry& e, map<int, BlockRef>& known);
+bool readCheckpoint(streamoff at, UndoCheckpoint& cp, map<int, BlockRef>& known);
+UndoEntry* undoEntryAt(int n, map<int, BlockRef>& known, bool& resolverBuilt);
+
+void NoteBlockEdited(const BlockRef& b);
+void PlateInsert(int index, const BlockRef& b);
+void PlateErase(int index);
+void PlateAppend(const BlockRef& b);
+void PlateRemove(const BlockRef& b, int index);
+void PlateClear();
+void clearUndoEdits();
+void commitPendingEdits();
+BlockFields blockFieldsOf(const Block& b);
+bool sameBlockFields(const BlockFields& a, const BlockFields& b);
+bool sameVariable(const Variable& a, const Variable& b);
+bool sameSpriteState(const Sprite& a, const Sprite& b);
+void applySpriteState(Sprite& sprite, const Sprite& s);
+void diffBlocks(UndoEntry& e);
+void diffVariables(UndoEntry& e);
+shared_ptr<UndoCheckpoint> makeCheckpoint();
 void pushState(const string& actionDesc);
+void setBlockFields(Block& b, const BlockFields& f, SDL_Renderer* renderer, const BlockRef& self, bool relisted);
+void applyUndoEntry(const UndoEntry& e, bool forward, SDL_Renderer* renderer);
+void applyCheckpoint(const UndoCheckpoint& cp, SDL_Renderer* renderer);
+int  undoEntryCost(const UndoEntry& e);
+int  checkpointCost();
 void restoreState(int idx, SDL_Renderer* renderer);
 void undo(SDL_Renderer* renderer);
 void redo(SDL_Renderer* renderer);
 
+void beginRunSession(const string& trigger);
+void noteRunMutation(const char* desc);
+void endRunSession();
+
 void resetProject(SDL_Renderer* renderer);
 bool showNewFileDialog(SDL_Renderer* renderer);
+void CreateDefaultProject(SDL_Renderer* renderer);
+void ReleaseEngine();
 void addBackdropFromFile(SDL_Renderer* renderer, const string& filePath, const string& name);
-string showRenameDialog(SDL_Renderer* renderer, const string& currentName);
+void addSpriteFromFile(SDL_Renderer* renderer, const string& filePath, const string& name);
+string showRenameDialog(SDL_Renderer* renderer, const string& title, const string& currentName);
 void showAboutDialog(SDL_Renderer* renderer);
 bool showExitDialog(SDL_Renderer* renderer);